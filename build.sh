@@ -2,7 +2,17 @@
 
 echo "Starting build"
 
-CFLAGS="-g -std=c++11 -DBUILD_INTERNAL=1 -DBUILD_SLOW=1 -Wno-write-strings"
+# Add -DBUILD_GENERIC_DISPATCH=1 to EXTRA_CFLAGS to use the old switch-based
+# dispatch instead of the per-opcode handler table
+CFLAGS="-g -std=c++11 -fno-exceptions -DBUILD_INTERNAL=1 -DBUILD_SLOW=1 -Wno-write-strings $EXTRA_CFLAGS"
 LFLAGS="$(pkg-config --cflags --libs x11) -ldl -lpthread"
 
 gcc $CFLAGS ../vm/linux_vm.cpp $LFLAGS -o os
+gcc $CFLAGS ../vm/digest_diff.cpp -ldl -lpthread -o digest_diff
+gcc $CFLAGS ../vm/metrics_reader.cpp -ldl -lpthread -o metrics_reader
+
+# Headless benchmarks, optimized since that's what they're for. Run from data/
+gcc -O2 $CFLAGS ../vm/bench.cpp -ldl -lpthread -lm -o bench
+
+# Headless batch runs of many programs on all cores, see batch.cpp
+gcc -O2 $CFLAGS ../vm/batch.cpp -ldl -lpthread -o batch
@@ -0,0 +1,110 @@
+// Checks the flag instructions (BIT, PHP, PLP, SEC/SED/SEI, CLD/CLI/CLV,
+// BMI/BPL/BVC/BVS), STX/STY and JMP (ind). Every check leaves a byte at
+// $10 and up, the comment next to the store says what it should be.
+// $1F is only set at the very end.
+
+  // PHP pushes the status with B and bit 5 set
+  clc
+  lda #0
+  php
+  pla
+  sta $10         // $32: bit 5, B, Z
+
+  // SEC, SED and SEI
+  sec
+  sed
+  sei
+  lda #$80
+  php
+  pla
+  sta $11         // $BD: N, bit 5, B, D, I, C
+
+  // PLP takes every flag, CLD, CLI and CLV clear theirs
+  lda #$FF
+  pha
+  plp
+  cld
+  cli
+  clv
+  php
+  pla
+  sta $12         // $B3: N, bit 5, B, Z, C
+
+  // BIT: N and V from bits 7 and 6 of memory, Z from A AND memory
+  lda #$C0
+  sta $20
+  clc
+  lda #$01
+  bit $20
+  php
+  pla
+  sta $13         // $F2: N, V, bit 5, B, Z
+
+  // Branches on N and V, taken and not taken. Each one that goes the
+  // right way counts one in X. INX changes N, so every branch sets its
+  // flag again first
+  ldx #0
+  lda #$80
+  bpl bpl_done    // not taken
+  inx
+bpl_done:
+  lda #$80
+  bmi bmi_taken   // taken
+  jmp bmi_done
+bmi_taken:
+  inx
+bmi_done:
+  lda #$01
+  bmi bmi_done2   // not taken
+  inx
+bmi_done2:
+  lda #$01
+  bpl bpl_taken   // taken
+  jmp bpl_done2
+bpl_taken:
+  inx
+bpl_done2:
+  clv
+  bvs bvs_done    // not taken
+  inx
+bvs_done:
+  clv
+  bvc bvc_taken   // taken
+  jmp bvc_done
+bvc_taken:
+  inx
+bvc_done:
+  bit $20
+  bvc bvc_done2   // not taken
+  inx
+bvc_done2:
+  bit $20
+  bvs bvs_taken   // taken
+  jmp bvs_done2
+bvs_taken:
+  inx
+bvs_done2:
+  stx $14         // $08
+
+  // STX and STY
+  ldx #$5A
+  ldy #$A5
+  stx $15         // $5A
+  sty $16         // $A5
+
+  // JMP (ind) goes where the pointer points. jump_back puts its return
+  // address in $30/$31 and jumps through it, which lands right here
+  jsr jump_back
+  lda #$01
+  sta $17         // $01
+
+  lda #$01
+  sta $1F         // $01
+  end
+
+jump_back:
+  pla
+  sta $30
+  pla
+  sta $31
+  jmp ($30)
@@ -0,0 +1,29 @@
+// PLP keeps B and bit 5 out of the status, so an NMI taken after php/plp
+// pushes B as 0. The handler leaves the P it finds on the stack at $10.
+// $1F is only set at the very end.
+
+  lda #<nmi
+  sta $FFFA
+  lda #>nmi
+  sta $FFFB
+  clc
+  php
+  plp
+  lda #$80
+  sta $FE00       // NMI on the next vblank
+wait:
+  lda $11
+  beq wait
+  lda #0
+  sta $FE00
+  lda #$01
+  sta $1F         // $01
+  end
+
+nmi:
+  pla
+  sta $10         // $22: bit 5 and Z from the wait loop, no B
+  pha
+  lda #$01
+  sta $11
+  rti
@@ -13,6 +13,10 @@ define  ball_display_h  $07
 define  max_y   192
 define  max_x_l 23    // = 279 - 256
 define  screen_half_x   140
+define  frame   $08
+define  video_control   $fe00
+define  nmi_vector      $fffa
+define  nmi_vector_h    $fffb
 
 
   jsr init
@@ -23,11 +27,19 @@ mainloop:
   jsr update_ball
   jsr draw_separator
   jsr draw_ball
-  jsr sleep   // TODO: sleep on "vblank"
+  jsr sleep
   jmp mainloop
 
 
 init:
+  // Count frames on vblank
+  lda #<on_vblank
+  sta nmi_vector
+  lda #>on_vblank
+  sta nmi_vector_h
+  lda #$80
+  sta video_control
+
   // Init ball
   lda #24
   sta ball_x
@@ -98,7 +110,6 @@ draw_separator_loop:
   sta draw_cursor_h
   dey
   bne draw_separator_loop // continue Y times
-  brk
   rts
 
 
@@ -107,13 +118,18 @@ draw_ball:
   rts
 
 
-sleep:
-  ldx #0
+sleep:  // until the next frame
+  lda frame
 sleep_loop:
-  dex
-  bne sleep_loop
+  cmp frame
+  beq sleep_loop
   rts
 
 
+on_vblank:
+  inc frame
+  rti
+
+
 game_over:
   end
\ No newline at end of file
@@ -0,0 +1,93 @@
+// ================= ALU tables ==================
+#ifndef ALU_CPP
+#define ALU_CPP
+
+// ADC and SBC (and CMP/CPX/CPY, which are SBC without the borrow and
+// without V) are looked up instead of computed. The index is
+//
+//   decimal << 17 | carry << 16 | A << 8 | operand
+//
+// and an entry packs everything the instruction changes:
+//
+//   byte 0: the result
+//   byte 1: value for flag_n
+//   byte 2: value for flag_z
+//   byte 3: bit 0 is C, bit 7 is V
+//
+// Decimal mode follows the NMOS 6502, including its N, V and Z flags
+// which come from different stages of the calculation.
+//
+// The tables are filled in before main. 2 x 256K entries is too much for
+// C++11 constexpr (no loops, limited recursion depth), so they aren't
+// generated by the compiler.
+
+global int const kAluTableSize = 1 << 18;
+
+global u32 gAluAdd[kAluTableSize];
+global u32 gAluSubtract[kAluTableSize];
+
+inline u32 AluEntry(int result, int n, int z, int c, int v) {
+  u32 cv = (c ? 0x01 : 0) | (v ? 0x80 : 0);
+  return (u32)((u8)result | (u8)n << 8 | (u8)z << 16) | cv << 24;
+}
+
+static u32 AluAdd(int a, int m, int carry, bool decimal) {
+  int binary = a + m + carry;
+  int v = ~(a ^ m) & (a ^ binary) & 0x80;
+  if (!decimal) {
+    return AluEntry(binary, binary, binary, binary > 0xFF, v);
+  }
+
+  int lo = (a & 0x0F) + (m & 0x0F) + carry;
+  if (lo > 0x09) lo += 0x06;
+  int hi = (a >> 4) + (m >> 4) + (lo > 0x0F);
+  // N and V are taken before the high digit is adjusted, Z from the binary sum
+  int n = hi << 4;
+  v = ~(a ^ m) & (a ^ n) & 0x80;
+  if (hi > 0x09) hi += 0x06;
+  return AluEntry(hi << 4 | (lo & 0x0F), n, binary, hi > 0x0F, v);
+}
+
+static u32 AluSubtract(int a, int m, int carry, bool decimal) {
+  int binary = a - m - (1 - carry);
+  int v = (a ^ m) & (a ^ binary) & 0x80;
+  int result = binary;
+  if (decimal) {
+    // Flags are the same as in binary mode
+    int lo = (a & 0x0F) - (m & 0x0F) - (1 - carry);
+    int hi = (a >> 4) - (m >> 4);
+    if (lo & 0x10) {
+      lo -= 0x06;
+      hi--;
+    }
+    if (hi & 0x10) hi -= 0x06;
+    result = hi << 4 | (lo & 0x0F);
+  }
+  return AluEntry(result, binary, binary, binary >= 0, v);
+}
+
+inline int AluIndex(int a, int m, int carry, int decimal) {
+  return decimal << 17 | carry << 16 | a << 8 | m;
+}
+
+static void FillAluTables() {
+  for (int decimal = 0; decimal < 2; decimal++) {
+    for (int carry = 0; carry < 2; carry++) {
+      for (int a = 0; a < 256; a++) {
+        for (int m = 0; m < 256; m++) {
+          int index = AluIndex(a, m, carry, decimal);
+          gAluAdd[index] = AluAdd(a, m, carry, decimal != 0);
+          gAluSubtract[index] = AluSubtract(a, m, carry, decimal != 0);
+        }
+      }
+    }
+  }
+}
+
+// Runs before main so that there's no question of which thread does it
+struct AluTablesInitializer {
+  AluTablesInitializer() { FillAluTables(); }
+};
+global AluTablesInitializer gAluTablesInitializer;
+
+#endif  // ALU_CPP
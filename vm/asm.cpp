@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <setjmp.h>
 
 #include "utils.cpp"
 
@@ -19,6 +20,8 @@ enum TokenType {
   Token_OpenParen,
   Token_CloseParen,
   Token_Comma,
+  Token_LessThan,
+  Token_GreaterThan,
   Token_Define,
 
   Token_SyntaxError,
@@ -33,7 +36,6 @@ struct Token {
   bool Equals(char *);
   bool IsNumber();
   int ParseNumber();
-  void SyntaxError(char *);
 };
 
 struct Tokenizer {
@@ -151,7 +153,17 @@ enum InstructionType {
   I_END,  // non-canonical
 };
 
-global int gBytesForAddressingMode[AM_Accumulator + 1] = {
+// For disassembly, in the same order as InstructionType
+global char const *const gInstructionNames[I_END + 1] = {
+    "???", "NOP", "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE",
+    "BPL", "BRK", "BVC", "BVS", "CLC", "CLD", "CLI", "CLV", "CMP", "CPX", "CPY",
+    "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP", "JSR", "LDA", "LDX",
+    "LDY", "LSR", "ORA", "PHA", "PHP", "PLA", "PLP", "ROL", "ROR", "RTI", "RTS",
+    "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY", "TAX", "TAY", "TSX", "TXA",
+    "TXS", "TYA", "END",
+};
+
+global int const gBytesForAddressingMode[AM_Accumulator + 1] = {
     0,  // AM_Unknown
     2,  // AM_Immediate
     3,  // AM_Absolute
@@ -173,7 +185,8 @@ struct InstructionTypeAndMode {
   AddressingMode mode;
 };
 
-const InstructionTypeAndMode gOpcodeToInstruction[256] = {
+// constexpr so that the CPU can specialize a handler for every opcode
+constexpr InstructionTypeAndMode gOpcodeToInstruction[256] = {
     {I_BRK, AM_Implied},
     {I_ORA, AM_Indirect_X},
     {},
@@ -432,14 +445,40 @@ const InstructionTypeAndMode gOpcodeToInstruction[256] = {
     {I_END, AM_Implied},
 };
 
-// Filled in later using the mapping above
-global u8 gInstructionToOpcode[I_END + 1][AM_Accumulator + 1] = {};
+// Base cycles for every opcode. Indexed reads that cross a page and taken
+// branches cost extra, see CPU::Execute
+constexpr u8 gCyclesForOpcode[256] = {
+    7, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 2, 4, 6, 2,  // 0x00
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x10
+    6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 4, 4, 6, 2,  // 0x20
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x30
+    6, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 3, 4, 6, 2,  // 0x40
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x50
+    6, 6, 2, 2, 2, 3, 5, 2, 4, 2, 2, 2, 5, 4, 6, 2,  // 0x60
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x70
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,  // 0x80
+    2, 6, 2, 2, 4, 4, 4, 2, 2, 5, 2, 2, 2, 5, 2, 2,  // 0x90
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,  // 0xA0
+    2, 5, 2, 2, 4, 4, 4, 2, 2, 4, 2, 2, 4, 4, 4, 2,  // 0xB0
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,  // 0xC0
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0xD0
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,  // 0xE0
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0xF0
+};
+
+// Immediate operands can take just one byte of a value, e.g. lda #<label
+enum OperandPart {
+  Operand_Whole = 0,
+  Operand_LowByte,
+  Operand_HighByte,
+};
 
 struct Instruction {
   InstructionType type;
   AddressingMode mode;
   u32 modes;  // supported addressing modes
   int operand;
+  OperandPart operand_part;
   Token *deferred_operand;  // to be looked up in the symbol table
   Token *mnemonic;          // for error reporting
   int address;              // for labels. filled at a later stage
@@ -448,7 +487,7 @@ struct Instruction {
 struct SymbolTableEntry {
   char *symbol;
   int value;
-  Instruction *instruction;  // the instruction immediately following the label
+  int instruction;  // index of the one following the label, -1 for defines
 };
 
 struct SymbolTable {
@@ -466,7 +505,67 @@ struct SymbolTable {
   void AllocateSpaceIfNeeded(Token *);
 };
 
+// What went wrong when a program couldn't be loaded
+struct AsmError {
+  int line_num;  // 0 if it's not about a particular line
+  char message[200];
+};
+
+// Which source line and label every address came from, for the profiler.
+// LoadProgram fills it in if it's given one
+global int const kMaxSourceLabels = 1024;
+
+struct SourceLabel {
+  u16 address;
+  char name[32];
+};
+
+struct SourceMap {
+  char filename[256];
+  int lines[kMachineMemorySize];  // 0 where no instruction starts
+  SourceLabel labels[kMaxSourceLabels];  // sorted by address
+  int num_labels;
+
+  void AddLabel(u16 address, char *name);
+  int FindLabel(u32 address);
+};
+
+// Keeps the first label if there are several at one address
+void SourceMap::AddLabel(u16 address, char *name) {
+  if (this->num_labels >= kMaxSourceLabels) return;
+  int index = this->num_labels;
+  while (index > 0 && this->labels[index - 1].address >= address) {
+    if (this->labels[index - 1].address == address) return;
+    index--;
+  }
+  memmove(this->labels + index + 1, this->labels + index,
+          (this->num_labels - index) * sizeof(SourceLabel));
+  this->labels[index].address = address;
+  snprintf(this->labels[index].name, sizeof(this->labels[index].name), "%s",
+           name);
+  this->num_labels++;
+}
+
+// Returns the index of the closest label at or before the address, or -1
+int SourceMap::FindLabel(u32 address) {
+  int low = 0;
+  int high = this->num_labels;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (this->labels[middle].address <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low - 1;
+}
+
 struct Assembler {
+  char *source;
+  Tokenizer tokenizer;
+  SymbolTable symbol_table;
+
   u8 *at_memory;
   Token *at_token;
 
@@ -482,7 +581,12 @@ struct Assembler {
 
   Instruction *NewInstruction();
 
+  AsmError *error;
+  SourceMap *source_map;  // NULL if nobody wants it
+  jmp_buf error_jump;  // where SyntaxError returns to, see LoadProgram
+
   void SyntaxError(char *);
+  void SyntaxError(Token *, char *);
 };
 
 struct CodeGenerator {
@@ -538,7 +642,7 @@ SymbolTableEntry *SymbolTable::AddEntry(Token *token, int value) {
   // Yes, linear search, don't look at me like this
   for (int i = 0; i < this->num_entries; i++) {
     if (token->Equals(this->entries[i].symbol)) {
-      token->SyntaxError("Identifier already declared");
+      return NULL;  // already declared
     }
   }
 
@@ -549,7 +653,7 @@ SymbolTableEntry *SymbolTable::AddEntry(Token *token, int value) {
   strncpy(entry->symbol, token->text, token->length);
   entry->symbol[token->length] = '\0';
   entry->value = value;
-  entry->instruction = NULL;
+  entry->instruction = -1;
 
   this->free_space += token->length + 1;
 
@@ -582,12 +686,11 @@ bool Token::IsNumber() {
   return this->type == Token_DecNumber || this->type == Token_HexNumber;
 }
 
+// The caller checks that it's a number
 int Token::ParseNumber() {
   int value = 0;
 
-  if (!this->IsNumber()) {
-    this->SyntaxError("Trying to parse this as a number");
-  }
+  Assert(this->IsNumber());
   if (this->type == Token_HexNumber) {
     value = strtoi(this->text, this->length, 16);
   } else {
@@ -597,12 +700,6 @@ int Token::ParseNumber() {
   return value;
 }
 
-void Token::SyntaxError(char *string) {
-  print("Syntax error at line %d: %s: '%.*s'\n", this->line_num, string,
-        this->length, this->text);
-  exit(1);
-}
-
 Token *Assembler::NextToken() {
   // keep at_token pointing at the current one, not the next
   this->at_token++;
@@ -680,15 +777,23 @@ Instruction *Assembler::NewInstruction() {
 }
 
 void Assembler::SyntaxError(char *string) {
-  this->at_token->SyntaxError(string);
+  this->SyntaxError(this->at_token, string);
 }
 
+// Doesn't return, jumps straight out of the assembler
+void Assembler::SyntaxError(Token *token, char *string) {
+  this->error->line_num = token->line_num;
+  snprintf(this->error->message, sizeof(this->error->message), "%s: '%.*s'",
+           string, token->length, token->text);
+  longjmp(this->error_jump, 1);
+}
+
+// Returns NULL if the file can't be read
 static char *ReadFileIntoString(char *filename) {
   char *result = NULL;
   FILE *file = fopen(filename, "rb");
   if (file == NULL) {
-    print("Couldn't open file %s\n", filename);
-    exit(1);
+    return NULL;
   }
 
   fseek(file, 0, SEEK_END);
@@ -696,6 +801,10 @@ static char *ReadFileIntoString(char *filename) {
   fseek(file, 0, SEEK_SET);
 
   result = (char *)malloc(file_size + 1);
+  if (result == NULL) {
+    fclose(file);
+    return NULL;
+  }
   fread(result, file_size, 1, file);
   fclose(file);
 
@@ -720,31 +829,30 @@ inline bool IsHex(char c) {
   return IsDecimal(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
 }
 
-static int LoadProgram(char *filename, u16 memory_address) {
-  char *file_contents = ReadFileIntoString(filename);
-  print("Assembling %s ...\n", filename);
-
+// Everything the assembler allocates lives in the Assembler so that it can
+// be freed whichever way LoadProgram returns
+static void Assemble(Assembler *assembler, u8 *memory, u16 memory_address) {
   // ****************************************************************
   // Tokenizing
   // ****************************************************************
-  Tokenizer tokenizer = {};
-  tokenizer.at = file_contents;
-  tokenizer.line_num = 1;
+  Tokenizer *tokenizer = &assembler->tokenizer;
+  tokenizer->at = assembler->source;
+  tokenizer->line_num = 1;
 
   bool tokenizing = true;
   while (tokenizing) {
     // Eat white space
     for (;;) {
-      char c = tokenizer.at[0];
+      char c = tokenizer->at[0];
       if (IsWhitespace(c)) {
         if (c == '\n') {
-          tokenizer.line_num++;
+          tokenizer->line_num++;
         }
-        tokenizer.at++;
-      } else if (c == '/' && tokenizer.at[1] == '/') {
-        tokenizer.at += 2;
-        while (!IsEndOfLine(*tokenizer.at)) {
-          tokenizer.at++;
+        tokenizer->at++;
+      } else if (c == '/' && tokenizer->at[1] == '/') {
+        tokenizer->at += 2;
+        while (!IsEndOfLine(*tokenizer->at)) {
+          tokenizer->at++;
         }
       } else {
         break;
@@ -752,21 +860,21 @@ static int LoadProgram(char *filename, u16 memory_address) {
     }
 
     // Get token
-    Token *token = tokenizer.NewToken();
-    token->text = tokenizer.at;
+    Token *token = tokenizer->NewToken();
+    token->text = tokenizer->at;
     token->length = 0;
-    token->line_num = tokenizer.line_num;  // for error reporting
+    token->line_num = tokenizer->line_num;  // for error reporting
 
-    char c = *tokenizer.at;
+    char c = *tokenizer->at;
     if (IsAlpha(c)) {
       while (!IsWhitespace(c) && c != ':' && c != '\0' && c != '(' &&
              c != ')' && c != ',') {
-        c = *++tokenizer.at;
+        c = *++tokenizer->at;
         token->length++;
       }
       if (c == ':') {
         token->type = Token_Label;
-        tokenizer.at++;
+        tokenizer->at++;
       } else {
         token->type = Token_Identifier;
         if (token->Equals("DEFINE")) {
@@ -776,46 +884,54 @@ static int LoadProgram(char *filename, u16 memory_address) {
     } else if (c == '#') {
       token->type = Token_Hash;
       token->length = 1;
-      tokenizer.at++;
+      tokenizer->at++;
     } else if (c == '(') {
       token->type = Token_OpenParen;
       token->length = 1;
-      tokenizer.at++;
+      tokenizer->at++;
     } else if (c == ')') {
       token->type = Token_CloseParen;
       token->length = 1;
-      tokenizer.at++;
+      tokenizer->at++;
     } else if (c == ',') {
       token->type = Token_Comma;
       token->length = 1;
-      tokenizer.at++;
+      tokenizer->at++;
+    } else if (c == '<') {
+      token->type = Token_LessThan;
+      token->length = 1;
+      tokenizer->at++;
+    } else if (c == '>') {
+      token->type = Token_GreaterThan;
+      token->length = 1;
+      tokenizer->at++;
     } else if (IsDecimal(c)) {
       token->type = Token_DecNumber;
-      while (IsDecimal(*tokenizer.at)) {
-        tokenizer.at++;
+      while (IsDecimal(*tokenizer->at)) {
+        tokenizer->at++;
         token->length++;
       }
     } else if (c == '$') {
       token->type = Token_HexNumber;
-      tokenizer.at++;
+      tokenizer->at++;
       token->text++;  // skip the $
-      while (IsHex(*tokenizer.at)) {
-        tokenizer.at++;
+      while (IsHex(*tokenizer->at)) {
+        tokenizer->at++;
         token->length++;
       }
       if (token->length == 0) {
         token->type = Token_SyntaxError;
-        sprintf(tokenizer.error_msg, "Number expected after $");
+        sprintf(tokenizer->error_msg, "Number expected after $");
       }
     } else if (c == '\0') {
       token->type = Token_EndOfStream;
     } else {
       token->type = Token_SyntaxError;
       while (!IsWhitespace(c)) {
-        c = *++tokenizer.at;
+        c = *++tokenizer->at;
         token->length++;
       }
-      sprintf(tokenizer.error_msg, "Unknown token '%.*s'", token->length,
+      sprintf(tokenizer->error_msg, "Unknown token '%.*s'", token->length,
               token->text);
     }
     // End get token
@@ -823,9 +939,12 @@ static int LoadProgram(char *filename, u16 memory_address) {
     if (token->type == Token_EndOfStream) {
       tokenizing = false;
     } else if (token->type == Token_SyntaxError) {
-      print("Syntax error at line %d: %s\n", token->line_num,
-            tokenizer.error_msg);
-      exit(1);
+      assembler->error->line_num = token->line_num;
+      // error_msg is bigger than message, keep what fits
+      int length = (int)sizeof(assembler->error->message) - 1;
+      snprintf(assembler->error->message, sizeof(assembler->error->message),
+               "%.*s", length, tokenizer->error_msg);
+      longjmp(assembler->error_jump, 1);
     }
   }
 
@@ -833,12 +952,12 @@ static int LoadProgram(char *filename, u16 memory_address) {
   // Parsing
   // ****************************************************************
 
-  Assembler assembler = {};
-  assembler.at_token = tokenizer.tokens;
+  assembler->at_token = tokenizer->tokens;
 
-  Token *token = assembler.at_token;
-  SymbolTable symbol_table = SymbolTable();
-  Instruction *instruction = assembler.instructions;
+  Token *token = assembler->at_token;
+  assembler->symbol_table = SymbolTable();
+  SymbolTable *symbol_table = &assembler->symbol_table;
+  Instruction *instruction = assembler->instructions;
 
   bool parsing = true;
 
@@ -849,19 +968,25 @@ static int LoadProgram(char *filename, u16 memory_address) {
       } break;
 
       case Token_Label: {
-        SymbolTableEntry *entry = symbol_table.AddEntry(token, 0);
-        entry->instruction =
-            (instruction + 1);  // we'll resolve its address later
+        SymbolTableEntry *entry = symbol_table->AddEntry(token, 0);
+        if (entry == NULL) {
+          assembler->SyntaxError(token, "Identifier already declared");
+        }
+        // We'll resolve its address later. It's an index because the
+        // instructions may still be reallocated
+        entry->instruction = assembler->num_instructions;
       } break;
 
       case Token_Define: {
-        token = assembler.RequireToken(Token_Identifier);
-        int value = assembler.RequireNumber();
-        symbol_table.AddEntry(token, value);
+        token = assembler->RequireToken(Token_Identifier);
+        int value = assembler->RequireNumber();
+        if (symbol_table->AddEntry(token, value) == NULL) {
+          assembler->SyntaxError(token, "Identifier already declared");
+        }
       } break;
 
       case Token_Identifier: {
-        instruction = assembler.NewInstruction();
+        instruction = assembler->NewInstruction();
         instruction->mnemonic = token;
         u32 modes = AMF_NONE;
         InstructionType type = I_Unknown;
@@ -1034,12 +1159,12 @@ static int LoadProgram(char *filename, u16 memory_address) {
           modes = AMF_IMPLIED;
         } else if (token->Equals("TYA")) {
           type = I_TYA;
-          modes = AMF_MOST_COMMON;
+          modes = AMF_IMPLIED;
         } else if (token->Equals("END")) {
           type = I_END;
           modes = AMF_IMPLIED;
         } else {
-          assembler.SyntaxError("Unknown command");
+          assembler->SyntaxError("Unknown command");
         }
 
         instruction->type = type;
@@ -1052,14 +1177,29 @@ static int LoadProgram(char *filename, u16 memory_address) {
         }
 
         // Parse operand
-        token = assembler.NextToken();
+        token = assembler->NextToken();
+
+        if ((modes & AMF_ACCUMULATOR) && token->type == Token_Identifier &&
+            token->Equals("A")) {
+          instruction->mode = AM_Accumulator;
+          break;
+        }
 
         if ((modes & AMF_IMMEDIATE) && token->type == Token_Hash) {
-          token = assembler.PeekToken();
+          token = assembler->PeekToken();
+          if (token->type == Token_LessThan) {
+            instruction->operand_part = Operand_LowByte;
+          } else if (token->type == Token_GreaterThan) {
+            instruction->operand_part = Operand_HighByte;
+          }
+          if (instruction->operand_part != Operand_Whole) {
+            assembler->NextToken();
+            token = assembler->PeekToken();
+          }
           if (token->type == Token_Identifier) {
-            instruction->deferred_operand = assembler.NextToken();
+            instruction->deferred_operand = assembler->NextToken();
           } else {
-            instruction->operand = assembler.RequireNumber();
+            instruction->operand = assembler->RequireNumber();
           }
           instruction->mode = AM_Immediate;
           break;
@@ -1073,15 +1213,15 @@ static int LoadProgram(char *filename, u16 memory_address) {
           } else {
             instruction->operand = token->ParseNumber();
           }
-          if (assembler.PeekToken()->type == Token_Comma) {
-            assembler.NextToken();  // skip the comma
-            token = assembler.NextToken();
+          if (assembler->PeekToken()->type == Token_Comma) {
+            assembler->NextToken();  // skip the comma
+            token = assembler->NextToken();
             if (token->Equals("x")) {
               instruction->mode = AM_Absolute_X;
             } else if (token->Equals("y")) {
               instruction->mode = AM_Absolute_Y;
             } else {
-              token->SyntaxError("X or Y expected, got");
+              assembler->SyntaxError(token, "X or Y expected, got");
             }
           } else {
             instruction->mode = AM_Absolute;
@@ -1091,36 +1231,36 @@ static int LoadProgram(char *filename, u16 memory_address) {
 
         if ((modes & (AMF_INDIRECT_X | AMF_INDIRECT_Y | AMF_INDIRECT)) &&
             token->type == Token_OpenParen) {
-          token = assembler.NextToken();
+          token = assembler->NextToken();
           if (token->type == Token_Identifier) {
             instruction->deferred_operand = token;
           } else {
-            assembler.PrevToken();
-            instruction->operand = assembler.RequireNumber();
+            assembler->PrevToken();
+            instruction->operand = assembler->RequireNumber();
           }
           if (modes & AMF_INDIRECT) {
-            assembler.RequireToken(Token_CloseParen);
+            assembler->RequireToken(Token_CloseParen);
             instruction->mode = AM_Indirect;
           } else {
-            token = assembler.NextToken();
+            token = assembler->NextToken();
             if (token->type == Token_CloseParen && (modes & AMF_INDIRECT_Y)) {
-              assembler.RequireToken(Token_Comma);
-              token = assembler.NextToken();
+              assembler->RequireToken(Token_Comma);
+              token = assembler->NextToken();
               if (token->Equals("y")) {
                 instruction->mode = AM_Indirect_Y;
               } else {
-                token->SyntaxError("Y expected, got");
+                assembler->SyntaxError(token, "Y expected, got");
               }
             } else if (token->type == Token_Comma && (modes & AMF_INDIRECT_X)) {
-              token = assembler.NextToken();
+              token = assembler->NextToken();
               if (token->Equals("X")) {
                 instruction->mode = AM_Indirect_X;
               } else {
-                token->SyntaxError("X expected, got");
+                assembler->SyntaxError(token, "X expected, got");
               }
-              assembler.RequireToken(Token_CloseParen);
+              assembler->RequireToken(Token_CloseParen);
             } else {
-              token->SyntaxError(") or , expected, got");
+              assembler->SyntaxError(token, ") or , expected, got");
             }
           }
           break;
@@ -1133,21 +1273,15 @@ static int LoadProgram(char *filename, u16 memory_address) {
           break;
         }
 
-        if ((modes & AMF_ACCUMULATOR) && token->type == Token_Identifier &&
-            token->Equals("A")) {
-          instruction->mode = AM_Accumulator;
-          break;
-        }
-
         // Couldn't match operand
-        token->SyntaxError("Incorrect operand");
+        assembler->SyntaxError(token, "Incorrect operand");
       } break;
 
       default: {
-        assembler.SyntaxError("Command or label expected, got");
+        assembler->SyntaxError("Command or label expected, got");
       } break;
     }
-    token = assembler.NextToken();
+    token = assembler->NextToken();
   }
 
   // ****************************************************************
@@ -1155,15 +1289,13 @@ static int LoadProgram(char *filename, u16 memory_address) {
   // ****************************************************************
 
   CodeGenerator codegen = {};
-  codegen.at_memory = (u8 *)gMachineMemory + memory_address;
-  codegen.at_instruction = assembler.instructions;
-
-  u8 *memory = (u8 *)gMachineMemory + memory_address;  // for debugging
+  codegen.at_memory = memory + memory_address;
+  codegen.at_instruction = assembler->instructions;
 
   // Fill in instruction addresses that are used in label resolving
   int address = memory_address;
-  for (int i = 0; i < assembler.num_instructions; i++) {
-    instruction = assembler.instructions + i;
+  for (int i = 0; i < assembler->num_instructions; i++) {
+    instruction = assembler->instructions + i;
     instruction->address = address;
 
     // Check for zero page - important for instruction size!
@@ -1187,22 +1319,32 @@ static int LoadProgram(char *filename, u16 memory_address) {
     int bytes = gBytesForAddressingMode[instruction->mode];
     address += bytes;
   }
+  int end_address = address;  // for labels after the last instruction
 
-  for (int i = 0; i < assembler.num_instructions; i++) {
-    instruction = assembler.instructions + i;
+  for (int i = 0; i < assembler->num_instructions; i++) {
+    instruction = assembler->instructions + i;
 
     // Resolve deferred operand
     if (instruction->deferred_operand != NULL) {
       SymbolTableEntry *entry =
-          symbol_table.GetEntry(instruction->deferred_operand);
+          symbol_table->GetEntry(instruction->deferred_operand);
       if (entry == NULL) {
-        instruction->deferred_operand->SyntaxError("Unknown identifier");
-      } else if (entry->instruction != NULL) {
-        instruction->operand = entry->instruction->address;
+        assembler->SyntaxError(instruction->deferred_operand,
+                               "Unknown identifier");
+      } else if (entry->instruction >= 0) {
+        instruction->operand =
+            entry->instruction < assembler->num_instructions
+                ? assembler->instructions[entry->instruction].address
+                : end_address;
       } else {
         instruction->operand = entry->value;
       }
     }
+    if (instruction->operand_part == Operand_LowByte) {
+      instruction->operand &= 0xFF;
+    } else if (instruction->operand_part == Operand_HighByte) {
+      instruction->operand = (instruction->operand >> 8) & 0xFF;
+    }
 
     if ((instruction->mode == AMF_ABSOLUTE &&
          !(instruction->modes & AMF_ABSOLUTE)) ||
@@ -1211,8 +1353,8 @@ static int LoadProgram(char *filename, u16 memory_address) {
         (instruction->mode == AMF_ABSOLUTE_Y &&
          !(instruction->modes & AMF_ABSOLUTE_Y))) {
       if (instruction->operand > 0xFF) {
-        instruction->mnemonic->SyntaxError(
-            "Only zero page addressing is supported");
+        assembler->SyntaxError(instruction->mnemonic,
+                               "Only zero page addressing is supported");
       }
     }
 
@@ -1220,36 +1362,26 @@ static int LoadProgram(char *filename, u16 memory_address) {
     u8 opcode = 0;
     AddressingMode mode = instruction->mode;
     InstructionType type = instruction->type;
-    bool error = false;
-
-    opcode = gInstructionToOpcode[type][mode];
-
-    if (opcode == 0x00 && type != I_BRK) {
-      bool found = false;
-      for (int o = 0; o <= 256; o++) {
-        InstructionTypeAndMode tm = gOpcodeToInstruction[o];
-        if (tm.type == type && tm.mode == mode) {
-          opcode = (u8)o;
-          found = true;
-          gInstructionToOpcode[type][mode] = opcode;
-          break;
-        }
-      }
-      if (!found) {
-        error = true;
+    bool found = false;
+    for (int o = 0; o < 256; o++) {
+      InstructionTypeAndMode tm = gOpcodeToInstruction[o];
+      if (tm.type == type && tm.mode == mode) {
+        opcode = (u8)o;
+        found = true;
+        break;
       }
     }
-
     int bytes = gBytesForAddressingMode[mode];
 
-    if (error || bytes == 0) {
-      instruction->mnemonic->SyntaxError("Incorrect addressing mode");
+    if (!found || bytes == 0) {
+      assembler->SyntaxError(instruction->mnemonic,
+                             "Incorrect addressing mode");
     }
 
     if ((bytes == 2 && instruction->operand > 0xFF) ||
         (bytes == 3 && instruction->operand > 0xFFFF)) {
-      instruction->mnemonic->SyntaxError(
-          "Operand is too large for this addressing mode");
+      assembler->SyntaxError(instruction->mnemonic,
+                             "Operand is too large for this addressing mode");
     }
 
     // Finally, write in memory
@@ -1268,7 +1400,93 @@ static int LoadProgram(char *filename, u16 memory_address) {
     }
   }
 
-  print("Assembling of %s finished\n", filename);
+  // ****************************************************************
+  // Source map
+  // ****************************************************************
 
-  return 0;
+  SourceMap *source_map = assembler->source_map;
+  if (source_map != NULL) {
+    for (int i = 0; i < assembler->num_instructions; i++) {
+      instruction = assembler->instructions + i;
+      source_map->lines[instruction->address & 0xFFFF] =
+          instruction->mnemonic->line_num;
+    }
+    for (int i = 0; i < symbol_table->num_entries; i++) {
+      SymbolTableEntry *entry = symbol_table->entries + i;
+      if (entry->instruction < 0) continue;
+      int label_address =
+          entry->instruction < assembler->num_instructions
+              ? assembler->instructions[entry->instruction].address
+              : end_address;
+      source_map->AddLabel((u16)label_address, entry->symbol);
+    }
+  }
+
+}
+
+// Takes the source and frees it when done
+static bool AssembleOwnedSource(u8 *memory, char *source, u16 memory_address,
+                                AsmError *error, SourceMap *source_map) {
+  // On the heap so that nothing in it is lost when SyntaxError jumps back
+  Assembler *assembler = (Assembler *)calloc(1, sizeof(Assembler));
+  if (assembler == NULL) {
+    free(source);
+    snprintf(error->message, sizeof(error->message), "Out of memory");
+    return false;
+  }
+  assembler->error = error;
+  assembler->source_map = source_map;
+  assembler->source = source;
+
+  bool result = false;
+  if (setjmp(assembler->error_jump) == 0) {
+    Assemble(assembler, memory, memory_address);
+    result = true;
+  }
+
+  free(assembler->source);
+  free(assembler->tokenizer.tokens);
+  free(assembler->symbol_table.symbol_space);
+  free(assembler->symbol_table.entries);
+  free(assembler->instructions);
+  free(assembler);
+
+  return result;
+}
+
+// Assembles a file into memory. Returns false and fills in the error if the
+// program is wrong or can't be read
+static bool LoadProgram(u8 *memory, char *filename, u16 memory_address,
+                        AsmError *error, SourceMap *source_map = NULL) {
+  error->line_num = 0;
+  error->message[0] = '\0';
+  if (source_map != NULL) {
+    memset(source_map, 0, sizeof(SourceMap));
+    snprintf(source_map->filename, sizeof(source_map->filename), "%s",
+             filename);
+  }
+
+  char *source = ReadFileIntoString(filename);
+  if (source == NULL) {
+    snprintf(error->message, sizeof(error->message), "Couldn't open file %s",
+             filename);
+    return false;
+  }
+  return AssembleOwnedSource(memory, source, memory_address, error,
+                             source_map);
+}
+
+// Same for a program that's already in memory, e.g. a generated one
+static bool AssembleSource(u8 *memory, char const *text, u16 memory_address,
+                           AsmError *error) {
+  error->line_num = 0;
+  error->message[0] = '\0';
+  size_t length = strlen(text);
+  char *source = (char *)malloc(length + 1);
+  if (source == NULL) {
+    snprintf(error->message, sizeof(error->message), "Out of memory");
+    return false;
+  }
+  memcpy(source, text, length + 1);
+  return AssembleOwnedSource(memory, source, memory_address, error, NULL);
 }
@@ -19,6 +19,14 @@ typedef unsigned int uint;
 #define global static
 #define local_persist static
 
+#ifdef BUILD_WIN32
+#define force_inline __forceinline
+#define no_inline __declspec(noinline)
+#else
+#define force_inline inline __attribute__((always_inline))
+#define no_inline __attribute__((noinline))
+#endif
+
 #if BUILD_SLOW
 #define Assert(Expression) if(!(Expression)) {*(int *)0 = 0;}
 #else
@@ -0,0 +1,712 @@
+// Runs many programs headless, spread over all cores, and writes a single
+// JSON report for all of them:
+//
+//   batch <manifest> [--threads N] [--tier interpreter|block-cache|jit]
+//         [--cycles N] [--report <file>] [--metrics <name>]
+//
+// The manifest has a job per line, # starts a comment:
+//
+//   <program> [load=<address>] [cycles=<limit>] [input=<script>]
+//             [<address>=<bytes>]...
+//
+// Addresses and bytes are hex, e.g. $0300=02 or $0200=1161E1. A job passes
+// when the program ends (END) within its cycle limit and memory holds the
+// bytes it should. cycles defaults to --cycles, a program still running
+// after that many has timed out. Paths are relative to where batch runs.
+//
+// With input= the machine gets the keyboard at $FD00 (see input.cpp) and
+// the script types on it. Each line of the script is an event:
+//
+//   <cycle> press|release <key>
+//
+// where key is a character or up, down, left, right, space, return, escape
+// or backspace. Events have to be in order.
+//
+// Every job gets a machine of its own. Each worker thread has a range of
+// jobs and takes them from the front, and when it runs out it steals the
+// back half of another worker's range. A range is one u64 (first job << 32
+// | end), so taking and stealing are both a compare and exchange. The
+// report lists the jobs in manifest order whoever ran them. The exit code
+// is 0 if they all passed.
+//
+// With --metrics every worker publishes the machine it's running as
+// <name>-<worker> (see metrics.cpp), e.g. metrics_reader jobs-0. Jobs then
+// run a frame at a time and publish at most every 10 ms in between.
+
+#include "base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef BUILD_WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "vm.cpp"
+#include "metrics.cpp"
+
+struct ScriptEvent {
+  u64 cycle;
+  u8 key;
+  bool pressed;
+};
+
+struct MemoryCheck {
+  u16 address;
+  u16 length;
+  u8 *expected;
+  u8 *actual;  // filled in when the job ends
+};
+
+global int const kMaxMemoryChecks = 32;
+
+enum JobStatus {
+  Job_NotRun = 0,
+  Job_Passed,
+  Job_Failed,  // memory isn't what it should be
+  Job_TimedOut,
+  Job_Error,  // couldn't load, or the CPU stopped with an error
+  kNumJobStatuses,
+};
+
+global char const *const kJobStatusNames[kNumJobStatuses] = {
+    "not run", "passed", "failed", "timeout", "error"};
+
+struct Job {
+  int line;  // in the manifest
+  char *program;
+  u16 load_address;
+  u64 cycle_limit;
+  char *input_file;
+  ScriptEvent *events;
+  int num_events;
+  MemoryCheck checks[kMaxMemoryChecks];
+  int num_checks;
+
+  // Results
+  JobStatus status;
+  u64 cycles;
+  u64 instructions;
+  u16 pc;
+  r64 seconds;
+  char error[256];
+};
+
+enum Tier {
+  Tier_Interpreter,
+  Tier_BlockCache,
+  Tier_Jit,
+  Tier_Count,
+};
+
+global char const *const gTierNames[Tier_Count] = {"interpreter",
+                                                   "block-cache", "jit"};
+
+struct BatchPool;
+
+struct Worker {
+  volatile u64 range;  // jobs [range >> 32, (u32)range)
+  BatchPool *pool;
+  int index;
+  u64 jobs_run;
+  u64 steals;
+  MetricsPublisher *metrics;  // NULL without --metrics
+  u8 padding[64];  // keeps the ranges on different cache lines
+};
+
+struct BatchPool {
+  Job *jobs;
+  int num_jobs;
+  Worker *workers;
+  int num_workers;
+  Tier tier;
+};
+
+static r64 GetWallClock() {
+#ifdef BUILD_WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (r64)counter.QuadPart / (r64)frequency.QuadPart;
+#else
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (r64)time.tv_sec + (r64)time.tv_nsec / 1e9;
+#endif
+}
+
+static int NumberOfCores() {
+#ifdef BUILD_WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+#endif
+}
+
+// ================= Manifest ==================
+
+// Hex, with or without a $. Returns false if there's anything else in it
+static bool ParseHex(char const *text, u32 max, u32 *value) {
+  if (*text == '$') text++;
+  if (*text == '\0') return false;
+  char *end;
+  unsigned long result = strtoul(text, &end, 16);
+  if (*end != '\0' || result > max) return false;
+  *value = (u32)result;
+  return true;
+}
+
+// A character, or one of the names in the script format. 0 if it's neither
+static u8 ParseKey(char const *name) {
+  if (name[0] != '\0' && name[1] == '\0') return (u8)name[0];
+  struct {
+    char const *name;
+    u8 key;
+  } const keys[] = {
+      {"up", Key_Up},       {"down", Key_Down},     {"left", Key_Left},
+      {"right", Key_Right}, {"space", ' '},         {"return", 0x0D},
+      {"escape", 0x1B},     {"backspace", 0x08},
+  };
+  for (int i = 0; i < (int)COUNT_OF(keys); i++) {
+    if (strcmp(name, keys[i].name) == 0) return keys[i].key;
+  }
+  return 0;
+}
+
+static bool ReadInputScript(Job *job) {
+  char *text = ReadFileIntoString(job->input_file);
+  if (text == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", job->input_file);
+    return false;
+  }
+  int capacity = 0;
+  bool ok = true;
+  int line_num = 0;
+  char *line = text;
+  for (char *next; line != NULL && ok; line = next) {
+    line_num++;
+    next = strchr(line, '\n');
+    if (next != NULL) *next++ = '\0';
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+    char cycle_text[32], action[16], key_name[32];
+    int fields = sscanf(line, "%31s %15s %31s", cycle_text, action, key_name);
+    if (fields <= 0) continue;  // empty
+
+    ScriptEvent event;
+    char *end;
+    event.cycle = strtoull(cycle_text, &end, 10);
+    event.key = fields == 3 ? ParseKey(key_name) : 0;
+    event.pressed = strcmp(action, "press") == 0;
+    bool in_order = job->num_events == 0 ||
+                    job->events[job->num_events - 1].cycle <= event.cycle;
+    if (fields != 3 || *end != '\0' || event.key == 0 || !in_order ||
+        (!event.pressed && strcmp(action, "release") != 0)) {
+      fprintf(stderr, "%s:%d: bad event\n", job->input_file, line_num);
+      ok = false;
+      break;
+    }
+    if (job->num_events == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      job->events = (ScriptEvent *)realloc(job->events,
+                                           capacity * sizeof(ScriptEvent));
+    }
+    job->events[job->num_events++] = event;
+  }
+  free(text);
+  return ok;
+}
+
+// <address>=<bytes>
+static bool ParseMemoryCheck(char const *text, MemoryCheck *check) {
+  char address_text[8];
+  char const *equals = strchr(text, '=');
+  if (equals == NULL || equals - text >= (int)sizeof(address_text)) {
+    return false;
+  }
+  memcpy(address_text, text, equals - text);
+  address_text[equals - text] = '\0';
+  u32 address;
+  char const *bytes = equals + 1;
+  int length = (int)strlen(bytes) / 2;
+  if (!ParseHex(address_text, 0xFFFF, &address) || length == 0 ||
+      strlen(bytes) % 2 != 0 || address + length > kMachineMemorySize) {
+    return false;
+  }
+  check->address = (u16)address;
+  check->length = (u16)length;
+  check->expected = (u8 *)malloc(2 * length);
+  check->actual = check->expected + length;
+  for (int i = 0; i < length; i++) {
+    char digits[3] = {bytes[2 * i], bytes[2 * i + 1], '\0'};
+    u32 value;
+    if (!ParseHex(digits, 0xFF, &value)) {
+      free(check->expected);
+      return false;
+    }
+    check->expected[i] = (u8)value;
+  }
+  return true;
+}
+
+// One job per line. Returns false and says why if anything's wrong
+static bool ReadManifest(char *filename, u64 default_cycles, Job **jobs,
+                         int *num_jobs) {
+  char *text = ReadFileIntoString(filename);
+  if (text == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", filename);
+    return false;
+  }
+  int capacity = 0;
+  *jobs = NULL;
+  *num_jobs = 0;
+  bool ok = true;
+  int line_num = 0;
+  char *line = text;
+  while (line != NULL && ok) {
+    line_num++;
+    char *next = strchr(line, '\n');
+    if (next != NULL) *next++ = '\0';
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+
+    Job job = {};
+    job.line = line_num;
+    job.load_address = kPC_start;
+    job.cycle_limit = default_cycles;
+    char *save;
+    for (char *token = strtok_r(line, " \t\r", &save); token != NULL && ok;
+         token = strtok_r(NULL, " \t\r", &save)) {
+      u32 value;
+      if (job.program == NULL) {
+        job.program = strdup(token);
+      } else if (strncmp(token, "load=", 5) == 0) {
+        ok = ParseHex(token + 5, 0xFFFF, &value);
+        job.load_address = (u16)value;
+      } else if (strncmp(token, "cycles=", 7) == 0) {
+        char *end;
+        job.cycle_limit = strtoull(token + 7, &end, 10);
+        ok = *end == '\0' && job.cycle_limit > 0;
+      } else if (strncmp(token, "input=", 6) == 0) {
+        job.input_file = strdup(token + 6);
+      } else if (job.num_checks < kMaxMemoryChecks) {
+        ok = ParseMemoryCheck(token, job.checks + job.num_checks++);
+        if (!ok) job.num_checks--;
+      } else {
+        ok = false;
+      }
+      if (!ok) {
+        fprintf(stderr, "%s:%d: don't know what %s is\n", filename, line_num,
+                token);
+      }
+    }
+    if (ok && job.input_file != NULL) {
+      ok = ReadInputScript(&job);
+    }
+    if (ok && job.program != NULL) {
+      if (*num_jobs == capacity) {
+        capacity = capacity ? 2 * capacity : 256;
+        *jobs = (Job *)realloc(*jobs, capacity * sizeof(Job));
+      }
+      (*jobs)[(*num_jobs)++] = job;
+    }
+    line = next;
+  }
+  free(text);
+  return ok;
+}
+
+// ================= Running jobs ==================
+
+struct ScriptPlayer {
+  Job *job;
+  InputDevice *input;
+  int next_event;
+};
+
+// Types everything that's due and waits for the next one
+static void PlayScript(void *context, u64 time) {
+  ScriptPlayer *player = (ScriptPlayer *)context;
+  Job *job = player->job;
+  while (player->next_event < job->num_events &&
+         job->events[player->next_event].cycle <= time) {
+    ScriptEvent *event = job->events + player->next_event++;
+    player->input->queue.Push(event->key, event->pressed);
+  }
+  if (player->next_event < job->num_events) {
+    player->input->machine->scheduler.Schedule(
+        job->events[player->next_event].cycle, PlayScript, player);
+  }
+}
+
+// Called on the worker between slices of a job
+static void PublishJobMetrics(MetricsPublisher *metrics, Job *job,
+                              Machine *machine, r64 now) {
+  CPU *cpu = &machine->cpu;
+  MetricsValues values = {};
+  values.cycles = cpu->cycles;
+  values.instructions = cpu->instructions;
+  values.emulated_frames = cpu->cycles / kCyclesPerFrame;
+  values.machine_thread_cpu_ns = CurrentThreadCPUNanoseconds();
+  values.published_ns = (u64)(now * 1e9);
+#ifdef BUILD_WIN32
+  values.pid = (u32)GetCurrentProcessId();
+#else
+  values.pid = (u32)getpid();
+#endif
+  values.pc = cpu->PC;
+  values.is_running = cpu->is_running;
+  values.machine = (u32)job->line;
+  PublishMetrics(metrics, &values, now);
+}
+
+static void RunJob(Job *job, Tier tier, MetricsPublisher *metrics) {
+  r64 start = GetWallClock();
+  Machine *machine = NewMachine();
+  if (machine != NULL && tier != Tier_Interpreter) {
+    machine->cpu.block_cache = NewBlockCache(&machine->bus);
+  }
+  if (machine == NULL ||
+      (tier != Tier_Interpreter && machine->cpu.block_cache == NULL)) {
+    job->status = Job_Error;
+    snprintf(job->error, sizeof(job->error), "Not enough memory");
+    if (machine != NULL) FreeMachine(machine);
+    return;
+  }
+  if (tier == Tier_Jit) {
+    machine->cpu.jit = NewJit();
+  }
+
+  ScriptPlayer player = {};
+  job->status = Job_Error;
+  if (!machine->LoadProgram(job->program, job->load_address)) {
+    snprintf(job->error, sizeof(job->error), "%s", machine->error);
+  } else if (job->input_file != NULL &&
+             (player.input = ConnectInput(machine)) == NULL) {
+    snprintf(job->error, sizeof(job->error), "Couldn't connect the keyboard");
+  } else {
+    machine->cpu.PC = job->load_address;
+    if (job->num_events > 0) {
+      player.job = job;
+      machine->scheduler.Schedule(job->events[0].cycle, PlayScript, &player);
+    }
+    // The cycle limit is the watchdog
+    u64 slice = metrics != NULL ? kCyclesPerFrame : job->cycle_limit;
+    StopReason reason = Stop_BudgetExhausted;
+    r64 last_published = 0;
+    while (reason == Stop_BudgetExhausted &&
+           machine->cpu.cycles < job->cycle_limit) {
+      u64 left = job->cycle_limit - machine->cpu.cycles;
+      reason = machine->Run(left < slice ? left : slice);
+      if (metrics != NULL && reason == Stop_BudgetExhausted) {
+        r64 now = GetWallClock();
+        if (now - last_published >= 0.01) {
+          PublishJobMetrics(metrics, job, machine, now);
+          last_published = now;
+        }
+      }
+    }
+    if (reason == Stop_Halted) {
+      job->status = Job_Passed;
+      for (int i = 0; i < job->num_checks; i++) {
+        MemoryCheck *check = job->checks + i;
+        memcpy(check->actual, machine->memory + check->address,
+               check->length);
+        if (memcmp(check->actual, check->expected, check->length) != 0) {
+          job->status = Job_Failed;
+        }
+      }
+    } else if (reason == Stop_BudgetExhausted) {
+      job->status = Job_TimedOut;
+    } else {
+      snprintf(job->error, sizeof(job->error), "%s",
+               reason == Stop_Error ? machine->error : "Stopped");
+    }
+  }
+  job->cycles = machine->cpu.cycles;
+  job->instructions = machine->cpu.instructions;
+  job->pc = machine->cpu.PC;
+  FreeMachine(machine);
+  job->seconds = GetWallClock() - start;
+}
+
+inline u64 JobRange(u32 first, u32 end) { return (u64)first << 32 | end; }
+
+// From the front of the worker's own range
+static bool TakeJob(Worker *worker, u32 *index) {
+  for (;;) {
+    u64 range = AtomicLoad(&worker->range);
+    u32 first = (u32)(range >> 32);
+    u32 end = (u32)range;
+    if (first >= end) return false;
+    if (AtomicCompareExchange(&worker->range, range,
+                              JobRange(first + 1, end))) {
+      *index = first;
+      return true;
+    }
+  }
+}
+
+// Takes the back half of somebody else's range, the worker's own has to be
+// empty. Returns false when there's nothing left anywhere
+static bool StealJobs(Worker *worker) {
+  BatchPool *pool = worker->pool;
+  for (int i = 1; i < pool->num_workers; i++) {
+    Worker *victim =
+        pool->workers + (worker->index + i) % pool->num_workers;
+    for (;;) {
+      u64 range = AtomicLoad(&victim->range);
+      u32 first = (u32)(range >> 32);
+      u32 end = (u32)range;
+      if (first >= end) break;
+      u32 middle = first + (end - first) / 2;
+      if (AtomicCompareExchange(&victim->range, range,
+                                JobRange(first, middle))) {
+        AtomicStore(&worker->range, JobRange(middle, end));
+        worker->steals++;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+#ifdef BUILD_WIN32
+static DWORD WINAPI WorkerThread(void *arg) {
+#else
+static void *WorkerThread(void *arg) {
+#endif
+  Worker *worker = (Worker *)arg;
+  BatchPool *pool = worker->pool;
+  for (;;) {
+    u32 index;
+    if (TakeJob(worker, &index)) {
+      RunJob(pool->jobs + index, pool->tier, worker->metrics);
+      worker->jobs_run++;
+    } else if (!StealJobs(worker)) {
+      break;
+    }
+  }
+  if (worker->metrics != NULL) {
+    // The last job as it was, but finished. Nobody else writes the segment
+    MetricsValues values = worker->metrics->segment->values;
+    r64 now = GetWallClock();
+    values.machine_thread_cpu_ns = CurrentThreadCPUNanoseconds();
+    values.published_ns = (u64)(now * 1e9);
+    values.is_running = 0;
+    PublishMetrics(worker->metrics, &values, now);
+  }
+  return 0;
+}
+
+// Runs all the jobs, the calling thread is one of the workers
+static void RunJobs(BatchPool *pool) {
+  for (int i = 0; i < pool->num_workers; i++) {
+    Worker *worker = pool->workers + i;
+    worker->pool = pool;
+    worker->index = i;
+    u32 first = (u32)((u64)pool->num_jobs * i / pool->num_workers);
+    u32 end = (u32)((u64)pool->num_jobs * (i + 1) / pool->num_workers);
+    worker->range = JobRange(first, end);
+  }
+  ReleaseFence();
+#ifdef BUILD_WIN32
+  HANDLE *threads = (HANDLE *)calloc(pool->num_workers, sizeof(HANDLE));
+  for (int i = 1; i < pool->num_workers; i++) {
+    threads[i] = CreateThread(0, 0, WorkerThread, pool->workers + i, 0, 0);
+  }
+  WorkerThread(pool->workers);
+  for (int i = 1; i < pool->num_workers; i++) {
+    // The ones that didn't start leave their jobs to be stolen
+    if (threads[i] == NULL) continue;
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+#else
+  pthread_t *threads =
+      (pthread_t *)calloc(pool->num_workers, sizeof(pthread_t));
+  bool *started = (bool *)calloc(pool->num_workers, sizeof(bool));
+  for (int i = 1; i < pool->num_workers; i++) {
+    started[i] = pthread_create(threads + i, 0, WorkerThread,
+                                pool->workers + i) == 0;
+  }
+  WorkerThread(pool->workers);
+  for (int i = 1; i < pool->num_workers; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+  }
+  free(started);
+#endif
+  free(threads);
+}
+
+// ================= Report ==================
+
+static void WriteJSONString(FILE *file, char const *text) {
+  fputc('"', file);
+  for (char const *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if ((u8)*c < 0x20) {
+      fprintf(file, "\\u%04x", (u8)*c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+static void WriteHexBytes(FILE *file, u8 *bytes, int length) {
+  fputc('"', file);
+  for (int i = 0; i < length; i++) fprintf(file, "%02X", bytes[i]);
+  fputc('"', file);
+}
+
+static void WriteReport(FILE *file, BatchPool *pool, r64 seconds,
+                        int *counts) {
+  u64 instructions = 0;
+  for (int i = 0; i < pool->num_jobs; i++) {
+    instructions += pool->jobs[i].instructions;
+  }
+  fprintf(file,
+          "{\"threads\":%d,\"tier\":\"%s\",\"dispatch\":\"%s\","
+          "\"seconds\":%.3f,\"instructions\":%llu,\"mips\":%.3f,\n",
+          pool->num_workers, gTierNames[pool->tier], kDispatchName, seconds,
+          (unsigned long long)instructions, instructions / seconds / 1e6);
+  fprintf(file, " \"jobs\":%d", pool->num_jobs);
+  for (int status = Job_Passed; status < kNumJobStatuses; status++) {
+    fprintf(file, ",\"%s\":%d", kJobStatusNames[status], counts[status]);
+  }
+  fprintf(file, ",\n \"workers\":[");
+  for (int i = 0; i < pool->num_workers; i++) {
+    Worker *worker = pool->workers + i;
+    fprintf(file, "%s{\"jobs\":%llu,\"steals\":%llu}", i ? "," : "",
+            (unsigned long long)worker->jobs_run,
+            (unsigned long long)worker->steals);
+  }
+  fprintf(file, "],\n \"results\":[\n");
+  for (int i = 0; i < pool->num_jobs; i++) {
+    Job *job = pool->jobs + i;
+    fprintf(file, "  {\"line\":%d,\"program\":", job->line);
+    WriteJSONString(file, job->program);
+    fprintf(file,
+            ",\"status\":\"%s\",\"cycles\":%llu,\"instructions\":%llu,"
+            "\"pc\":\"$%04X\",\"seconds\":%.6f",
+            kJobStatusNames[job->status], (unsigned long long)job->cycles,
+            (unsigned long long)job->instructions, job->pc, job->seconds);
+    if (job->status == Job_Error) {
+      fprintf(file, ",\"error\":");
+      WriteJSONString(file, job->error);
+    }
+    // Only the ones that got to be checked
+    if (job->status == Job_Passed || job->status == Job_Failed) {
+      fprintf(file, ",\"checks\":[");
+      for (int c = 0; c < job->num_checks; c++) {
+        MemoryCheck *check = job->checks + c;
+        bool same =
+            memcmp(check->actual, check->expected, check->length) == 0;
+        fprintf(file, "%s{\"address\":\"$%04X\",\"ok\":%s,\"expected\":",
+                c ? "," : "", check->address, same ? "true" : "false");
+        WriteHexBytes(file, check->expected, check->length);
+        fprintf(file, ",\"actual\":");
+        WriteHexBytes(file, check->actual, check->length);
+        fprintf(file, "}");
+      }
+      fprintf(file, "]");
+    }
+    fprintf(file, "}%s\n", i + 1 < pool->num_jobs ? "," : "");
+  }
+  fprintf(file, " ]}\n");
+}
+
+int main(int argc, char const *argv[]) {
+  char *manifest = NULL;
+  char const *report_file = NULL;
+  char const *metrics_name = NULL;
+  int num_threads = NumberOfCores();
+  u64 default_cycles = 10 * kCPUFrequency;
+  int tier = Tier_BlockCache;
+  bool ok = true;
+  for (int i = 1; i < argc && ok; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+      default_cycles = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+      char const *name = argv[++i];
+      tier = -1;
+      for (int t = 0; t < Tier_Count; t++) {
+        if (strcmp(name, gTierNames[t]) == 0) tier = t;
+      }
+      ok = tier >= 0;
+    } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+      report_file = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_name = argv[++i];
+    } else if (manifest == NULL) {
+      manifest = (char *)argv[i];
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok || manifest == NULL || num_threads < 1 || default_cycles == 0) {
+    fprintf(stderr,
+            "Usage: %s <manifest> [--threads N] "
+            "[--tier interpreter|block-cache|jit] [--cycles N] "
+            "[--report <file>] [--metrics <name>]\n",
+            argv[0]);
+    return 1;
+  }
+
+  BatchPool pool = {};
+  pool.tier = (Tier)tier;
+  if (!ReadManifest(manifest, default_cycles, &pool.jobs, &pool.num_jobs)) {
+    return 1;
+  }
+  if (pool.num_jobs == 0) {
+    fprintf(stderr, "There are no jobs in %s\n", manifest);
+    return 1;
+  }
+  pool.num_workers = num_threads < pool.num_jobs ? num_threads : pool.num_jobs;
+  pool.workers = (Worker *)calloc(pool.num_workers, sizeof(Worker));
+  for (int i = 0; metrics_name != NULL && i < pool.num_workers; i++) {
+    char name[48];
+    snprintf(name, sizeof(name), "%s-%d", metrics_name, i);
+    pool.workers[i].metrics = StartMetrics(name);
+    if (pool.workers[i].metrics == NULL) {
+      fprintf(stderr, "Couldn't publish metrics as %s\n", name);
+      while (i-- > 0) StopMetrics(pool.workers[i].metrics);
+      return 1;
+    }
+  }
+
+  r64 start = GetWallClock();
+  RunJobs(&pool);
+  r64 seconds = GetWallClock() - start;
+  for (int i = 0; metrics_name != NULL && i < pool.num_workers; i++) {
+    StopMetrics(pool.workers[i].metrics);
+  }
+
+  int counts[kNumJobStatuses] = {};
+  for (int i = 0; i < pool.num_jobs; i++) counts[pool.jobs[i].status]++;
+  FILE *report = report_file ? fopen(report_file, "w") : stdout;
+  if (report == NULL) {
+    fprintf(stderr, "Couldn't write %s\n", report_file);
+    return 1;
+  }
+  WriteReport(report, &pool, seconds, counts);
+  if (report != stdout) fclose(report);
+
+  fprintf(stderr,
+          "%d jobs on %d threads in %.2f s: %d passed, %d failed, "
+          "%d timed out, %d errors\n",
+          pool.num_jobs, pool.num_workers, seconds, counts[Job_Passed],
+          counts[Job_Failed], counts[Job_TimedOut], counts[Job_Error]);
+  return counts[Job_Passed] == pool.num_jobs ? 0 : 1;
+}
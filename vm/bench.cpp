@@ -0,0 +1,396 @@
+// Headless benchmarks for the emulator core, no X11 needed:
+//
+//   bench [--cycles N] [--runs N] [--tier interpreter|block-cache|jit|all]
+//         [--only <name>] [--data <dir>] [--json]
+//
+// Every benchmark runs a program for a fixed number of emulated cycles, a
+// few times over, and reports how fast the host got through it. Most of the
+// programs are generated here, each one hammers a single addressing mode,
+// instruction class, branches, the stack or memory fills. pong.s and dumb.s
+// are the real programs, they're started over whenever they finish.
+//
+// --json prints one JSON object per line so that results can be kept and
+// compared between builds.
+
+#include "base.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef BUILD_WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "vm.cpp"
+
+// A generated program is the setup, then the body repeated a few times in an
+// endless loop, then whatever the body calls. Each copy of the body gets '@'
+// replaced with its number so that its labels are unique
+struct Kernel {
+  char const *name;
+  char const *setup;
+  char const *body;
+  int repeat;
+  char const *subroutines;
+};
+
+// Pointers at $10 and $12 for the indirect modes, both into video memory
+#define KERNEL_POINTERS \
+  "  lda #$00\n"        \
+  "  sta $10\n"         \
+  "  sta $12\n"         \
+  "  lda #$03\n"        \
+  "  sta $11\n"         \
+  "  sta $13\n"         \
+  "  ldx #4\n"          \
+  "  ldy #4\n"
+
+global Kernel const gKernels[] = {
+    // Addressing modes, the same three instructions in each
+    {"mode_immediate", KERNEL_POINTERS,
+     "  lda #1\n  adc #2\n  cmp #3\n", 16, ""},
+    {"mode_zeropage", KERNEL_POINTERS,
+     "  lda $20\n  adc $21\n  sta $22\n", 16, ""},
+    {"mode_zeropage_x", KERNEL_POINTERS,
+     "  lda $20,x\n  adc $21,x\n  sta $22,x\n", 16, ""},
+    {"mode_absolute", KERNEL_POINTERS,
+     "  lda $0300\n  adc $0301\n  sta $0302\n", 16, ""},
+    {"mode_absolute_x", KERNEL_POINTERS,
+     "  lda $0300,x\n  adc $0301,x\n  sta $0302,x\n", 16, ""},
+    {"mode_absolute_y", KERNEL_POINTERS,
+     "  lda $0300,y\n  adc $0301,y\n  sta $0302,y\n", 16, ""},
+    {"mode_indirect_x", KERNEL_POINTERS "  ldx #0\n",
+     "  lda ($10,x)\n  adc ($12,x)\n  sta ($10,x)\n", 16, ""},
+    {"mode_indirect_y", KERNEL_POINTERS,
+     "  lda ($10),y\n  adc ($12),y\n  sta ($10),y\n", 16, ""},
+
+    // Instruction classes
+    {"class_alu", KERNEL_POINTERS,
+     "  adc #3\n  sbc #1\n  and #$7f\n  ora #$10\n  eor #$55\n"
+     "  cmp #$40\n  bit $20\n",
+     16, ""},
+    {"class_shift", KERNEL_POINTERS,
+     "  asl a\n  lsr a\n  rol a\n  ror a\n  asl $20\n  lsr $20\n"
+     "  rol $21\n  ror $21\n",
+     16, ""},
+    {"class_incdec", KERNEL_POINTERS,
+     "  inc $20\n  dec $21\n  inx\n  dey\n  inc $0300\n  dec $0301,x\n", 16,
+     ""},
+    {"class_transfer", KERNEL_POINTERS,
+     "  tax\n  txa\n  tay\n  tya\n  tsx\n  txs\n", 16, ""},
+    {"class_flags", KERNEL_POINTERS,
+     "  clc\n  sec\n  clv\n  sed\n  cld\n  php\n  plp\n", 16, ""},
+    {"class_decimal", KERNEL_POINTERS "  sed\n",
+     "  clc\n  adc #$19\n  sec\n  sbc #$07\n", 16, ""},
+
+    // Branches, half taken and half not
+    {"branches", KERNEL_POINTERS,
+     "  inx\n  txa\n  and #1\n  beq even@\n  nop\n"
+     "even@:\n  cpx #$80\n  bcs high@\n  nop\n"
+     "high@:\n  bmi negative@\n  nop\n"
+     "negative@:\n",
+     8, ""},
+
+    // The stack and subroutines
+    {"stack", KERNEL_POINTERS,
+     "  pha\n  php\n  plp\n  pla\n  jsr subroutine\n", 16,
+     "subroutine:\n  rts\n"},
+
+    // Fills the video memory with a new color every time round
+    {"memory_fill",
+     "  lda #0\n  sta $10\n  lda #2\n  sta $11\n  ldx #0\n",
+     "  txa\n  ldy #0\n"
+     "fill@:\n  sta ($10),y\n  iny\n  bne fill@\n"
+     "  inx\n  inc $11\n  lda $11\n  cmp #$d4\n  bcc done@\n"
+     "  lda #2\n  sta $11\n"
+     "done@:\n",
+     1, ""},
+};
+
+// Real programs, relative to --data
+global char const *const gPrograms[] = {"pong.s", "dumb.s"};
+
+enum Tier {
+  Tier_Interpreter,
+  Tier_BlockCache,
+  Tier_Jit,
+  Tier_Count,
+};
+
+global char const *const gTierNames[Tier_Count] = {"interpreter",
+                                                   "block-cache", "jit"};
+
+static r64 GetWallClock() {
+#ifdef BUILD_WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (r64)counter.QuadPart / (r64)frequency.QuadPart;
+#else
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (r64)time.tv_sec + (r64)time.tv_nsec / 1e9;
+#endif
+}
+
+// Returns a malloc'ed program for the kernel
+static char *GenerateKernel(Kernel const *kernel) {
+  int size = (int)(strlen(kernel->setup) + strlen(kernel->subroutines) +
+                   (strlen(kernel->body) + 16) * kernel->repeat + 64);
+  char *result = (char *)malloc(size);
+  char *at = result;
+  at += sprintf(at, "%sloop:\n", kernel->setup);
+  for (int i = 0; i < kernel->repeat; i++) {
+    for (char const *c = kernel->body; *c; c++) {
+      if (*c == '@') {
+        at += sprintf(at, "_%d", i);
+      } else {
+        *at++ = *c;
+      }
+    }
+  }
+  sprintf(at, "  jmp loop\n%s", kernel->subroutines);
+  return result;
+}
+
+struct Benchmark {
+  char const *name;
+  char *source;     // for generated kernels
+  char *filename;   // for real programs
+};
+
+// What a program looks like right after it's loaded, to start it over
+struct Snapshot {
+  u8 memory[kMachineMemorySize];
+};
+
+static Machine *NewBenchMachine(Benchmark *benchmark, Tier tier,
+                                Snapshot *snapshot) {
+  Machine *machine = NewMachine();
+  if (machine == NULL) return NULL;
+  if (tier != Tier_Interpreter) {
+    machine->cpu.block_cache = NewBlockCache(&machine->bus);
+    if (machine->cpu.block_cache == NULL) {
+      FreeMachine(machine);
+      return NULL;
+    }
+  }
+  if (tier == Tier_Jit) {
+    machine->cpu.jit = NewJit();
+  }
+  bool ok = benchmark->source
+                ? machine->LoadSource(benchmark->source, benchmark->name,
+                                      kPC_start)
+                : machine->LoadProgram(benchmark->filename, kPC_start);
+  if (!ok) {
+    fprintf(stderr, "%s\n", machine->error);
+    FreeMachine(machine);
+    return NULL;
+  }
+  memcpy(snapshot->memory, machine->memory, kMachineMemorySize);
+  return machine;
+}
+
+// Puts the program back the way it was loaded. The clocks keep going
+static void RestartMachine(Machine *machine, Snapshot *snapshot) {
+  memcpy(machine->memory, snapshot->memory, kMachineMemorySize);
+  CPU *cpu = &machine->cpu;
+  CPU fresh = CPU(&machine->bus);
+  fresh.block_cache = cpu->block_cache;
+  fresh.jit = cpu->jit;
+  fresh.cycles = cpu->cycles;
+  fresh.instructions = cpu->instructions;
+  *cpu = fresh;
+  if (cpu->block_cache != NULL) {
+    cpu->block_cache->Reset();
+  }
+  machine->video_control = 0;
+  machine->bus.irq = 0;
+  machine->bus.nmi = false;
+}
+
+struct RunResult {
+  r64 seconds;
+  u64 instructions;
+  u64 cycles;
+  int restarts;
+};
+
+// Only the time spent in Machine::Run counts
+static bool RunOnce(Benchmark *benchmark, Tier tier, u64 cycles,
+                    RunResult *result) {
+  Snapshot *snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+  Machine *machine = NewBenchMachine(benchmark, tier, snapshot);
+  if (machine == NULL) {
+    free(snapshot);
+    return false;
+  }
+  CPU *cpu = &machine->cpu;
+  bool ok = true;
+  result->seconds = 0;
+  result->restarts = 0;
+  while (cpu->cycles < cycles) {
+    r64 start = GetWallClock();
+    StopReason reason = machine->Run(cycles - cpu->cycles);
+    result->seconds += GetWallClock() - start;
+    if (reason == Stop_Error) {
+      fprintf(stderr, "%s: %s\n", benchmark->name, machine->error);
+      ok = false;
+      break;
+    }
+    if (reason == Stop_Halted) {
+      RestartMachine(machine, snapshot);
+      result->restarts++;
+    }
+  }
+  result->instructions = cpu->instructions;
+  result->cycles = cpu->cycles;
+  FreeMachine(machine);
+  free(snapshot);
+  return ok;
+}
+
+static int CompareR64(void const *a, void const *b) {
+  r64 x = *(r64 const *)a;
+  r64 y = *(r64 const *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+struct Options {
+  u64 cycles;
+  int runs;
+  int tier;  // -1 for all
+  char const *only;
+  char const *data;
+  bool json;
+};
+
+// One warm-up run that isn't counted, then the measured ones
+static void RunBenchmark(Benchmark *benchmark, Tier tier, Options *options) {
+  RunResult result;
+  if (!RunOnce(benchmark, tier, options->cycles, &result)) return;
+
+  r64 *mips = (r64 *)malloc(options->runs * sizeof(r64));
+  u64 instructions = 0;
+  int restarts = 0;
+  for (int i = 0; i < options->runs; i++) {
+    if (!RunOnce(benchmark, tier, options->cycles, &result)) {
+      free(mips);
+      return;
+    }
+    mips[i] = result.instructions / result.seconds / 1e6;
+    instructions = result.instructions;  // the same every time
+    restarts = result.restarts;
+  }
+
+  r64 mean = 0;
+  for (int i = 0; i < options->runs; i++) mean += mips[i];
+  mean /= options->runs;
+  r64 variance = 0;
+  for (int i = 0; i < options->runs; i++) {
+    variance += (mips[i] - mean) * (mips[i] - mean);
+  }
+  r64 stddev = options->runs > 1 ? sqrt(variance / (options->runs - 1)) : 0;
+  qsort(mips, options->runs, sizeof(r64), CompareR64);
+  int n = options->runs;
+  r64 median = n % 2 ? mips[n / 2] : (mips[n / 2 - 1] + mips[n / 2]) / 2;
+  r64 ns_per_instruction = 1e3 / median;
+  r64 cv = 100.0 * stddev / mean;  // in percent
+
+  if (options->json) {
+    printf("{\"benchmark\":\"%s\",\"tier\":\"%s\",\"dispatch\":\"%s\","
+           "\"cycles\":%llu,\"instructions\":%llu,\"restarts\":%d,"
+           "\"runs\":%d,\"mips_median\":%.3f,\"mips_mean\":%.3f,"
+           "\"mips_min\":%.3f,\"mips_max\":%.3f,\"mips_stddev\":%.3f,"
+           "\"cv_percent\":%.2f,\"ns_per_instruction\":%.3f}\n",
+           benchmark->name, gTierNames[tier], kDispatchName,
+           (unsigned long long)options->cycles,
+           (unsigned long long)instructions, restarts, n, median, mean,
+           mips[0], mips[n - 1], stddev, cv, ns_per_instruction);
+  } else {
+    printf("%-16s %-12s %9.1f %9.1f %9.1f %6.1f%% %8.2f\n", benchmark->name,
+           gTierNames[tier], median, mips[0], mips[n - 1], cv,
+           ns_per_instruction);
+  }
+  fflush(stdout);
+  free(mips);
+}
+
+int main(int argc, char const *argv[]) {
+  Options options = {};
+  options.cycles = 20 * kCPUFrequency;
+  options.runs = 5;
+  options.tier = -1;
+  options.data = "test";
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+      options.cycles = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      options.runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+      char const *name = argv[++i];
+      options.tier = -2;
+      if (strcmp(name, "all") == 0) options.tier = -1;
+      for (int t = 0; t < Tier_Count; t++) {
+        if (strcmp(name, gTierNames[t]) == 0) options.tier = t;
+      }
+    } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+      options.only = argv[++i];
+    } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+      options.data = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else {
+      options.tier = -2;
+      break;
+    }
+  }
+  if (options.tier == -2 || options.runs < 1 || options.cycles == 0) {
+    fprintf(stderr,
+            "Usage: %s [--cycles N] [--runs N] "
+            "[--tier interpreter|block-cache|jit|all] [--only <name>] "
+            "[--data <dir with pong.s and dumb.s>] [--json]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int num_benchmarks = COUNT_OF(gKernels) + COUNT_OF(gPrograms);
+  Benchmark *benchmarks =
+      (Benchmark *)calloc(num_benchmarks, sizeof(Benchmark));
+  for (int i = 0; i < (int)COUNT_OF(gKernels); i++) {
+    benchmarks[i].name = gKernels[i].name;
+    benchmarks[i].source = GenerateKernel(gKernels + i);
+  }
+  for (int i = 0; i < (int)COUNT_OF(gPrograms); i++) {
+    Benchmark *benchmark = benchmarks + COUNT_OF(gKernels) + i;
+    benchmark->name = gPrograms[i];
+    int size = (int)(strlen(options.data) + strlen(gPrograms[i]) + 2);
+    benchmark->filename = (char *)malloc(size);
+    snprintf(benchmark->filename, size, "%s/%s", options.data, gPrograms[i]);
+  }
+
+  if (!options.json) {
+    printf("%llu cycles per run, %d runs, %s dispatch\n",
+           (unsigned long long)options.cycles, options.runs, kDispatchName);
+    printf("%-16s %-12s %9s %9s %9s %7s %8s\n", "benchmark", "tier",
+           "Mips", "min", "max", "cv", "ns/instr");
+  }
+  for (int i = 0; i < num_benchmarks; i++) {
+    Benchmark *benchmark = benchmarks + i;
+    if (options.only && strcmp(options.only, benchmark->name) != 0) continue;
+    for (int tier = 0; tier < Tier_Count; tier++) {
+      if (options.tier >= 0 && options.tier != tier) continue;
+      RunBenchmark(benchmark, (Tier)tier, &options);
+    }
+  }
+
+  for (int i = 0; i < num_benchmarks; i++) {
+    free(benchmarks[i].source);
+    free(benchmarks[i].filename);
+  }
+  free(benchmarks);
+  return 0;
+}
@@ -0,0 +1,370 @@
+// ================= Pre-decoded basic blocks ==================
+#ifndef BLOCK_CACHE_CPP
+#define BLOCK_CACHE_CPP
+
+// A block is a straight run of instructions ending with one that can change
+// the flow (branch, jump, etc.). Blocks are decoded once and then executed
+// without looking at the instruction bytes again. Pages that hold cached
+// blocks trap writes on the MemoryBus, and any store to such a page throws
+// away all blocks on that page.
+//
+// Blocks that only spin until a counter runs out or until some memory
+// changes are recognized when decoded, and Run skips over them instead of
+// going round (see CPU::RunIdleLoop).
+//
+// The interpreter runs a block as a list of steps. A step is usually one
+// instruction, or two when they make one of the pairs in fusion.cpp.
+
+global int const kMaxBlockInstructions = 16;
+global int const kMaxBlocks = 1024;
+global int const kBlockLookupSize = 4096;  // must be a power of 2
+
+struct DecodedInstruction {
+  DecodedOpcodeHandler handler;
+  u16 operand;
+  u8 length;
+  u8 opcode;
+};
+
+// A fused pair's handler moves PC past the second instruction itself
+struct BlockStep {
+  DecodedOpcodeHandler handler;
+  int operand;  // a fused pair has the second operand in the high 16 bits
+  u8 length;    // of the first instruction
+  u8 num_instructions;
+};
+
+enum IdleLoop {
+  Idle_None = 0,
+  Idle_Countdown,  // dex/dey/inx/iny and a bne back to the start
+  Idle_Poll,       // reads and compares, then a branch back to the start
+};
+
+struct Block {
+  u16 start;  // address of the first instruction
+  u16 last;   // address of the last byte of the last instruction
+  bool is_valid;
+  u8 idle_loop;  // IdleLoop
+  int num_instructions;
+  DecodedInstruction instructions[kMaxBlockInstructions];
+  int num_steps;
+  BlockStep steps[kMaxBlockInstructions];
+
+  u32 execution_count;
+  void *jit_code;  // NULL until translated, see Jit
+};
+
+struct BlockCache {
+  MemoryBus *bus;
+
+  Block *lookup[kBlockLookupSize];  // direct-mapped by start address
+  Block blocks[kMaxBlocks];
+  int num_blocks;
+
+  u16 blocks_on_page[256];  // how many valid blocks touch each page
+  u32 generation;           // changes every time blocks are invalidated
+  u8 jit_flush_pending;     // translated code may be stale, see Jit
+
+  u64 blocks_decoded;
+  u64 blocks_invalidated;
+
+  bool fuse_pairs;       // on by default
+  bool skip_idle_loops;  // on by default
+  u64 fused_pairs_executed[kNumFusedPairs];
+  u64 idle_cycles_skipped;
+
+  void Reset();
+  Block *GetBlock(u16 address);
+  Block *Decode(u16 address);
+  void BuildSteps(Block *block);
+  void InvalidatePage(int page);
+  void PrintFusionReport();
+};
+
+// Hooks itself up to the bus so that it hears about stores to code.
+// Returns NULL if out of memory
+static BlockCache *NewBlockCache(MemoryBus *bus) {
+  BlockCache *result = (BlockCache *)calloc(1, sizeof(BlockCache));
+  if (result == NULL) return NULL;
+  result->bus = bus;
+  result->fuse_pairs = true;
+  result->skip_idle_loops = true;
+  result->Reset();
+  bus->block_cache = result;
+  return result;
+}
+
+static void FreeBlockCache(BlockCache *cache) {
+  cache->Reset();  // gives the pages back their write pointers
+  cache->bus->block_cache = NULL;
+  free(cache);
+}
+
+void BlockCache::Reset() {
+  for (int page = 0; page < kNumPages; page++) {
+    if (this->blocks_on_page[page]) {
+      this->bus->TrapWrites(page, false);
+    }
+  }
+  memset(this->lookup, 0, sizeof(this->lookup));
+  memset(this->blocks_on_page, 0, sizeof(this->blocks_on_page));
+  this->num_blocks = 0;
+  this->generation++;
+  this->jit_flush_pending = true;
+}
+
+inline bool EndsBlock(InstructionType type) {
+  switch (type) {
+    case I_BCC:
+    case I_BCS:
+    case I_BEQ:
+    case I_BMI:
+    case I_BNE:
+    case I_BPL:
+    case I_BVC:
+    case I_BVS:
+    case I_JMP:
+    case I_JSR:
+    case I_RTS:
+    case I_RTI:
+    case I_BRK:
+    case I_END:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline bool IsConditionalBranch(InstructionType type) {
+  return type != I_JMP && type != I_JSR && type != I_RTS && type != I_RTI &&
+         type != I_BRK && type != I_END && EndsBlock(type);
+}
+
+// Instructions that can go in a polling loop: nothing that stores, uses
+// the stack or changes the flow. Indexed absolute and indirect reads may
+// land on a device, so they're out too
+inline bool CanPoll(InstructionType type, AddressingMode mode) {
+  switch (mode) {
+    case AM_Immediate:
+    case AM_Implied:
+    case AM_Accumulator:
+    case AM_Zeropage:
+    case AM_Zeropage_X:
+    case AM_Zeropage_Y:
+    case AM_Absolute:
+      break;
+    default:
+      return false;
+  }
+  switch (type) {
+    case I_ADC:
+    case I_AND:
+    case I_BIT:
+    case I_CLC:
+    case I_CLV:
+    case I_CMP:
+    case I_CPX:
+    case I_CPY:
+    case I_EOR:
+    case I_LDA:
+    case I_LDX:
+    case I_LDY:
+    case I_NOP:
+    case I_ORA:
+    case I_SBC:
+    case I_SEC:
+    case I_TAX:
+    case I_TAY:
+    case I_TXA:
+    case I_TYA:
+      return true;
+    case I_ASL:
+    case I_LSR:
+    case I_ROL:
+    case I_ROR:
+      return mode == AM_Accumulator;
+    default:
+      return false;
+  }
+}
+
+static IdleLoop FindIdleLoop(Block *block) {
+  DecodedInstruction *last = block->instructions + block->num_instructions - 1;
+  if (!IsConditionalBranch(KnownType(last->opcode)) ||
+      last->operand != block->start) {
+    return Idle_None;
+  }
+
+  if (block->num_instructions == 2 && last->opcode == 0xD0) {
+    InstructionType type = KnownType(block->instructions[0].opcode);
+    if (type == I_DEX || type == I_DEY || type == I_INX || type == I_INY) {
+      return Idle_Countdown;
+    }
+  }
+
+  for (int i = 0; i < block->num_instructions - 1; i++) {
+    u8 opcode = block->instructions[i].opcode;
+    if (!CanPoll(KnownType(opcode), KnownMode(opcode))) {
+      return Idle_None;
+    }
+  }
+  return Idle_Poll;
+}
+
+// Returns NULL if there can't be a block at this address
+Block *BlockCache::GetBlock(u16 address) {
+  Block *block = this->lookup[address & (kBlockLookupSize - 1)];
+  if (block != NULL && block->is_valid && block->start == address) {
+    return block;
+  }
+  return this->Decode(address);
+}
+
+// Only code in RAM and ROM gets decoded, devices are left to the interpreter.
+// So is code on the zero page and the stack, stores there aren't trapped
+Block *BlockCache::Decode(u16 address) {
+  if ((address >> 8) < kFirstMappablePage) return NULL;
+  if (this->num_blocks >= kMaxBlocks) {
+    // Out of space, start over
+    this->Reset();
+  }
+
+  Block *block = this->blocks + this->num_blocks;
+  block->start = address;
+  block->num_instructions = 0;
+  block->execution_count = 0;
+  block->jit_code = NULL;
+
+  int pc = address;
+  while (block->num_instructions < kMaxBlockInstructions) {
+    u8 *memory = this->bus->read[pc >> 8];
+    if (memory == NULL) break;
+    u8 opcode = memory[pc];
+    int bytes = gBytesForAddressingMode[KnownMode(opcode)];
+    if (pc + bytes > kMachineMemorySize) {
+      // Blocks don't wrap around the end of memory
+      break;
+    }
+    if (this->bus->read[(pc + bytes - 1) >> 8] != memory) {
+      // The instruction runs into a device page
+      break;
+    }
+
+    DecodedInstruction *instruction =
+        block->instructions + block->num_instructions;
+    instruction->handler = gDecodedOpcodeHandlers[opcode];
+    instruction->opcode = opcode;
+    instruction->length = (u8)bytes;
+    instruction->operand = 0;
+    if (bytes == 2) {
+      instruction->operand = memory[pc + 1];
+    } else if (bytes == 3) {
+      instruction->operand = (u16)(memory[pc + 2] << 8 | memory[pc + 1]);
+    }
+    block->num_instructions++;
+    pc += bytes;
+
+    if (EndsBlock(KnownType(opcode))) break;
+  }
+
+  if (block->num_instructions == 0) {
+    return NULL;
+  }
+
+  this->BuildSteps(block);
+  block->idle_loop = (u8)FindIdleLoop(block);
+  block->last = (u16)(pc - 1);
+  block->is_valid = true;
+  for (int page = block->start >> 8; page <= block->last >> 8; page++) {
+    if (this->blocks_on_page[page]++ == 0) {
+      this->bus->TrapWrites(page, true);
+    }
+  }
+  this->lookup[address & (kBlockLookupSize - 1)] = block;
+  this->num_blocks++;
+  this->blocks_decoded++;
+
+  return block;
+}
+
+// Pairs are matched from the end of the block backwards, so that the branch
+// that ends it goes together with the compare or decrement it tests
+void BlockCache::BuildSteps(Block *block) {
+  int pair_at[kMaxBlockInstructions];
+  for (int i = 0; i < block->num_instructions; i++) {
+    pair_at[i] = -1;
+  }
+  if (this->fuse_pairs) {
+    for (int i = block->num_instructions - 2; i >= 0; i--) {
+      if (pair_at[i + 1] >= 0) continue;  // already taken
+      pair_at[i] = FindFusedPair(block->instructions[i].opcode,
+                                 block->instructions[i + 1].opcode);
+    }
+  }
+
+  block->num_steps = 0;
+  for (int i = 0; i < block->num_instructions;) {
+    DecodedInstruction *instruction = block->instructions + i;
+    BlockStep *step = block->steps + block->num_steps++;
+    step->length = instruction->length;
+    if (pair_at[i] >= 0) {
+      step->handler = gFusedPairs[pair_at[i]].handler;
+      step->operand = (int)((u32)instruction[1].operand << 16 |
+                            instruction->operand);
+      step->num_instructions = 2;
+      i += 2;
+    } else {
+      step->handler = instruction->handler;
+      step->operand = instruction->operand;
+      step->num_instructions = 1;
+      i++;
+    }
+  }
+}
+
+force_inline void CountFusedPair(CPU *cpu, int pair) {
+  cpu->block_cache->fused_pairs_executed[pair]++;
+}
+
+void BlockCache::PrintFusionReport() {
+  u64 total = 0;
+  for (int i = 0; i < kNumFusedPairs; i++) {
+    total += this->fused_pairs_executed[i];
+  }
+  print("Fused pairs: %llu executed, one dispatch each instead of two\n",
+        (unsigned long long)total);
+  for (int i = 0; i < kNumFusedPairs; i++) {
+    u64 count = this->fused_pairs_executed[i];
+    if (count == 0) continue;
+    print("  %-16s %12llu  %5.1f%%\n", gFusedPairs[i].name,
+          (unsigned long long)count, 100.0 * count / total);
+  }
+}
+
+static void InvalidateCodeOnPage(BlockCache *cache, int page) {
+  if (cache != NULL && cache->blocks_on_page[page]) {
+    cache->InvalidatePage(page);
+  }
+}
+
+void BlockCache::InvalidatePage(int page) {
+  for (int i = 0; i < this->num_blocks; i++) {
+    Block *block = this->blocks + i;
+    if (!block->is_valid) continue;
+    if (block->start >> 8 > page || block->last >> 8 < page) continue;
+
+    block->is_valid = false;
+    if (block->jit_code != NULL) {
+      this->jit_flush_pending = true;
+    }
+    for (int p = block->start >> 8; p <= block->last >> 8; p++) {
+      if (--this->blocks_on_page[p] == 0) {
+        this->bus->TrapWrites(p, false);
+      }
+    }
+    this->blocks_invalidated++;
+  }
+  this->generation++;
+}
+
+#endif  // BLOCK_CACHE_CPP
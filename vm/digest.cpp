@@ -0,0 +1,162 @@
+// ================= State digests ==================
+#ifndef DIGEST_CPP
+#define DIGEST_CPP
+
+// With Instrument_Digest the CPU writes a digest of the whole machine
+// every interval cycles: the registers and a hash of the 64K of memory.
+// Two runs that should behave the same write the same digests, and
+// digest_diff finds the first interval where they don't.
+//
+// The memory hash is kept per page. Stores mark their page dirty, and a
+// checkpoint only rehashes the dirty pages, then hashes the 256 page hashes.
+// Memory that changes without a CPU store (LoadProgram, a debugger) isn't
+// noticed until MarkAllDirty.
+//
+// A checkpoint is taken before the first instruction that starts at or
+// after a multiple of interval, so it lands on the same instruction in
+// every run that executes the same instructions.
+
+global u64 const kDigestPrime1 = 0x9E3779B185EBCA87ULL;
+global u64 const kDigestPrime2 = 0xC2B2AE3D27D4EB4FULL;
+
+force_inline u64 RotateLeft(u64 value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Not cryptographic. Four lanes that don't depend on each other, so the
+// loads and multiplies overlap and the compiler can vectorize the loop.
+// size has to be a multiple of 32
+static u64 HashBytes(void const *data, int size, u64 seed) {
+  u8 const *bytes = (u8 const *)data;
+  u64 lanes[4] = {seed + kDigestPrime1, seed ^ kDigestPrime2, seed,
+                  seed - kDigestPrime1};
+  for (int offset = 0; offset < size; offset += 32) {
+    for (int lane = 0; lane < 4; lane++) {
+      u64 word;
+      memcpy(&word, bytes + offset + lane * 8, sizeof(word));
+      lanes[lane] = RotateLeft(lanes[lane] + word * kDigestPrime2, 31) *
+                    kDigestPrime1;
+    }
+  }
+  u64 hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) +
+             RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18) + size;
+  // Mix the bits down, as in splitmix64
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  return hash ^ (hash >> 31);
+}
+
+struct DigestRecord {
+  u64 cycle;
+  u64 memory_hash;
+  u64 state_hash;  // memory_hash and the registers
+  u16 pc;
+  u8 A;
+  u8 X;
+  u8 Y;
+  u8 SP;
+  u8 status;  // as GetStatus returns it
+  u8 pad;
+};
+
+static_assert(sizeof(DigestRecord) == 32, "digest files depend on it");
+
+global char const kDigestMagic[8] = {'6', '5', '0', '2', 'D', 'G', 'S', 'T'};
+
+// The records follow right after it
+struct DigestFileHeader {
+  char magic[8];
+  u32 record_size;
+  u32 reserved;
+  u64 interval;  // cycles
+  u64 pad[5];
+};
+
+static_assert(sizeof(DigestFileHeader) == 64, "digest files depend on it");
+
+struct StateDigest {
+  u8 *memory;
+  u64 interval;
+  u64 next_checkpoint;
+  bool dirty[kNumPages];
+  u64 page_hashes[kNumPages];
+
+  FILE *file;  // may be NULL, then only last is kept
+  DigestRecord last;
+  u64 num_records;
+
+  inline void MarkDirty(u32 address);
+  void MarkAllDirty();
+  void Checkpoint(DigestRecord *record);
+};
+
+force_inline void StateDigest::MarkDirty(u32 address) {
+  this->dirty[(u16)address >> 8] = true;
+}
+
+void StateDigest::MarkAllDirty() {
+  for (int page = 0; page < kNumPages; page++) {
+    this->dirty[page] = true;
+  }
+}
+
+// Fills in the hashes of a record that has the registers, and writes it
+void StateDigest::Checkpoint(DigestRecord *record) {
+  for (int page = 0; page < kNumPages; page++) {
+    if (!this->dirty[page]) continue;
+    this->page_hashes[page] = HashBytes(this->memory + page * 256, 256, page);
+    this->dirty[page] = false;
+  }
+  record->memory_hash =
+      HashBytes(this->page_hashes, sizeof(this->page_hashes), 0);
+  u64 registers = (u64)record->pc | (u64)record->A << 16 |
+                  (u64)record->X << 24 | (u64)record->Y << 32 |
+                  (u64)record->SP << 40 | (u64)record->status << 48;
+  u64 state[4] = {record->memory_hash, registers, record->cycle, 0};
+  record->state_hash = HashBytes(state, sizeof(state), 0);
+  record->pad = 0;
+
+  this->last = *record;
+  this->num_records++;
+  if (this->file != NULL) {
+    fwrite(record, sizeof(DigestRecord), 1, this->file);
+  }
+  this->next_checkpoint = (record->cycle / this->interval + 1) * this->interval;
+}
+
+// filename may be NULL to only keep the last record. Returns NULL if the
+// file can't be created
+static StateDigest *NewStateDigest(u8 *memory, u64 interval,
+                                   char *filename) {
+  StateDigest *digest = (StateDigest *)calloc(1, sizeof(StateDigest));
+  if (digest == NULL) return NULL;
+  digest->memory = memory;
+  digest->interval = interval > 0 ? interval : 1;
+  digest->MarkAllDirty();
+  if (filename != NULL) {
+    digest->file = fopen(filename, "wb");
+    if (digest->file == NULL) {
+      free(digest);
+      return NULL;
+    }
+    DigestFileHeader header = {};
+    memcpy(header.magic, kDigestMagic, sizeof(kDigestMagic));
+    header.record_size = sizeof(DigestRecord);
+    header.interval = digest->interval;
+    fwrite(&header, sizeof(header), 1, digest->file);
+  }
+  return digest;
+}
+
+// Returns false if the file couldn't be written
+static bool FreeStateDigest(StateDigest *digest) {
+  bool ok = true;
+  if (digest->file != NULL) {
+    ok = !ferror(digest->file);
+    ok = fclose(digest->file) == 0 && ok;
+  }
+  free(digest);
+  return ok;
+}
+
+#endif  // DIGEST_CPP
@@ -0,0 +1,229 @@
+// Finds the first interval where two runs went apart, from the digests
+// they wrote with --digest. With --replay it runs the program again up to
+// the last checkpoint they agree on, then prints every instruction of the
+// interval after it into a text file:
+//
+//   digest_diff <a> <b> [--replay <program> --trace <file>] [--block-cache]
+//
+// The replay has to run the way the run that wrote <a> did, e.g. with the
+// block cache if that one had it.
+
+#include "base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.cpp"
+
+struct DigestStream {
+  char const *filename;
+  u64 interval;
+  DigestRecord *records;
+  u64 num_records;
+};
+
+static bool ReadDigestStream(char const *filename, DigestStream *stream) {
+  stream->filename = filename;
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", filename);
+    return false;
+  }
+  DigestFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, kDigestMagic, sizeof(kDigestMagic)) != 0 ||
+      header.record_size != sizeof(DigestRecord)) {
+    fprintf(stderr, "%s is not a digest file\n", filename);
+    fclose(file);
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, sizeof(header), SEEK_SET);
+  stream->interval = header.interval;
+  stream->num_records = (u64)(size - sizeof(header)) / sizeof(DigestRecord);
+  stream->records =
+      (DigestRecord *)malloc((stream->num_records + 1) * sizeof(DigestRecord));
+  if (stream->records == NULL) {
+    fprintf(stderr, "Not enough memory for %s\n", filename);
+    fclose(file);
+    return false;
+  }
+  stream->num_records = fread(stream->records, sizeof(DigestRecord),
+                              stream->num_records, file);
+  fclose(file);
+  return true;
+}
+
+static bool SameState(DigestRecord *a, DigestRecord *b) {
+  return a->cycle == b->cycle && a->state_hash == b->state_hash;
+}
+
+static void PrintRecord(char const *name, DigestRecord *record) {
+  printf("  %-12s cycle %llu  PC=$%04X A=$%02X X=$%02X Y=$%02X SP=$%02X "
+         "P=$%02X  memory %016llx\n",
+         name, (unsigned long long)record->cycle, record->pc, record->A,
+         record->X, record->Y, record->SP, record->status,
+         (unsigned long long)record->memory_hash);
+}
+
+// Runs up to cycle and makes sure there's a checkpoint for it, the run may
+// stop right before the instruction that would take it
+static bool ReplayUntil(Machine *machine, u64 cycle) {
+  CPU *cpu = &machine->cpu;
+  if (cpu->cycles < cycle) {
+    StopReason reason = machine->Run(cycle - cpu->cycles);
+    if (reason == Stop_Error) {
+      fprintf(stderr, "%s\n", machine->error);
+      return false;
+    }
+  }
+  StateDigest *digest = cpu->digest;
+  if (cpu->cycles == cycle &&
+      (digest->num_records == 0 || digest->last.cycle != cycle)) {
+    TakeCheckpoint(cpu, cpu->PC);
+  }
+  return true;
+}
+
+// Prints which of the streams the replay agrees with
+static void PrintReplayMatch(DigestRecord *replay, DigestStream *a,
+                             DigestStream *b, u64 index) {
+  bool in_a = index < a->num_records && SameState(replay, a->records + index);
+  bool in_b = index < b->num_records && SameState(replay, b->records + index);
+  PrintRecord("replay", replay);
+  if (in_a && in_b) {
+    printf("The replay agrees with both\n");
+  } else if (in_a || in_b) {
+    printf("The replay agrees with %s\n", in_a ? a->filename : b->filename);
+  } else {
+    printf("The replay agrees with neither\n");
+  }
+}
+
+int main(int argc, char const *argv[]) {
+  char const *filenames[2] = {};
+  int num_filenames = 0;
+  char *program = NULL;
+  char *trace_file = NULL;
+  bool use_block_cache = false;
+  bool ok = true;
+  for (int i = 1; i < argc && ok; i++) {
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      program = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_file = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--block-cache") == 0) {
+      use_block_cache = true;
+    } else if (num_filenames < 2) {
+      filenames[num_filenames++] = argv[i];
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok || num_filenames != 2 || (program != NULL) != (trace_file != NULL)) {
+    fprintf(stderr,
+            "Usage: %s <digests a> <digests b> "
+            "[--replay <program> --trace <file>] [--block-cache]\n",
+            argv[0]);
+    return 1;
+  }
+
+  DigestStream a, b;
+  if (!ReadDigestStream(filenames[0], &a) ||
+      !ReadDigestStream(filenames[1], &b)) {
+    return 1;
+  }
+  if (a.interval != b.interval) {
+    fprintf(stderr, "The digests were taken every %llu and %llu cycles\n",
+            (unsigned long long)a.interval, (unsigned long long)b.interval);
+    return 1;
+  }
+
+  // Once apart, runs don't usually come back together, so the first
+  // difference can be searched for
+  u64 count = a.num_records < b.num_records ? a.num_records : b.num_records;
+  u64 low = 0;
+  u64 high = count;
+  while (low < high) {
+    u64 middle = low + (high - low) / 2;
+    if (SameState(a.records + middle, b.records + middle)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  u64 first = low;  // the first checkpoint that differs
+
+  if (first == count) {
+    if (a.num_records == b.num_records) {
+      printf("All %llu checkpoints are the same\n", (unsigned long long)count);
+    } else {
+      DigestStream *longer = a.num_records > b.num_records ? &a : &b;
+      printf("The first %llu checkpoints are the same, then only %s goes "
+             "on\n",
+             (unsigned long long)count, longer->filename);
+    }
+    return 0;
+  }
+
+  if (first > 0) {
+    printf("Same up to checkpoint %llu:\n", (unsigned long long)(first - 1));
+    PrintRecord("both", a.records + first - 1);
+  } else {
+    printf("Different from the first checkpoint on\n");
+  }
+  printf("Apart at checkpoint %llu:\n", (unsigned long long)first);
+  PrintRecord(filenames[0], a.records + first);
+  PrintRecord(filenames[1], b.records + first);
+  if (program == NULL) return 1;
+
+  // Replay it, with a trace of the interval where they went apart
+  Machine *machine = NewMachine(Instrument_Digest);
+  if (machine != NULL) {
+    machine->cpu.digest = NewStateDigest(machine->memory, a.interval, NULL);
+  }
+  if (machine == NULL || machine->cpu.digest == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return 1;
+  }
+  if (use_block_cache) {
+    machine->cpu.block_cache = NewBlockCache(&machine->bus);
+    if (machine->cpu.block_cache == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return 1;
+    }
+  }
+  if (!machine->LoadProgram(program, kPC_start)) {
+    fprintf(stderr, "%s\n", machine->error);
+    return 1;
+  }
+  u64 start = first > 0 ? a.records[first - 1].cycle : 0;
+  if (!ReplayUntil(machine, start)) return 1;
+  if (first > 0) {
+    printf("\nReplayed up to cycle %llu\n", (unsigned long long)start);
+    PrintReplayMatch(&machine->cpu.digest->last, &a, &b, first - 1);
+  }
+
+  machine->cpu.trace = fopen(trace_file, "w");
+  if (machine->cpu.trace == NULL) {
+    fprintf(stderr, "Couldn't create %s\n", trace_file);
+    return 1;
+  }
+  machine->cpu.instruments |= Instrument_Trace;
+  u64 end = a.records[first].cycle;
+  u64 traced = machine->cpu.instructions;
+  bool replayed = ReplayUntil(machine, end);
+  traced = machine->cpu.instructions - traced;
+  fclose(machine->cpu.trace);
+  machine->cpu.trace = NULL;
+  machine->cpu.instruments &= ~Instrument_Trace;
+  if (!replayed) return 1;
+  printf("\nTraced %llu instructions up to cycle %llu into %s\n",
+         (unsigned long long)traced, (unsigned long long)end, trace_file);
+  PrintReplayMatch(&machine->cpu.digest->last, &a, &b, first);
+
+  FreeMachine(machine);
+  return 1;
+}
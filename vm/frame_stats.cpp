@@ -0,0 +1,214 @@
+// ================= Frame timing ==================
+#ifndef FRAME_STATS_CPP
+#define FRAME_STATS_CPP
+
+// The platform layer times each stage of its render loop (taking events,
+// converting video memory to pixels, presenting) and the whole frame, and
+// FrameStats keeps a histogram for each. Times are in nanoseconds.
+//
+// The histograms are log-linear: exact below 32 ns, then 16 buckets per
+// power of two, so a percentile is off by at most 1/16 and the whole
+// range of u64 fits in a fixed array.
+//
+// InputLatencyProbe times key events from the moment the platform layer
+// takes them to the end of presenting the first frame that can show what
+// the program did with them. That's the first frame converted after the
+// one in which the program read the event from the input device.
+
+global int const kHistogramSubBuckets = 16;
+global int const kHistogramBuckets = 64 * kHistogramSubBuckets;
+
+struct Histogram {
+  u64 counts[kHistogramBuckets];
+  u64 count;
+  u64 sum;
+  u64 max;
+
+  void Add(u64 value);
+  u64 Percentile(r64 percent);
+};
+
+static int HistogramBucket(u64 value) {
+  int shift = 0;
+  while ((value >> shift) >= 2 * kHistogramSubBuckets) shift++;
+  return shift * kHistogramSubBuckets + (int)(value >> shift);
+}
+
+// The highest value that goes into bucket
+static u64 HistogramBucketTop(int bucket) {
+  if (bucket < 2 * kHistogramSubBuckets) return (u64)bucket;
+  int shift = bucket / kHistogramSubBuckets - 1;
+  u64 mantissa = (u64)(bucket - shift * kHistogramSubBuckets);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::Add(u64 value) {
+  this->counts[HistogramBucket(value)]++;
+  this->count++;
+  this->sum += value;
+  if (value > this->max) this->max = value;
+}
+
+// E.g. 99 for p99. Never more than max
+u64 Histogram::Percentile(r64 percent) {
+  if (this->count == 0) return 0;
+  u64 rank = (u64)(this->count * percent / 100.0);
+  if (rank >= this->count) rank = this->count - 1;
+  u64 seen = 0;
+  for (int bucket = 0; bucket < kHistogramBuckets; bucket++) {
+    seen += this->counts[bucket];
+    if (seen > rank) {
+      u64 top = HistogramBucketTop(bucket);
+      return top < this->max ? top : this->max;
+    }
+  }
+  return this->max;
+}
+
+enum FrameStage {
+  Stage_Events = 0,
+  Stage_Convert,
+  Stage_Present,
+  Stage_Frame,  // the whole loop, start to start
+  kNumFrameStages,
+};
+
+global char const *const kFrameStageNames[kNumFrameStages] = {
+    "events", "convert", "present", "frame"};
+
+global r64 const kInputProbeTimeout = 1.0;  // seconds
+
+// Times one event at a time, the ones that come in meanwhile are skipped
+struct InputLatencyProbe {
+  Histogram latency;
+  u64 sequence;  // of the event being timed, 0 if none
+  r64 event_time;
+  bool in_this_frame;  // the frame being presented shows it
+  u64 unread;  // events the program didn't read within kInputProbeTimeout
+
+  void OnEvent(u64 sequence, r64 now);
+  void BeforeConvert(InputDevice *input, u64 frame, r64 now);
+  void AfterPresent(r64 now);
+};
+
+// sequence is what InputQueue::Push returned
+void InputLatencyProbe::OnEvent(u64 sequence, r64 now) {
+  if (this->sequence != 0 || sequence == 0) return;
+  this->sequence = sequence;
+  this->event_time = now;
+}
+
+// frame is the machine's frame counter
+void InputLatencyProbe::BeforeConvert(InputDevice *input, u64 frame,
+                                      r64 now) {
+  if (this->sequence == 0) return;
+  // The device stores seen_frame first, so this one is at least as new as
+  // the sequence. If it's newer the event waits for a later frame
+  u64 seen_sequence = AtomicLoad(&input->seen_sequence);
+  u64 seen_frame = AtomicLoad(&input->seen_frame);
+  if (seen_sequence >= this->sequence) {
+    this->in_this_frame = frame > seen_frame;
+  } else if (now - this->event_time > kInputProbeTimeout) {
+    this->unread++;
+    this->sequence = 0;
+  }
+}
+
+void InputLatencyProbe::AfterPresent(r64 now) {
+  if (!this->in_this_frame) return;
+  this->latency.Add((u64)((now - this->event_time) * 1e9));
+  this->in_this_frame = false;
+  this->sequence = 0;
+}
+
+struct FrameStats {
+  Histogram stages[kNumFrameStages];
+  InputLatencyProbe input;
+  r64 frame_start;  // seconds, 0 before the first frame
+  r64 stage_start;
+
+  // For the overlay, updated once a second
+  r64 window_start;
+  u64 window_frames;
+  r64 frames_per_second;
+
+  void StartFrame(r64 now);
+  void EndStage(FrameStage stage, r64 now);
+};
+
+// Also ends the last frame
+void FrameStats::StartFrame(r64 now) {
+  if (this->frame_start > 0) {
+    this->stages[Stage_Frame].Add((u64)((now - this->frame_start) * 1e9));
+  } else {
+    this->window_start = now;
+  }
+  this->frame_start = now;
+  this->stage_start = now;
+
+  this->window_frames++;
+  if (now - this->window_start >= 1.0) {
+    this->frames_per_second = this->window_frames / (now - this->window_start);
+    this->window_start = now;
+    this->window_frames = 0;
+  }
+}
+
+// The next stage starts where this one ends
+void FrameStats::EndStage(FrameStage stage, r64 now) {
+  this->stages[stage].Add((u64)((now - this->stage_start) * 1e9));
+  this->stage_start = now;
+}
+
+// One line per stage, times in milliseconds, for drawing over the picture.
+// Returns the number of lines
+static int FormatFrameOverlay(FrameStats *stats, char lines[][64],
+                              int max_lines) {
+  int count = 0;
+  if (count < max_lines) {
+    snprintf(lines[count++], 64, "%.0f fps", stats->frames_per_second);
+  }
+  for (int i = 0; i < kNumFrameStages && count < max_lines; i++) {
+    Histogram *histogram = stats->stages + i;
+    snprintf(lines[count++], 64, "%-8s p50 %6.3f p99 %6.3f max %6.3f",
+             kFrameStageNames[i], histogram->Percentile(50) / 1e6,
+             histogram->Percentile(99) / 1e6, histogram->max / 1e6);
+  }
+  Histogram *latency = &stats->input.latency;
+  if (latency->count > 0 && count < max_lines) {
+    snprintf(lines[count++], 64, "%-8s p50 %6.3f p99 %6.3f max %6.3f",
+             "input", latency->Percentile(50) / 1e6,
+             latency->Percentile(99) / 1e6, latency->max / 1e6);
+  }
+  return count;
+}
+
+static void PrintFrameStats(FrameStats *stats) {
+  print("Frame times over %llu frames, in ms:\n",
+        (unsigned long long)stats->stages[Stage_Frame].count);
+  print("%-8s %9s %9s %9s %9s %9s\n", "stage", "mean", "p50", "p95", "p99",
+        "max");
+  for (int i = 0; i < kNumFrameStages; i++) {
+    Histogram *histogram = stats->stages + i;
+    r64 mean = histogram->count ? (r64)histogram->sum / histogram->count : 0;
+    print("%-8s %9.3f %9.3f %9.3f %9.3f %9.3f\n", kFrameStageNames[i],
+          mean / 1e6, histogram->Percentile(50) / 1e6,
+          histogram->Percentile(95) / 1e6, histogram->Percentile(99) / 1e6,
+          histogram->max / 1e6);
+  }
+
+  InputLatencyProbe *input = &stats->input;
+  if (input->latency.count > 0 || input->unread > 0) {
+    Histogram *latency = &input->latency;
+    print("\nInput to display over %llu key events, in ms (%llu never read):\n",
+          (unsigned long long)latency->count,
+          (unsigned long long)input->unread);
+    print("%9s %9s %9s %9s %9s\n", "mean", "p50", "p95", "p99", "max");
+    r64 mean = latency->count ? (r64)latency->sum / latency->count : 0;
+    print("%9.3f %9.3f %9.3f %9.3f %9.3f\n", mean / 1e6,
+          latency->Percentile(50) / 1e6, latency->Percentile(95) / 1e6,
+          latency->Percentile(99) / 1e6, latency->max / 1e6);
+  }
+}
+
+#endif  // FRAME_STATS_CPP
@@ -0,0 +1,84 @@
+// ================= Fused instruction pairs ==================
+#ifndef FUSION_CPP
+#define FUSION_CPP
+
+// A few pairs of instructions come up together all the time: a counter
+// decrement and the branch that loops on it, a compare and its branch, a
+// load and a store. The block cache looks for them when it decodes a block
+// and runs each pair as one handler, which saves a dispatch per pair. The
+// result is exactly the same as running the two one by one, including flags,
+// cycles and the instruction count.
+//
+// The first instruction of a pair only uses immediate, implied or zero page
+// operands, and never stores, touches the stack or changes the flow. So
+// it can't hit a device or overwrite code, and the second instruction is
+// always the one that was decoded.
+
+// Name, first opcode, second opcode, what the report calls it
+#define FUSED_PAIRS(X)                         \
+  X(DEX_BNE, 0xCA, 0xD0, "dex / bne")          \
+  X(DEY_BNE, 0x88, 0xD0, "dey / bne")          \
+  X(INX_BNE, 0xE8, 0xD0, "inx / bne")          \
+  X(INY_BNE, 0xC8, 0xD0, "iny / bne")          \
+  X(DEX_BPL, 0xCA, 0x10, "dex / bpl")          \
+  X(DEY_BPL, 0x88, 0x10, "dey / bpl")          \
+  X(CMP_BCC, 0xC9, 0x90, "cmp # / bcc")        \
+  X(CMP_BCS, 0xC9, 0xB0, "cmp # / bcs")        \
+  X(CMP_BEQ, 0xC9, 0xF0, "cmp # / beq")        \
+  X(CMP_BNE, 0xC9, 0xD0, "cmp # / bne")        \
+  X(CMPZ_BCS, 0xC5, 0xB0, "cmp zp / bcs")      \
+  X(CMPZ_BNE, 0xC5, 0xD0, "cmp zp / bne")      \
+  X(CPX_BNE, 0xE0, 0xD0, "cpx # / bne")        \
+  X(CPY_BNE, 0xC0, 0xD0, "cpy # / bne")        \
+  X(LDA_STAZ, 0xA9, 0x85, "lda # / sta zp")    \
+  X(LDA_STA, 0xA9, 0x8D, "lda # / sta abs")    \
+  X(CLC_ADC, 0x18, 0x69, "clc / adc #")        \
+  X(SEC_SBC, 0x38, 0xE9, "sec / sbc #")
+
+enum FusedPairKind {
+#define FUSED_PAIR_ENUM(name, first, second, text) FusedPair_##name,
+  FUSED_PAIRS(FUSED_PAIR_ENUM)
+#undef FUSED_PAIR_ENUM
+  FusedPair_Count,
+};
+
+global int const kNumFusedPairs = FusedPair_Count;
+
+struct FusedPair {
+  u8 first;
+  u8 second;
+  DecodedOpcodeHandler handler;
+  char const *name;
+};
+
+inline void CountFusedPair(CPU *cpu, int pair);  // see BlockCache
+
+// The two operands come packed, the second one in the high 16 bits
+template <u8 first, u8 second, int pair>
+static void ExecuteFusedPair(CPU *cpu, int operands) {
+  cpu->ExecuteDecoded(first, KnownType(first), KnownMode(first),
+                      operands & 0xFFFF);
+  cpu->PC += (u16)gBytesForAddressingMode[KnownMode(second)];
+  cpu->ExecuteDecoded(second, KnownType(second), KnownMode(second),
+                      (int)((u32)operands >> 16));
+  CountFusedPair(cpu, pair);
+}
+
+global FusedPair const gFusedPairs[kNumFusedPairs] = {
+#define FUSED_PAIR_ENTRY(name, first, second, text) \
+  {first, second, &ExecuteFusedPair<first, second, FusedPair_##name>, text},
+    FUSED_PAIRS(FUSED_PAIR_ENTRY)
+#undef FUSED_PAIR_ENTRY
+};
+
+// Returns -1 if the two don't make a pair
+static int FindFusedPair(u8 first, u8 second) {
+  for (int i = 0; i < kNumFusedPairs; i++) {
+    if (gFusedPairs[i].first == first && gFusedPairs[i].second == second) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#endif  // FUSION_CPP
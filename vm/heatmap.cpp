@@ -0,0 +1,265 @@
+// ================= Memory heatmap ==================
+#ifndef HEATMAP_CPP
+#define HEATMAP_CPP
+
+// With Instrument_Heatmap the CPU counts the reads, writes and executed
+// instructions on every page of the address space, and optionally on every
+// byte. Instruction fetches aren't reads, they're counted as one execute on
+// the opcode's address.
+//
+// Every sample_interval cycles the page counts since the last sample go
+// into a time series, so you can see when the traffic moved, e.g. from
+// clearing the screen to the game loop.
+//
+// WriteHeatmap dumps it all into a binary file, PrintHeatmap draws the pages
+// as a 16x16 grid per kind of access and sums them up per region.
+
+enum HeatmapAccess {
+  Heat_Read = 0,
+  Heat_Write,
+  Heat_Execute,
+  kNumHeatmapAccesses,
+};
+
+struct HeatmapCounts {
+  u64 count[kNumHeatmapAccesses][kNumPages];
+};
+
+struct HeatmapSample {
+  u64 cycle;  // when it was taken, it covers the cycles before
+  u32 count[kNumHeatmapAccesses][kNumPages];
+};
+
+struct Heatmap {
+  HeatmapCounts pages;
+  u64 (*bytes)[kMachineMemorySize];  // kNumHeatmapAccesses of them, or NULL
+
+  u64 sample_interval;  // cycles, 0 = no time series
+  u64 next_sample;
+  HeatmapCounts at_last_sample;
+  HeatmapSample *samples;
+  int num_samples;
+  int max_samples;
+
+  inline void Count(HeatmapAccess access, u32 address);
+  inline void Tick(u64 cycles);
+  void Sample(u64 cycles);
+};
+
+force_inline void Heatmap::Count(HeatmapAccess access, u32 address) {
+  address = (u16)address;  // past $FFFF is the bottom again
+  this->pages.count[access][address >> 8]++;
+  if (this->bytes != NULL) {
+    this->bytes[access][address]++;
+  }
+}
+
+// Called before every instruction
+force_inline void Heatmap::Tick(u64 cycles) {
+  if (this->sample_interval != 0 && cycles >= this->next_sample) {
+    this->Sample(cycles);
+  }
+}
+
+void Heatmap::Sample(u64 cycles) {
+  if (this->num_samples == this->max_samples) {
+    int max_samples = this->max_samples > 0 ? 2 * this->max_samples : 64;
+    HeatmapSample *samples = (HeatmapSample *)realloc(
+        this->samples, max_samples * sizeof(HeatmapSample));
+    if (samples == NULL) {
+      this->sample_interval = 0;  // keep what we have
+      return;
+    }
+    this->samples = samples;
+    this->max_samples = max_samples;
+  }
+  HeatmapSample *sample = this->samples + this->num_samples++;
+  sample->cycle = cycles;
+  for (int access = 0; access < kNumHeatmapAccesses; access++) {
+    for (int page = 0; page < kNumPages; page++) {
+      u64 now = this->pages.count[access][page];
+      sample->count[access][page] =
+          (u32)(now - this->at_last_sample.count[access][page]);
+      this->at_last_sample.count[access][page] = now;
+    }
+  }
+  this->next_sample = cycles + this->sample_interval;
+}
+
+// per_byte adds counters for every address (1.5 MB). Samples are taken
+// every sample_interval cycles, 0 for none. Returns NULL if out of memory
+static Heatmap *NewHeatmap(bool per_byte, u64 sample_interval) {
+  Heatmap *heatmap = (Heatmap *)calloc(1, sizeof(Heatmap));
+  if (heatmap == NULL) return NULL;
+  if (per_byte) {
+    heatmap->bytes = (u64(*)[kMachineMemorySize])calloc(
+        kNumHeatmapAccesses, kMachineMemorySize * sizeof(u64));
+    if (heatmap->bytes == NULL) {
+      free(heatmap);
+      return NULL;
+    }
+  }
+  heatmap->sample_interval = sample_interval;
+  heatmap->next_sample = sample_interval;
+  return heatmap;
+}
+
+static void FreeHeatmap(Heatmap *heatmap) {
+  free(heatmap->bytes);
+  free(heatmap->samples);
+  free(heatmap);
+}
+
+// ================= Reports ==================
+
+global char const kHeatmapMagic[8] = {'6', '5', '0', '2', 'H', 'E', 'A', 'T'};
+
+// Followed by the page counts (u64 [3][256], reads, writes, executes), the
+// byte counts if there are any (u64 [3][65536]) and the samples
+// (HeatmapSample each, u32 counts)
+struct HeatmapFileHeader {
+  char magic[8];
+  u32 version;
+  u32 has_bytes;
+  u64 sample_interval;
+  u64 num_samples;
+  u64 pad[4];
+};
+
+static_assert(sizeof(HeatmapFileHeader) == 64, "heatmap files depend on it");
+
+// Returns false if the file can't be written
+static bool WriteHeatmap(Heatmap *heatmap, char *filename) {
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) return false;
+  HeatmapFileHeader header = {};
+  memcpy(header.magic, kHeatmapMagic, sizeof(kHeatmapMagic));
+  header.version = 1;
+  header.has_bytes = heatmap->bytes != NULL;
+  header.sample_interval = heatmap->sample_interval;
+  header.num_samples = heatmap->num_samples;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(&heatmap->pages, sizeof(HeatmapCounts), 1, file) == 1;
+  if (heatmap->bytes != NULL) {
+    ok = ok && fwrite(heatmap->bytes, sizeof(u64) * kMachineMemorySize,
+                      kNumHeatmapAccesses, file) == kNumHeatmapAccesses;
+  }
+  if (heatmap->num_samples > 0) {
+    ok = ok && fwrite(heatmap->samples, sizeof(HeatmapSample),
+                      heatmap->num_samples,
+                      file) == (size_t)heatmap->num_samples;
+  }
+  return fclose(file) == 0 && ok;
+}
+
+struct HeatmapRegion {
+  char const *name;
+  int first_page;
+  int last_page;
+};
+
+// The way this machine lays out memory
+global HeatmapRegion const kHeatmapRegions[] = {
+    {"zero page", 0x00, 0x00},
+    {"stack", 0x01, 0x01},
+    {"video", kVideoMemoryStart >> 8,
+     (kVideoMemoryStart + kWindowWidth * kWindowHeight - 1) >> 8},
+    {"program", kPC_start >> 8, 0xFF},
+};
+
+static int BitLength(u64 value) {
+  int result = 0;
+  while (value != 0) {
+    result++;
+    value >>= 1;
+  }
+  return result;
+}
+
+// Darker is busier, on a log scale so that the quiet pages still show
+static char HeatChar(u64 count, u64 max) {
+  char const levels[] = " .:-=+*#%@";
+  int num_levels = sizeof(levels) - 1;
+  if (count == 0) return levels[0];
+  return levels[1 + (num_levels - 2) * BitLength(count) / BitLength(max)];
+}
+
+static void PrintHeatmap(Heatmap *heatmap) {
+  char const *names[kNumHeatmapAccesses] = {"reads", "writes", "executes"};
+  u64 totals[kNumHeatmapAccesses] = {};
+  for (int access = 0; access < kNumHeatmapAccesses; access++) {
+    u64 max = 0;
+    for (int page = 0; page < kNumPages; page++) {
+      u64 count = heatmap->pages.count[access][page];
+      totals[access] += count;
+      if (count > max) max = count;
+    }
+    print("Heatmap of %s per page, %llu in all, busiest page %llu\n",
+          names[access], (unsigned long long)totals[access],
+          (unsigned long long)max);
+    print("      0123456789ABCDEF\n");
+    for (int row = 0; row < 16; row++) {
+      char line[17];
+      for (int column = 0; column < 16; column++) {
+        u64 count = heatmap->pages.count[access][row * 16 + column];
+        line[column] = HeatChar(count, max);
+      }
+      line[16] = '\0';
+      print("  $%X_ %s\n", row, line);
+    }
+    print("\n");
+  }
+
+  print("%-10s %-11s %14s %14s %14s\n", "region", "pages", "reads", "writes",
+        "executes");
+  for (int i = 0; i < (int)COUNT_OF(kHeatmapRegions); i++) {
+    HeatmapRegion const *region = kHeatmapRegions + i;
+    u64 sums[kNumHeatmapAccesses] = {};
+    for (int access = 0; access < kNumHeatmapAccesses; access++) {
+      for (int page = region->first_page; page <= region->last_page; page++) {
+        sums[access] += heatmap->pages.count[access][page];
+      }
+    }
+    char pages[16];
+    snprintf(pages, sizeof(pages), "$%02X-$%02X", region->first_page,
+             region->last_page);
+    print("%-10s %-11s %14llu %14llu %14llu\n", region->name, pages,
+          (unsigned long long)sums[Heat_Read],
+          (unsigned long long)sums[Heat_Write],
+          (unsigned long long)sums[Heat_Execute]);
+  }
+}
+
+// The time series per region, one line per sample. Returns false if the file
+// can't be written
+static bool WriteHeatmapSeries(Heatmap *heatmap, char *filename) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) return false;
+  char const *names[kNumHeatmapAccesses] = {"reads", "writes", "executes"};
+  fprintf(file, "cycle");
+  for (int i = 0; i < (int)COUNT_OF(kHeatmapRegions); i++) {
+    for (int access = 0; access < kNumHeatmapAccesses; access++) {
+      fprintf(file, ",%s %s", kHeatmapRegions[i].name, names[access]);
+    }
+  }
+  fprintf(file, "\n");
+  for (int s = 0; s < heatmap->num_samples; s++) {
+    HeatmapSample *sample = heatmap->samples + s;
+    fprintf(file, "%llu", (unsigned long long)sample->cycle);
+    for (int i = 0; i < (int)COUNT_OF(kHeatmapRegions); i++) {
+      HeatmapRegion const *region = kHeatmapRegions + i;
+      for (int access = 0; access < kNumHeatmapAccesses; access++) {
+        u64 sum = 0;
+        for (int page = region->first_page; page <= region->last_page;
+             page++) {
+          sum += sample->count[access][page];
+        }
+        fprintf(file, ",%llu", (unsigned long long)sum);
+      }
+    }
+    fprintf(file, "\n");
+  }
+  return fclose(file) == 0;
+}
+
+#endif  // HEATMAP_CPP
@@ -0,0 +1,222 @@
+// ================= Input ==================
+#ifndef INPUT_CPP
+#define INPUT_CPP
+
+// A page of keyboard and joystick registers at $FD00:
+//
+//   $FD00  joystick, one bit per direction and fire (Joy_ flags)
+//   $FD01  next key event, 0 if there's none. Bit 7 is set for a release,
+//          the rest is the key (ASCII, or one of the Key_ codes)
+//   $FD02  number of key events waiting
+//   $FD03  control, bit 0: IRQ while key events are waiting
+//
+// The platform layer pushes key events from its own thread into an
+// InputQueue, a lock-free ring with one producer and one consumer. The
+// machine takes them out every kInputPollCycles cycles, on its scheduler,
+// and updates the registers.
+//
+// For the latency probe every event gets a sequence number. When the
+// program reads a register that shows an event, the device publishes its
+// number and the frame it was read in (see seen_sequence).
+
+global u16 const kInputJoystick = 0xFD00;
+global u16 const kInputKey = 0xFD01;
+global u16 const kInputPending = 0xFD02;
+global u16 const kInputControl = 0xFD03;
+global u8 const kInputControlIRQ = 0x01;
+global u64 const kInputPollCycles = 1000;  // 1 ms
+global int const kInputQueueSize = 256;    // must be a power of 2
+global int const kMaxPendingKeys = 16;     // more are thrown away
+
+enum JoystickBit {
+  Joy_Up = 0x01,
+  Joy_Down = 0x02,
+  Joy_Left = 0x04,
+  Joy_Right = 0x08,
+  Joy_Fire = 0x10,
+};
+
+// Keys that aren't ASCII
+enum InputKey {
+  Key_Up = 0x11,
+  Key_Down = 0x12,
+  Key_Left = 0x13,
+  Key_Right = 0x14,
+};
+
+global u8 const kKeyReleased = 0x80;
+
+struct InputEvent {
+  u64 sequence;
+  u8 key;
+  bool pressed;
+};
+
+struct InputQueue {
+  // Platform thread
+  volatile u64 head;  // next slot to fill
+  u64 next_sequence;
+  u64 dropped;     // the machine wasn't taking them
+  u8 padding[64];  // keeps the two threads off each other's cache line
+
+  // Machine thread
+  volatile u64 tail;  // next event to take
+
+  InputEvent events[kInputQueueSize];
+
+  u64 Push(u8 key, bool pressed);
+  bool Pop(InputEvent *event);
+};
+
+// Returns the event's sequence number, 0 if the queue was full
+u64 InputQueue::Push(u8 key, bool pressed) {
+  u64 head = this->head;
+  if (head - AtomicLoad(&this->tail) >= (u64)kInputQueueSize) {
+    this->dropped++;
+    return 0;
+  }
+  InputEvent *event = this->events + (head & (kInputQueueSize - 1));
+  event->sequence = ++this->next_sequence;
+  event->key = key;
+  event->pressed = pressed;
+  AtomicStore(&this->head, head + 1);
+  return event->sequence;
+}
+
+bool InputQueue::Pop(InputEvent *event) {
+  u64 tail = this->tail;
+  if (tail == AtomicLoad(&this->head)) return false;
+  *event = this->events[tail & (kInputQueueSize - 1)];
+  AtomicStore(&this->tail, tail + 1);
+  return true;
+}
+
+struct InputDevice {
+  Machine *machine;
+  InputQueue queue;
+  int irq_source;
+
+  u8 joystick;
+  u64 joystick_sequence;  // the last event that changed it
+  u8 control;
+  u8 keys[kMaxPendingKeys];
+  u64 key_sequences[kMaxPendingKeys];
+  int first_key;
+  int num_keys;
+
+  // For the latency probe, written by the machine thread
+  volatile u64 seen_frame;     // machine->frame when read
+  volatile u64 seen_sequence;  // the last event the program has read
+
+  void Poll();
+  void UpdateIRQ();
+  void Seen(u64 sequence);
+};
+
+static u8 JoystickBitFor(u8 key) {
+  switch (key) {
+    case Key_Up:
+      return Joy_Up;
+    case Key_Down:
+      return Joy_Down;
+    case Key_Left:
+      return Joy_Left;
+    case Key_Right:
+      return Joy_Right;
+    case ' ':
+      return Joy_Fire;
+  }
+  return 0;
+}
+
+void InputDevice::Poll() {
+  InputEvent event;
+  while (this->queue.Pop(&event)) {
+    u8 bit = JoystickBitFor(event.key);
+    if (bit != 0) {
+      this->joystick = event.pressed ? (this->joystick | bit)
+                                     : (this->joystick & ~bit);
+      this->joystick_sequence = event.sequence;
+    }
+    if (this->num_keys < kMaxPendingKeys) {
+      int index = (this->first_key + this->num_keys++) % kMaxPendingKeys;
+      this->keys[index] = event.key | (event.pressed ? 0 : kKeyReleased);
+      this->key_sequences[index] = event.sequence;
+    }
+  }
+  this->UpdateIRQ();
+}
+
+void InputDevice::UpdateIRQ() {
+  MemoryBus *bus = &this->machine->bus;
+  if ((this->control & kInputControlIRQ) && this->num_keys > 0) {
+    bus->AssertIRQ(this->irq_source);
+  } else {
+    bus->ReleaseIRQ(this->irq_source);
+  }
+}
+
+void InputDevice::Seen(u64 sequence) {
+  if (sequence <= this->seen_sequence) return;
+  AtomicStore(&this->seen_frame, this->machine->frame);
+  AtomicStore(&this->seen_sequence, sequence);
+}
+
+static u8 ReadInputRegister(void *context, u16 address) {
+  InputDevice *input = (InputDevice *)context;
+  switch (address) {
+    case kInputJoystick: {
+      input->Seen(input->joystick_sequence);
+      return input->joystick;
+    }
+    case kInputKey: {
+      if (input->num_keys == 0) return 0;
+      u8 key = input->keys[input->first_key];
+      input->Seen(input->key_sequences[input->first_key]);
+      input->first_key = (input->first_key + 1) % kMaxPendingKeys;
+      input->num_keys--;
+      input->UpdateIRQ();
+      return key;
+    }
+    case kInputPending:
+      return (u8)input->num_keys;
+    case kInputControl:
+      return input->control;
+  }
+  return 0;
+}
+
+static void WriteInputRegister(void *context, u16 address, u8 value) {
+  InputDevice *input = (InputDevice *)context;
+  if (address == kInputControl) {
+    input->control = value;
+    input->UpdateIRQ();
+  }
+}
+
+static void PollInput(void *context, u64 time) {
+  InputDevice *input = (InputDevice *)context;
+  input->Poll();
+  input->machine->scheduler.Schedule(time + kInputPollCycles, PollInput,
+                                     input);
+}
+
+// Maps the input registers and starts taking events from input->queue.
+// Returns NULL if out of memory or the bus has no room for the device
+static InputDevice *ConnectInput(Machine *machine) {
+  InputDevice *input = (InputDevice *)calloc(1, sizeof(InputDevice));
+  if (input == NULL) return NULL;
+  input->machine = machine;
+  input->irq_source = machine->bus.num_devices;
+  Device device = {ReadInputRegister, WriteInputRegister, input};
+  if (!machine->bus.MapDevice(kInputJoystick >> 8, 1, device)) {
+    free(input);
+    return NULL;
+  }
+  machine->scheduler.Schedule(machine->cpu.cycles + kInputPollCycles,
+                              PollInput, input);
+  machine->input = input;
+  return input;
+}
+
+#endif  // INPUT_CPP
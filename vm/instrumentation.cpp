@@ -0,0 +1,196 @@
+// ================= Instrumentation ==================
+#ifndef INSTRUMENTATION_CPP
+#define INSTRUMENTATION_CPP
+
+// Tools that want to see the program run (tracing, profiling, etc.) hook into
+// the instruction loop through a policy. The CPU's loop and every opcode
+// handler are templates on the policy, so each one gets its own copy of the
+// interpreter with the hooks compiled in. The plain loop is instantiated with
+// NoInstrumentation, whose hooks are empty, and comes out exactly as if
+// there were no hooks at all.
+//
+// A policy is a struct with these static functions:
+//
+//   OnFetch(cpu, opcode, mode, operand, address)
+//       before an instruction runs, with its effective address if it has
+//       one. cpu->PC is already past it
+//   OnRead(cpu, address, value)   after a memory read
+//   OnWrite(cpu, address, value)  after a memory write
+//   OnBranch(cpu, target, taken)  for conditional branches
+//   OnInterrupt(cpu, vector)      when an interrupt or BRK has gone to its
+//                                 handler
+//
+// and kActive, false only for NoInstrumentation. Active policies turn off the
+// JIT and idle loop skipping, since they'd hide instructions.
+//
+// Compose<A, B> runs the hooks of both. The Instrument flags pick a
+// combination of the tools below when a machine is made (see NewMachine), and
+// CPU::Run goes to the loop for that combination.
+
+struct NoInstrumentation {
+  static bool const kActive = false;
+  force_inline static void OnFetch(CPU *, u8, AddressingMode, int, u32) {}
+  force_inline static void OnRead(CPU *, u32, u8) {}
+  force_inline static void OnWrite(CPU *, u32, u8) {}
+  force_inline static void OnBranch(CPU *, u16, bool) {}
+  force_inline static void OnInterrupt(CPU *, u16) {}
+};
+
+template <class First, class Second>
+struct Compose {
+  static bool const kActive = First::kActive || Second::kActive;
+
+  force_inline static void OnFetch(CPU *cpu, u8 opcode, AddressingMode mode,
+                                   int operand, u32 address) {
+    First::OnFetch(cpu, opcode, mode, operand, address);
+    Second::OnFetch(cpu, opcode, mode, operand, address);
+  }
+  force_inline static void OnRead(CPU *cpu, u32 address, u8 value) {
+    First::OnRead(cpu, address, value);
+    Second::OnRead(cpu, address, value);
+  }
+  force_inline static void OnWrite(CPU *cpu, u32 address, u8 value) {
+    First::OnWrite(cpu, address, value);
+    Second::OnWrite(cpu, address, value);
+  }
+  force_inline static void OnBranch(CPU *cpu, u16 target, bool taken) {
+    First::OnBranch(cpu, target, taken);
+    Second::OnBranch(cpu, target, taken);
+  }
+  force_inline static void OnInterrupt(CPU *cpu, u16 vector) {
+    First::OnInterrupt(cpu, vector);
+    Second::OnInterrupt(cpu, vector);
+  }
+};
+
+// Prints every instruction into cpu->trace, see trace.cpp
+no_inline static void TraceInstruction(CPU *cpu, u8 opcode, u16 pc,
+                                       int operand, u32 address) {
+  TraceLine line = {};
+  line.cycle = cpu->cycles;
+  line.pc = pc;
+  line.operand = (u16)operand;
+  line.address = (u16)address;
+  line.opcode = opcode;
+  line.A = cpu->A;
+  line.X = cpu->X;
+  line.Y = cpu->Y;
+  line.SP = cpu->SP;
+  line.status = cpu->GetStatus();
+  PrintTraceLine(cpu->trace, &line);
+}
+
+struct TraceInstrument : NoInstrumentation {
+  static bool const kActive = true;
+
+  force_inline static void OnFetch(CPU *cpu, u8 opcode, AddressingMode mode,
+                                   int operand, u32 address) {
+    TraceInstruction(cpu, opcode,
+                     (u16)(cpu->PC - gBytesForAddressingMode[mode]), operand,
+                     address);
+  }
+};
+
+// Counts into cpu->profile, see profiler.cpp
+struct ProfileInstrument : NoInstrumentation {
+  static bool const kActive = true;
+
+  force_inline static void OnFetch(CPU *cpu, u8 opcode, AddressingMode mode,
+                                   int operand, u32 address) {
+    cpu->profile->Enter((u16)(cpu->PC - gBytesForAddressingMode[mode]),
+                        opcode, operand, cpu->cycles);
+  }
+  force_inline static void OnInterrupt(CPU *cpu, u16 vector) {
+    cpu->profile->Call(cpu->PC);
+  }
+};
+
+// Counts into cpu->heatmap, see heatmap.cpp
+struct HeatmapInstrument : NoInstrumentation {
+  static bool const kActive = true;
+
+  force_inline static void OnFetch(CPU *cpu, u8 opcode, AddressingMode mode,
+                                   int operand, u32 address) {
+    cpu->heatmap->Tick(cpu->cycles);
+    cpu->heatmap->Count(Heat_Execute,
+                        (u16)(cpu->PC - gBytesForAddressingMode[mode]));
+  }
+  force_inline static void OnRead(CPU *cpu, u32 address, u8 value) {
+    cpu->heatmap->Count(Heat_Read, address);
+  }
+  force_inline static void OnWrite(CPU *cpu, u32 address, u8 value) {
+    cpu->heatmap->Count(Heat_Write, address);
+  }
+};
+
+// Writes a checkpoint of the machine into cpu->digest every so often, see
+// digest.cpp
+no_inline static void TakeCheckpoint(CPU *cpu, u16 pc) {
+  DigestRecord record = {};
+  record.cycle = cpu->cycles;
+  record.pc = pc;
+  record.A = cpu->A;
+  record.X = cpu->X;
+  record.Y = cpu->Y;
+  record.SP = cpu->SP;
+  record.status = cpu->GetStatus();
+  cpu->digest->Checkpoint(&record);
+}
+
+struct DigestInstrument : NoInstrumentation {
+  static bool const kActive = true;
+
+  force_inline static void OnFetch(CPU *cpu, u8 opcode, AddressingMode mode,
+                                   int operand, u32 address) {
+    if (cpu->cycles >= cpu->digest->next_checkpoint) {
+      TakeCheckpoint(cpu, (u16)(cpu->PC - gBytesForAddressingMode[mode]));
+    }
+  }
+  force_inline static void OnWrite(CPU *cpu, u32 address, u8 value) {
+    cpu->digest->MarkDirty(address);
+  }
+};
+
+enum Instrument {
+  Instrument_Trace = 0x01,    // needs cpu->trace
+  Instrument_Profile = 0x02,  // needs cpu->profile
+  Instrument_Heatmap = 0x04,  // needs cpu->heatmap
+  Instrument_Digest = 0x08,   // needs cpu->digest
+};
+
+global int const kNumInstruments = 4;
+global int const kNumInstrumentSets = 1 << kNumInstruments;
+
+template <bool enabled, class Tool>
+struct IfEnabled {
+  typedef NoInstrumentation Policy;
+};
+
+template <class Tool>
+struct IfEnabled<true, Tool> {
+  typedef Tool Policy;
+};
+
+// The policy for a combination of Instrument flags
+template <u32 instruments>
+struct InstrumentSet {
+  typedef typename IfEnabled<(instruments & Instrument_Trace) != 0,
+                             TraceInstrument>::Policy TracePart;
+  typedef typename IfEnabled<(instruments & Instrument_Profile) != 0,
+                             ProfileInstrument>::Policy ProfilePart;
+  typedef typename IfEnabled<(instruments & Instrument_Heatmap) != 0,
+                             HeatmapInstrument>::Policy HeatmapPart;
+  typedef typename IfEnabled<(instruments & Instrument_Digest) != 0,
+                             DigestInstrument>::Policy DigestPart;
+  typedef Compose<Compose<TracePart, ProfilePart>,
+                  Compose<HeatmapPart, DigestPart> >
+      Policy;
+};
+
+// Nothing on is the plain loop, not a composition of empty hooks
+template <>
+struct InstrumentSet<0> {
+  typedef NoInstrumentation Policy;
+};
+
+#endif  // INSTRUMENTATION_CPP
@@ -0,0 +1,891 @@
+// ================= x86-64 translation of hot blocks ==================
+#ifndef JIT_CPP
+#define JIT_CPP
+
+// Blocks from the BlockCache that run often enough get translated into host
+// code. Loads, stores, ALU ops, compares, register and flag instructions and
+// branches are emitted natively, the rest (shifts, the stack, JSR/RTS...)
+// call the same specialized handlers the interpreter uses. Translated
+// blocks jump straight into each other while the cycle budget lasts and
+// no interrupt or stop request is waiting on the bus.
+//
+// A store to a page with translated code makes the block return right after
+// the store. Run then throws all translations away and carries on in the
+// interpreter until blocks get hot again.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if JIT_SUPPORTED && defined(BUILD_WIN32)
+#include <windows.h>
+#elif JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+global int const kJitThreshold = 64;  // executions before translating
+global int const kJitArenaSize = 4 * 1024 * 1024;
+global int const kMaxTranslationSize = 8192;
+global int const kMaxJitExits = 16 * 1024;
+
+struct JitExit {
+  u16 target;  // 6502 address the block may continue at
+  bool linked;
+  u8 *jump;  // rel32 of the jmp to patch when the target gets translated
+};
+
+struct Jit {
+  bool enabled;
+  bool validate;  // check every translated block against the interpreter
+
+  u8 *arena;
+  int arena_used;
+
+  JitExit exits[kMaxJitExits];
+  int num_exits;
+
+  u8 *validation_memory;
+  MemoryBus *validation_bus;
+
+  u64 blocks_translated;
+  u64 flushes;
+  u64 blocks_validated;
+  u64 validation_failures;
+
+  bool IsHot(BlockCache *, Block *);
+  void *Translate(BlockCache *, Block *);
+  void Link(BlockCache *, Block *, int first_exit);
+  void Flush(BlockCache *);
+  void Execute(CPU *, Block *);
+};
+
+static Jit *NewJit() {
+#if JIT_SUPPORTED
+  Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+  if (jit == NULL) {
+    print("Couldn't allocate memory for the JIT\n");
+    return NULL;
+  }
+#ifdef BUILD_WIN32
+  jit->arena = (u8 *)VirtualAlloc(0, kJitArenaSize, MEM_COMMIT | MEM_RESERVE,
+                                  PAGE_EXECUTE_READWRITE);
+#else
+  jit->arena = (u8 *)mmap(0, kJitArenaSize,
+                          PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->arena == MAP_FAILED) jit->arena = NULL;
+#endif
+  if (jit->arena == NULL) {
+    print("Couldn't allocate executable memory for the JIT\n");
+    free(jit);
+    return NULL;
+  }
+  jit->enabled = true;
+  return jit;
+#else
+  print("The JIT is only supported on x86-64\n");
+  return NULL;
+#endif
+}
+
+static void FreeJit(Jit *jit) {
+#if JIT_SUPPORTED
+#ifdef BUILD_WIN32
+  VirtualFree(jit->arena, 0, MEM_RELEASE);
+#else
+  munmap(jit->arena, kJitArenaSize);
+#endif
+#endif
+  if (jit->validation_memory != NULL) {
+    FreeMirroredMemory(jit->validation_memory);
+  }
+  free(jit->validation_bus);
+  free(jit);
+}
+
+// Blocks are translated when they've been executed kJitThreshold times
+bool Jit::IsHot(BlockCache *cache, Block *block) {
+  if (cache->jit_flush_pending) {
+    this->Flush(cache);
+  }
+  if (block->jit_code != NULL) return true;
+  if (++block->execution_count < kJitThreshold) return false;
+  return this->Translate(cache, block) != NULL;
+}
+
+void Jit::Flush(BlockCache *cache) {
+  for (int i = 0; i < cache->num_blocks; i++) {
+    cache->blocks[i].jit_code = NULL;
+    cache->blocks[i].execution_count = 0;
+  }
+  this->arena_used = 0;
+  this->num_exits = 0;
+  cache->jit_flush_pending = false;
+  this->flushes++;
+}
+
+// ----------------- Code emission -----------------
+
+struct CodeEmitter {
+  u8 *at;
+
+  void Byte(u8 value) { *this->at++ = value; }
+  void U16(u16 value) {
+    memcpy(this->at, &value, 2);
+    this->at += 2;
+  }
+  void U32(u32 value) {
+    memcpy(this->at, &value, 4);
+    this->at += 4;
+  }
+  void U64(u64 value) {
+    memcpy(this->at, &value, 8);
+    this->at += 8;
+  }
+
+  // The CPU pointer lives in rbx, all its fields are within disp8 range
+  void MovByteImm(int offset, u8 value) {  // mov byte [rbx+offset], imm8
+    Byte(0xC6), Byte(0x43), Byte((u8)offset), Byte(value);
+  }
+  void MovWordImm(int offset, u16 value) {  // mov word [rbx+offset], imm16
+    Byte(0x66), Byte(0xC7), Byte(0x43), Byte((u8)offset), U16(value);
+  }
+  void AddQwordImm(int offset, u32 value) {  // add qword [rbx+offset], imm32
+    if (value == 0) return;
+    Byte(0x48), Byte(0x81), Byte(0x43), Byte((u8)offset), U32(value);
+  }
+  void AndByteImm(int offset, u8 value) {  // and byte [rbx+offset], imm8
+    Byte(0x80), Byte(0x63), Byte((u8)offset), Byte(value);
+  }
+  void OrByteImm(int offset, u8 value) {  // or byte [rbx+offset], imm8
+    Byte(0x80), Byte(0x4B), Byte((u8)offset), Byte(value);
+  }
+  void TestByteImm(int offset, u8 value) {  // test byte [rbx+offset], imm8
+    Byte(0xF6), Byte(0x43), Byte((u8)offset), Byte(value);
+  }
+  // Returns where the rel32 is so that it can be patched later
+  u8 *Jump32(u8 opcode) {  // jmp rel32
+    Byte(opcode);
+    u8 *result = this->at;
+    U32(0);
+    return result;
+  }
+  u8 *JumpCondition32(u8 condition) {  // jcc rel32
+    Byte(0x0F);
+    return Jump32(condition);
+  }
+};
+
+#define X86_JMP 0xE9
+#define X86_JZ 0x84
+#define X86_JNZ 0x85
+#define X86_JAE 0x83
+
+static void PatchRel32(u8 *rel32, u8 *target) {
+  i32 offset = (i32)(target - (rel32 + 4));
+  memcpy(rel32, &offset, 4);
+}
+
+#define CPU_FIELD(field) ((int)offsetof(CPU, field))
+
+// Sets N and Z from a value known at translation time
+static void EmitSetNZForConstant(CodeEmitter *e, u8 value) {
+  e->MovByteImm(CPU_FIELD(flag_n), value);
+  e->MovByteImm(CPU_FIELD(flag_z), value);
+}
+
+// INX/INY/DEX/DEY
+static void EmitIncDec(CodeEmitter *e, int offset, bool increment) {
+  e->Byte(0x8A), e->Byte(0x43), e->Byte((u8)offset);  // mov al, [rbx+reg]
+  e->Byte(0xFE), e->Byte(increment ? 0xC0 : 0xC8);    // inc al / dec al
+  e->Byte(0x88), e->Byte(0x43), e->Byte((u8)offset);  // mov [rbx+reg], al
+  e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_n));  // mov [flag_n], al
+  e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_z));  // mov [flag_z], al
+}
+
+static void EmitCall(CodeEmitter *e, void *function) {
+  e->Byte(0x48), e->Byte(0xB8), e->U64((u64)function);  // mov rax, function
+  e->Byte(0xFF), e->Byte(0xD0);                         // call rax
+}
+
+// Calls handler(cpu, operand)
+static void EmitHandlerCall(CodeEmitter *e, DecodedOpcodeHandler handler,
+                            u16 operand) {
+#ifdef BUILD_WIN32
+  e->Byte(0x48), e->Byte(0x89), e->Byte(0xD9);  // mov rcx, rbx
+  e->Byte(0xBA), e->U32(operand);               // mov edx, operand
+#else
+  e->Byte(0x48), e->Byte(0x89), e->Byte(0xDF);  // mov rdi, rbx
+  e->Byte(0xBE), e->U32(operand);               // mov esi, operand
+#endif
+  EmitCall(e, (void *)handler);
+}
+
+// The bus's slow paths, for pages without a host pointer
+static u8 JitSlowRead(MemoryBus *bus, u32 address) {
+  return bus->SlowRead(address);
+}
+
+static void JitSlowWrite(MemoryBus *bus, u32 address, u8 value) {
+  bus->SlowWrite(address, value);
+}
+
+// Returns the jump to take if a store has overwritten translated code
+static u8 *EmitFlushCheck(CodeEmitter *e, BlockCache *cache) {
+  e->Byte(0x48), e->Byte(0xB8);  // mov rax, &jit_flush_pending
+  e->U64((u64)&cache->jit_flush_pending);
+  e->Byte(0x80), e->Byte(0x38), e->Byte(0x00);  // cmp byte [rax], 0
+  return e->JumpCondition32(X86_JNZ);
+}
+
+// Sets N and Z from al
+static void EmitSetNZFromAL(CodeEmitter *e) {
+  e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_n));  // mov [flag_n], al
+  e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_z));  // mov [flag_z], al
+}
+
+// movzx r32, byte [rbx+offset], modrm 0x43 is eax, 0x4B ecx, 0x53 edx
+static void EmitLoadField(CodeEmitter *e, u8 modrm, int offset) {
+  e->Byte(0x0F), e->Byte(0xB6), e->Byte(modrm), e->Byte((u8)offset);
+}
+
+static void EmitLoadMemoryPointer(CodeEmitter *e) {  // mov rdx, [memory]
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x53), e->Byte(CPU_FIELD(memory));
+}
+
+// Adds a cycle if the address in ecx is on another page than the one in edx
+static void EmitPageCrossCycle(CodeEmitter *e) {
+  e->Byte(0x89), e->Byte(0xC8);              // mov eax, ecx
+  e->Byte(0x31), e->Byte(0xD0);              // xor eax, edx
+  e->Byte(0x3D), e->U32(0xFF);               // cmp eax, 0xFF
+  e->Byte(0x0F), e->Byte(0x97), e->Byte(0xC0);  // seta al
+  e->Byte(0x0F), e->Byte(0xB6), e->Byte(0xC0);  // movzx eax, al
+  e->Byte(0x48), e->Byte(0x01), e->Byte(0x43);  // add [cycles], rax
+  e->Byte(CPU_FIELD(cycles));
+}
+
+// Modes that work out an address (or are immediate) the same way for every
+// instruction, see ExecuteDecoded
+static bool IsDataMode(AddressingMode mode) {
+  switch (mode) {
+    case AM_Immediate:
+    case AM_Zeropage:
+    case AM_Zeropage_X:
+    case AM_Zeropage_Y:
+    case AM_Absolute:
+    case AM_Absolute_X:
+    case AM_Absolute_Y:
+    case AM_Indirect_X:
+    case AM_Indirect_Y: return true;
+    default: return false;
+  }
+}
+
+// Puts the effective address in ecx. With charge_page_cross, crossing a
+// page adds its cycle right away
+static void EmitAddress(CodeEmitter *e, AddressingMode mode, u16 operand,
+                        bool charge_page_cross) {
+  switch (mode) {
+    case AM_Zeropage:
+    case AM_Absolute: {
+      e->Byte(0xB9), e->U32(operand);  // mov ecx, operand
+    } break;
+    case AM_Zeropage_X:
+    case AM_Zeropage_Y: {
+      int index = mode == AM_Zeropage_X ? CPU_FIELD(X) : CPU_FIELD(Y);
+      EmitLoadField(e, 0x4B, index);                      // movzx ecx, [index]
+      e->Byte(0x80), e->Byte(0xC1), e->Byte((u8)operand);  // add cl, operand
+      e->Byte(0x0F), e->Byte(0xB6), e->Byte(0xC9);         // movzx ecx, cl
+    } break;
+    case AM_Absolute_X:
+    case AM_Absolute_Y: {
+      int index = mode == AM_Absolute_X ? CPU_FIELD(X) : CPU_FIELD(Y);
+      EmitLoadField(e, 0x4B, index);                  // movzx ecx, [index]
+      e->Byte(0x81), e->Byte(0xC1), e->U32(operand);  // add ecx, operand
+      if (charge_page_cross) {
+        e->Byte(0xBA), e->U32(operand);  // mov edx, operand
+        EmitPageCrossCycle(e);
+      }
+    } break;
+    case AM_Indirect_X: {
+      // The pointer wraps around within the zero page
+      EmitLoadMemoryPointer(e);
+      EmitLoadField(e, 0x43, CPU_FIELD(X));               // movzx eax, [X]
+      e->Byte(0x04), e->Byte((u8)operand);                 // add al, operand
+      e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x0C), e->Byte(0x02);
+      // movzx ecx, byte [rdx+rax]
+      e->Byte(0xFE), e->Byte(0xC0);                        // inc al
+      e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x04), e->Byte(0x02);
+      // movzx eax, byte [rdx+rax]
+      e->Byte(0xC1), e->Byte(0xE0), e->Byte(8);            // shl eax, 8
+      e->Byte(0x09), e->Byte(0xC1);                        // or ecx, eax
+    } break;
+    case AM_Indirect_Y: {
+      EmitLoadMemoryPointer(e);
+      e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x8A);  // movzx ecx, [rdx+low]
+      e->U32(operand);
+      e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x92);  // movzx edx, [rdx+high]
+      e->U32((u8)(operand + 1));
+      e->Byte(0xC1), e->Byte(0xE2), e->Byte(8);     // shl edx, 8
+      e->Byte(0x09), e->Byte(0xCA);                 // or edx, ecx
+      EmitLoadField(e, 0x4B, CPU_FIELD(Y));         // movzx ecx, [Y]
+      e->Byte(0x01), e->Byte(0xD1);                 // add ecx, edx
+      if (charge_page_cross) {
+        EmitPageCrossCycle(e);
+      }
+    } break;
+    default: {
+      Assert(!"No address for this mode");
+    } break;
+  }
+}
+
+// Looks up the page of the address in ecx in the bus's read or write table,
+// like MemoryBus::Read/Write. Leaves the pointer in rax and ZF set if the
+// page needs the slow path
+static void EmitPageLookup(CodeEmitter *e, int table) {
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x43);  // mov rax, [bus]
+  e->Byte(CPU_FIELD(bus));
+  e->Byte(0x89), e->Byte(0xCA);                 // mov edx, ecx
+  e->Byte(0xC1), e->Byte(0xEA), e->Byte(8);     // shr edx, 8
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x84);  // mov rax, [rax+rdx*8+table]
+  e->Byte(0xD0), e->U32((u32)table);
+  e->Byte(0x48), e->Byte(0x85), e->Byte(0xC0);  // test rax, rax
+}
+
+// Reads the byte at the address in ecx into eax. The zero page is always
+// RAM, the rest goes through the bus
+static void EmitRead(CodeEmitter *e, AddressingMode mode) {
+  if (IsZeropageMode(mode)) {
+    EmitLoadMemoryPointer(e);
+    e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x04), e->Byte(0x0A);
+    // movzx eax, byte [rdx+rcx]
+    return;
+  }
+  EmitPageLookup(e, (int)offsetof(MemoryBus, read));
+  u8 *slow = e->JumpCondition32(X86_JZ);
+  e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x04), e->Byte(0x08);
+  // movzx eax, byte [rax+rcx]
+  u8 *done = e->Jump32(X86_JMP);
+
+  PatchRel32(slow, e->at);
+#ifdef BUILD_WIN32
+  e->Byte(0x89), e->Byte(0xCA);                 // mov edx, ecx
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x4B);  // mov rcx, [bus]
+#else
+  e->Byte(0x89), e->Byte(0xCE);                 // mov esi, ecx
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x7B);  // mov rdi, [bus]
+#endif
+  e->Byte(CPU_FIELD(bus));
+  EmitCall(e, (void *)JitSlowRead);
+  e->Byte(0x0F), e->Byte(0xB6), e->Byte(0xC0);  // movzx eax, al
+  PatchRel32(done, e->at);
+}
+
+// Stores the register at offset to the address in ecx. Devices and pages
+// with code take MemoryBus::SlowWrite, which may throw the translations
+// away. Then the block leaves through the returned jump with PC at next_pc
+static u8 *EmitWrite(CodeEmitter *e, BlockCache *cache, AddressingMode mode,
+                     int offset, u16 next_pc) {
+  if (IsZeropageMode(mode)) {
+    EmitLoadMemoryPointer(e);
+    EmitLoadField(e, 0x43, offset);              // movzx eax, [reg]
+    e->Byte(0x88), e->Byte(0x04), e->Byte(0x0A);  // mov [rdx+rcx], al
+    return NULL;
+  }
+  EmitPageLookup(e, (int)offsetof(MemoryBus, write));
+  u8 *slow = e->JumpCondition32(X86_JZ);
+  EmitLoadField(e, 0x53, offset);              // movzx edx, [reg]
+  e->Byte(0x88), e->Byte(0x14), e->Byte(0x08);  // mov [rax+rcx], dl
+  u8 *done = e->Jump32(X86_JMP);
+
+  PatchRel32(slow, e->at);
+  e->MovWordImm(CPU_FIELD(PC), next_pc);
+#ifdef BUILD_WIN32
+  e->Byte(0x89), e->Byte(0xCA);                 // mov edx, ecx
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x4B);  // mov rcx, [bus]
+  e->Byte(CPU_FIELD(bus));
+  e->Byte(0x44);                                // movzx r8d, [reg]
+  EmitLoadField(e, 0x43, offset);
+#else
+  e->Byte(0x89), e->Byte(0xCE);                 // mov esi, ecx
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x7B);  // mov rdi, [bus]
+  e->Byte(CPU_FIELD(bus));
+  EmitLoadField(e, 0x53, offset);               // movzx edx, [reg]
+#endif
+  EmitCall(e, (void *)JitSlowWrite);
+  u8 *flushed = EmitFlushCheck(e, cache);
+  PatchRel32(done, e->at);
+  return flushed;
+}
+
+// What an instruction does with the data byte in eax
+static void EmitDataOp(CodeEmitter *e, InstructionType type) {
+  switch (type) {
+    case I_LDA:
+    case I_LDX:
+    case I_LDY: {
+      int offset = type == I_LDA ? CPU_FIELD(A)
+                   : type == I_LDX ? CPU_FIELD(X)
+                                   : CPU_FIELD(Y);
+      e->Byte(0x88), e->Byte(0x43), e->Byte((u8)offset);  // mov [reg], al
+      EmitSetNZFromAL(e);
+    } break;
+    case I_AND:
+    case I_ORA:
+    case I_EOR: {
+      u8 op = type == I_AND ? 0x22 : type == I_ORA ? 0x0A : 0x32;
+      e->Byte(op), e->Byte(0x43), e->Byte(CPU_FIELD(A));  // op al, [A]
+      e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(A));  // mov [A], al
+      EmitSetNZFromAL(e);
+    } break;
+    case I_CMP:
+    case I_CPX:
+    case I_CPY: {
+      // Carry is set when there's no borrow, like CPU::Compare
+      int offset = type == I_CMP ? CPU_FIELD(A)
+                   : type == I_CPX ? CPU_FIELD(X)
+                                   : CPU_FIELD(Y);
+      EmitLoadField(e, 0x4B, offset);                   // movzx ecx, [reg]
+      e->Byte(0x28), e->Byte(0xC1);                     // sub cl, al
+      e->Byte(0x0F), e->Byte(0x93), e->Byte(0xC2);      // setae dl
+      e->Byte(0x88), e->Byte(0x4B), e->Byte(CPU_FIELD(flag_n));  // [flag_n], cl
+      e->Byte(0x88), e->Byte(0x4B), e->Byte(CPU_FIELD(flag_z));  // [flag_z], cl
+      e->Byte(0x88), e->Byte(0x53), e->Byte(CPU_FIELD(flag_c));  // [flag_c], dl
+    } break;
+    case I_ADC:
+    case I_SBC: {
+      // The same table lookup as the interpreter, see AluIndex
+      EmitLoadField(e, 0x4B, CPU_FIELD(A));         // movzx ecx, [A]
+      e->Byte(0xC1), e->Byte(0xE1), e->Byte(8);     // shl ecx, 8
+      e->Byte(0x09), e->Byte(0xC1);                 // or ecx, eax
+      EmitLoadField(e, 0x53, CPU_FIELD(flag_c));    // movzx edx, [flag_c]
+      e->Byte(0xC1), e->Byte(0xE2), e->Byte(16);    // shl edx, 16
+      e->Byte(0x09), e->Byte(0xD1);                 // or ecx, edx
+      EmitLoadField(e, 0x53, CPU_FIELD(status));    // movzx edx, [status]
+      e->Byte(0x83), e->Byte(0xE2), e->Byte(FLAG_D);  // and edx, FLAG_D
+      e->Byte(0xC1), e->Byte(0xE2), e->Byte(14);    // shl edx, 14
+      e->Byte(0x09), e->Byte(0xD1);                 // or ecx, edx
+      e->Byte(0x48), e->Byte(0xBA);                 // mov rdx, table
+      e->U64((u64)(type == I_ADC ? gAluAdd : gAluSubtract));
+      e->Byte(0x8B), e->Byte(0x04), e->Byte(0x8A);  // mov eax, [rdx+rcx*4]
+      e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(A));       // [A], al
+      e->Byte(0x88), e->Byte(0x63), e->Byte(CPU_FIELD(flag_n));  // [flag_n], ah
+      e->Byte(0xC1), e->Byte(0xE8), e->Byte(16);    // shr eax, 16
+      e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_z));  // [flag_z], al
+      e->Byte(0x88), e->Byte(0x63), e->Byte(CPU_FIELD(flag_v));  // [flag_v], ah
+      e->Byte(0xC1), e->Byte(0xE8), e->Byte(8);     // shr eax, 8
+      e->Byte(0x24), e->Byte(0x01);                 // and al, 1
+      e->Byte(0x88), e->Byte(0x43), e->Byte(CPU_FIELD(flag_c));  // [flag_c], al
+    } break;
+    default: {
+      Assert(!"Not a data instruction");
+    } break;
+  }
+}
+
+// Register to register and flag instructions that don't need anything
+// but the CPU fields. Returns false for anything else
+static bool EmitRegisterOp(CodeEmitter *e, InstructionType type) {
+  int from = 0, to = 0;
+  switch (type) {
+    case I_TAX: from = CPU_FIELD(A), to = CPU_FIELD(X); break;
+    case I_TAY: from = CPU_FIELD(A), to = CPU_FIELD(Y); break;
+    case I_TXA: from = CPU_FIELD(X), to = CPU_FIELD(A); break;
+    case I_TYA: from = CPU_FIELD(Y), to = CPU_FIELD(A); break;
+    case I_CLC: e->MovByteImm(CPU_FIELD(flag_c), 0); return true;
+    case I_SEC: e->MovByteImm(CPU_FIELD(flag_c), 1); return true;
+    case I_CLV: e->MovByteImm(CPU_FIELD(flag_v), 0); return true;
+    case I_CLD: e->AndByteImm(CPU_FIELD(status), (u8)~FLAG_D); return true;
+    case I_SED: e->OrByteImm(CPU_FIELD(status), FLAG_D); return true;
+    case I_CLI: e->AndByteImm(CPU_FIELD(status), (u8)~FLAG_I); return true;
+    case I_SEI: e->OrByteImm(CPU_FIELD(status), FLAG_I); return true;
+    case I_NOP: return true;
+    default: return false;
+  }
+  e->Byte(0x8A), e->Byte(0x43), e->Byte((u8)from);  // mov al, [from]
+  e->Byte(0x88), e->Byte(0x43), e->Byte((u8)to);    // mov [to], al
+  EmitSetNZFromAL(e);
+  return true;
+}
+
+// Length of push rbx / sub rsp, 32 / mov rbx, <first argument>.
+// Chained jumps skip it
+global int const kJitPrologueSize = 8;
+
+void *Jit::Translate(BlockCache *cache, Block *block) {
+#if JIT_SUPPORTED
+  static_assert(offsetof(CPU, cycle_limit) < 128, "CPU fields need disp8");
+
+  if (this->arena_used + kMaxTranslationSize > kJitArenaSize ||
+      this->num_exits + 2 > kMaxJitExits) {
+    this->Flush(cache);
+  }
+
+  CodeEmitter emitter = {this->arena + this->arena_used};
+  CodeEmitter *e = &emitter;
+  u8 *code = e->at;
+
+  // Prologue. The stack ends up 16-aligned with 32 bytes of shadow space
+  e->Byte(0x53);                                           // push rbx
+  e->Byte(0x48), e->Byte(0x83), e->Byte(0xEC), e->Byte(32);  // sub rsp, 32
+#ifdef BUILD_WIN32
+  e->Byte(0x48), e->Byte(0x89), e->Byte(0xCB);  // mov rbx, rcx
+#else
+  e->Byte(0x48), e->Byte(0x89), e->Byte(0xFB);  // mov rbx, rdi
+#endif
+  Assert(e->at - code == kJitPrologueSize);
+
+  u8 *exit_jumps[kMaxBlockInstructions + 6];
+  int num_exit_jumps = 0;
+
+  u16 successors[2];
+  int num_successors = 0;
+
+  int pending_cycles = 0;
+  int pending_instructions = 0;
+  bool pc_is_stale = false;  // native instructions don't update PC
+
+  u16 pc = block->start;
+  for (int i = 0; i < block->num_instructions; i++) {
+    DecodedInstruction *instruction = block->instructions + i;
+    u8 opcode = instruction->opcode;
+    u16 operand = instruction->operand;
+    u16 next_pc = (u16)(pc + instruction->length);
+    bool is_last = (i == block->num_instructions - 1);
+
+    pending_instructions++;
+    pending_cycles += gCyclesForOpcode[opcode];
+
+    switch (opcode) {
+      case 0xA9:    // LDA #
+      case 0xA2:    // LDX #
+      case 0xA0: {  // LDY #
+        int offset = opcode == 0xA9 ? CPU_FIELD(A)
+                     : opcode == 0xA2 ? CPU_FIELD(X)
+                                      : CPU_FIELD(Y);
+        e->MovByteImm(offset, (u8)operand);
+        EmitSetNZForConstant(e, (u8)operand);
+        pc_is_stale = true;
+      } break;
+
+      case 0xE8:  // INX
+      case 0xC8:  // INY
+      case 0xCA:  // DEX
+      case 0x88: {  // DEY
+        int offset = (opcode == 0xE8 || opcode == 0xCA) ? CPU_FIELD(X)
+                                                        : CPU_FIELD(Y);
+        EmitIncDec(e, offset, opcode == 0xE8 || opcode == 0xC8);
+        pc_is_stale = true;
+      } break;
+
+      case 0x4C: {  // JMP absolute
+        e->MovWordImm(CPU_FIELD(PC), operand);
+        pc_is_stale = false;
+        successors[num_successors++] = operand;
+      } break;
+
+      case 0x90:    // BCC
+      case 0xB0:    // BCS
+      case 0xF0:    // BEQ
+      case 0xD0:    // BNE
+      case 0x10:    // BPL
+      case 0x30:    // BMI
+      case 0x50:    // BVC
+      case 0x70: {  // BVS
+        e->AddQwordImm(CPU_FIELD(cycles), pending_cycles);
+        e->AddQwordImm(CPU_FIELD(instructions), pending_instructions);
+        pending_cycles = 0;
+        pending_instructions = 0;
+
+        // C and Z are tested on the whole flag byte, N and V on bit 7
+        int flag = 0;
+        u8 mask = 0x80;
+        switch (opcode) {
+          case 0x90: case 0xB0: flag = CPU_FIELD(flag_c), mask = 0xFF; break;
+          case 0xF0: case 0xD0: flag = CPU_FIELD(flag_z), mask = 0xFF; break;
+          case 0x10: case 0x30: flag = CPU_FIELD(flag_n); break;
+          case 0x50: case 0x70: flag = CPU_FIELD(flag_v); break;
+        }
+        // BCC, BEQ, BPL and BVC are taken when the tested bits are zero,
+        // the others when they aren't. Jump over the taken path if the
+        // branch isn't taken
+        bool taken_if_zero = (opcode == 0x90 || opcode == 0xF0 ||
+                              opcode == 0x10 || opcode == 0x50);
+        e->TestByteImm(flag, mask);
+        u8 *not_taken = e->JumpCondition32(taken_if_zero ? X86_JNZ : X86_JZ);
+
+        int extra_cycles = ((next_pc ^ operand) > 0xFF) ? 2 : 1;
+        e->AddQwordImm(CPU_FIELD(cycles), extra_cycles);
+        e->MovWordImm(CPU_FIELD(PC), operand);
+        u8 *done = e->Jump32(X86_JMP);
+
+        PatchRel32(not_taken, e->at);
+        e->MovWordImm(CPU_FIELD(PC), next_pc);
+        PatchRel32(done, e->at);
+
+        pc_is_stale = false;
+        successors[num_successors++] = operand;
+        successors[num_successors++] = next_pc;
+      } break;
+
+      default: {
+        InstructionType type = KnownType(opcode);
+        AddressingMode mode = KnownMode(opcode);
+
+        if ((type == I_STA || type == I_STX || type == I_STY) &&
+            IsDataMode(mode)) {
+          // The store may hit code and end the block, so the counters have
+          // to be up to date before it
+          e->AddQwordImm(CPU_FIELD(cycles), pending_cycles);
+          e->AddQwordImm(CPU_FIELD(instructions), pending_instructions);
+          pending_cycles = 0;
+          pending_instructions = 0;
+
+          int offset = type == I_STA ? CPU_FIELD(A)
+                       : type == I_STX ? CPU_FIELD(X)
+                                       : CPU_FIELD(Y);
+          EmitAddress(e, mode, operand, false);
+          u8 *flushed = EmitWrite(e, cache, mode, offset, next_pc);
+          if (flushed != NULL) {
+            exit_jumps[num_exit_jumps++] = flushed;
+          }
+          pc_is_stale = true;
+          break;
+        }
+
+        if (IsDataMode(mode) &&
+            (type == I_LDA || type == I_LDX || type == I_LDY ||
+             type == I_AND || type == I_ORA || type == I_EOR ||
+             type == I_CMP || type == I_CPX || type == I_CPY ||
+             type == I_ADC || type == I_SBC)) {
+          if (mode == AM_Immediate) {
+            e->Byte(0xB8), e->U32((u8)operand);  // mov eax, operand
+          } else {
+            EmitAddress(e, mode, operand, PaysPageCrossPenalty(type));
+            EmitRead(e, mode);
+          }
+          EmitDataOp(e, type);
+          pc_is_stale = true;
+          break;
+        }
+
+        if ((type == I_INC || type == I_DEC) && IsZeropageMode(mode)) {
+          EmitAddress(e, mode, operand, false);
+          EmitLoadMemoryPointer(e);
+          e->Byte(0xFE), e->Byte(type == I_INC ? 0x04 : 0x0C);
+          e->Byte(0x0A);  // inc/dec byte [rdx+rcx]
+          e->Byte(0x0F), e->Byte(0xB6), e->Byte(0x04), e->Byte(0x0A);
+          // movzx eax, byte [rdx+rcx]
+          EmitSetNZFromAL(e);
+          pc_is_stale = true;
+          break;
+        }
+
+        if (EmitRegisterOp(e, type)) {
+          pc_is_stale = true;
+          break;
+        }
+
+        // Everything else goes through the interpreter's handler
+        e->AddQwordImm(CPU_FIELD(cycles), pending_cycles -
+                                              gCyclesForOpcode[opcode]);
+        e->AddQwordImm(CPU_FIELD(instructions), pending_instructions);
+        pending_cycles = 0;
+        pending_instructions = 0;
+
+        e->MovWordImm(CPU_FIELD(PC), next_pc);
+        EmitHandlerCall(e, instruction->handler, operand);
+        pc_is_stale = false;
+
+        // Leave if the handler has overwritten translated code
+        exit_jumps[num_exit_jumps++] = EmitFlushCheck(e, cache);
+
+        if ((type == I_JMP || type == I_JSR) && mode == AM_Absolute) {
+          successors[num_successors++] = operand;
+        }
+      } break;
+    }
+
+    if (is_last && !EndsBlock(KnownType(opcode))) {
+      // The block was cut short, it falls through to the next one
+      successors[num_successors++] = next_pc;
+    }
+    if (is_last && pc_is_stale) {
+      e->MovWordImm(CPU_FIELD(PC), next_pc);
+    }
+    pc = next_pc;
+  }
+
+  e->AddQwordImm(CPU_FIELD(cycles), pending_cycles);
+  e->AddQwordImm(CPU_FIELD(instructions), pending_instructions);
+
+  // Go on to the next translated block while the budget lasts and nothing
+  // is waiting on the bus. Run takes interrupts and stop requests
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x43);  // mov rax, [cycles]
+  e->Byte(CPU_FIELD(cycles));
+  e->Byte(0x48), e->Byte(0x3B), e->Byte(0x43);  // cmp rax, [cycle_limit]
+  e->Byte(CPU_FIELD(cycle_limit));
+  exit_jumps[num_exit_jumps++] = e->JumpCondition32(X86_JAE);
+  e->Byte(0x48), e->Byte(0x8B), e->Byte(0x43);  // mov rax, [bus]
+  e->Byte(CPU_FIELD(bus));
+  e->Byte(0x83), e->Byte(0xB8);  // cmp dword [rax+irq], 0
+  e->U32((u32)offsetof(MemoryBus, irq)), e->Byte(0);
+  exit_jumps[num_exit_jumps++] = e->JumpCondition32(X86_JNZ);
+  e->Byte(0x80), e->Byte(0xB8);  // cmp byte [rax+nmi], 0
+  e->U32((u32)offsetof(MemoryBus, nmi)), e->Byte(0);
+  exit_jumps[num_exit_jumps++] = e->JumpCondition32(X86_JNZ);
+
+  e->Byte(0x0F), e->Byte(0xB7), e->Byte(0x43);  // movzx eax, word [PC]
+  e->Byte(CPU_FIELD(PC));
+  int first_exit = this->num_exits;
+  for (int i = 0; i < num_successors; i++) {
+    e->Byte(0x3D), e->U32(successors[i]);  // cmp eax, successor
+    e->Byte(0x75), e->Byte(5);             // jne over the jump
+    JitExit *exit = this->exits + this->num_exits++;
+    exit->target = successors[i];
+    exit->linked = false;
+    exit->jump = e->Jump32(X86_JMP);
+    exit_jumps[num_exit_jumps++] = exit->jump;
+  }
+
+  // Epilogue
+  for (int i = 0; i < num_exit_jumps; i++) {
+    PatchRel32(exit_jumps[i], e->at);
+  }
+  e->Byte(0x48), e->Byte(0x83), e->Byte(0xC4), e->Byte(32);  // add rsp, 32
+  e->Byte(0x5B);                                             // pop rbx
+  e->Byte(0xC3);                                             // ret
+
+  Assert(e->at - code <= kMaxTranslationSize);
+  this->arena_used += (int)(e->at - code);
+  block->jit_code = code;
+  this->blocks_translated++;
+
+  this->Link(cache, block, first_exit);
+
+  return code;
+#else
+  return NULL;
+#endif
+}
+
+// Patches jumps between the new block and the ones already translated
+void Jit::Link(BlockCache *cache, Block *block, int first_exit) {
+  for (int i = 0; i < this->num_exits; i++) {
+    JitExit *exit = this->exits + i;
+    if (exit->linked) continue;
+
+    Block *target = NULL;
+    if (i >= first_exit) {
+      // The new block's own exits
+      target = cache->lookup[exit->target & (kBlockLookupSize - 1)];
+      if (target == NULL || !target->is_valid ||
+          target->start != exit->target || target->jit_code == NULL) {
+        continue;
+      }
+    } else if (exit->target == block->start) {
+      target = block;
+    } else {
+      continue;
+    }
+
+    PatchRel32(exit->jump, (u8 *)target->jit_code + kJitPrologueSize);
+    exit->linked = true;
+  }
+}
+
+typedef void (*TranslatedBlock)(CPU *);
+
+// Runs a translated block and whatever blocks it chains to
+void Jit::Execute(CPU *cpu, Block *block) {
+  if (!this->validate) {
+    ((TranslatedBlock)block->jit_code)(cpu);
+    return;
+  }
+
+  // Lockstep validation: run one block natively, then replay the same number
+  // of instructions in the interpreter on a copy of the machine. Devices
+  // are shared with the copy, so they see every access twice
+  if (this->validation_memory == NULL) {
+    this->validation_memory = AllocateMirroredMemory();
+    this->validation_bus = (MemoryBus *)malloc(sizeof(MemoryBus));
+    if (this->validation_memory == NULL || this->validation_bus == NULL) {
+      print("Couldn't allocate memory for JIT validation\n");
+      if (this->validation_memory != NULL) {
+        FreeMirroredMemory(this->validation_memory);
+        this->validation_memory = NULL;
+      }
+      free(this->validation_bus);
+      this->validation_bus = NULL;
+      this->validate = false;
+      ((TranslatedBlock)block->jit_code)(cpu);
+      return;
+    }
+  }
+  MemoryBus *bus = this->validation_bus;
+  *bus = *cpu->bus;
+  bus->memory = this->validation_memory;
+  bus->block_cache = NULL;
+  for (int page = 0; page <= kNumPages; page++) {
+    if (bus->read[page] != NULL) bus->read[page] = bus->memory;
+    if (bus->write[page] != NULL) bus->write[page] = bus->memory;
+  }
+  memcpy(this->validation_memory, cpu->bus->memory, kMachineMemorySize);
+  CPU reference = *cpu;
+  reference.memory = bus->memory;
+  reference.bus = bus;
+  reference.block_cache = NULL;
+  reference.jit = NULL;
+
+  u64 cycle_limit = cpu->cycle_limit;
+  cpu->cycle_limit = 0;  // don't chain
+  ((TranslatedBlock)block->jit_code)(cpu);
+  cpu->cycle_limit = cycle_limit;
+
+  while (reference.instructions < cpu->instructions) {
+    reference.Tick();
+  }
+  this->blocks_validated++;
+
+  int bad_address = -1;
+  for (int i = 0; i < kMachineMemorySize; i++) {
+    if (bus->memory[i] != cpu->bus->memory[i]) {
+      bad_address = i;
+      break;
+    }
+  }
+
+  if (reference.A != cpu->A || reference.X != cpu->X ||
+      reference.Y != cpu->Y || reference.SP != cpu->SP ||
+      reference.GetStatus() != cpu->GetStatus() || reference.PC != cpu->PC ||
+      reference.cycles != cpu->cycles || bad_address >= 0) {
+    print("JIT mismatch in block at $%04X:\n", block->start);
+    print("  jit:         A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X %llu\n",
+          cpu->A, cpu->X, cpu->Y, cpu->SP, cpu->GetStatus(), cpu->PC,
+          (unsigned long long)cpu->cycles);
+    print("  interpreter: A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X %llu\n",
+          reference.A, reference.X, reference.Y, reference.SP,
+          reference.GetStatus(), reference.PC,
+          (unsigned long long)reference.cycles);
+    if (bad_address >= 0) {
+      print("  first memory difference at $%04X\n", bad_address);
+    }
+    this->validation_failures++;
+
+    // Trust the interpreter and carry on without the JIT
+    memcpy(cpu->bus->memory, bus->memory, kMachineMemorySize);
+    cpu->block_cache->Reset();
+    reference.memory = cpu->memory;
+    reference.bus = cpu->bus;
+    reference.block_cache = cpu->block_cache;
+    reference.jit = cpu->jit;
+    reference.cycle_limit = cpu->cycle_limit;
+    *cpu = reference;
+    this->enabled = false;
+  }
+}
+
+#endif  // JIT_CPP
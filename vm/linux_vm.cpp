@@ -3,6 +3,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
+#include <X11/keysym.h>
 #include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,23 +17,319 @@
 
 **************************************/
 
-global bool gRunning;
+global volatile bool gRunning;  // false once the window is closed
 global void *gLinuxBitmapMemory;
+global r64 gSpeed = 1.0;  // multiple of the emulated clock, 0 = unthrottled
+global bool gUseBlockCache = true;
+global bool gFusePairs = true;
+global bool gSkipIdleLoops = true;
+global bool gUseJit = false;
+global bool gValidateJit = false;
+global char *gProfileFile = NULL;  // folded stacks
+global char *gHeatmapFile = NULL;
+global char *gHeatmapSeriesFile = NULL;  // per frame, CSV
+global bool gHeatmapBytes = false;
+global bool gShowFrameStats = false;  // the overlay, F1 toggles it
+global char *gMetricsName = NULL;
+global char *gDigestFile = NULL;
+global u64 gDigestInterval = 100000;  // cycles
+global int const kMaxWatchArgs = 16;
+global char const *gWatchArgs[kMaxWatchArgs];  // "<address>[:<length>]"
+global int gNumWatchArgs = 0;
+global bool gPauseOnWatch = false;
 
 #include "vm.cpp"
+#include "frame_stats.cpp"
+#include "metrics.cpp"
 
 global XImage *gXImage;
+global FrameStats gFrameStats;
+global MetricsPublisher *gMetrics;
+global pthread_t gRenderThread;
+global volatile u64 gFramesRendered;  // written by the render thread
+global volatile u64 gFramesDropped;
+
+static r64 LinuxGetWallClock() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (r64)time.tv_sec + (r64)time.tv_nsec / 1e9;
+}
+
+static u64 ThreadCPUNanoseconds(clockid_t clock) {
+  timespec time;
+  if (clock_gettime(clock, &time) != 0) return 0;
+  return (u64)time.tv_sec * 1000000000 + (u64)time.tv_nsec;
+}
+
+// Called on the machine thread
+static void PublishMachineMetrics(Machine *machine, r64 now) {
+  CPU *cpu = &machine->cpu;
+  MetricsValues values = {};
+  values.cycles = cpu->cycles;
+  values.instructions = cpu->instructions;
+  values.emulated_frames = cpu->cycles / kCyclesPerFrame;
+  values.frames_rendered = AtomicLoad(&gFramesRendered);
+  values.frames_dropped = AtomicLoad(&gFramesDropped);
+  values.machine_thread_cpu_ns = CurrentThreadCPUNanoseconds();
+  clockid_t render_clock;
+  if (pthread_getcpuclockid(gRenderThread, &render_clock) == 0) {
+    values.render_thread_cpu_ns = ThreadCPUNanoseconds(render_clock);
+  }
+  values.published_ns = (u64)(now * 1e9);
+  values.pid = (u32)getpid();
+  values.pc = cpu->PC;
+  values.is_running = cpu->is_running;
+  PublishMetrics(gMetrics, &values, now);
+}
+
+// What the input device gets for a key, 0 for keys it doesn't know
+static u8 InputKeyFor(KeySym keysym) {
+  if (keysym >= 0x20 && keysym <= 0x7E) return (u8)keysym;  // ASCII
+  switch (keysym) {
+    case XK_Return:
+      return 0x0D;
+    case XK_Escape:
+      return 0x1B;
+    case XK_BackSpace:
+      return 0x08;
+    case XK_Up:
+      return Key_Up;
+    case XK_Down:
+      return Key_Down;
+    case XK_Left:
+      return Key_Left;
+    case XK_Right:
+      return Key_Right;
+  }
+  return 0;
+}
+
+static void DrawFrameOverlay(Display *display, Window window, GC gc) {
+  char lines[kNumFrameStages + 2][64];
+  int count = FormatFrameOverlay(&gFrameStats, lines, COUNT_OF(lines));
+  XSetForeground(display, gc, WhitePixel(display, DefaultScreen(display)));
+  for (int i = 0; i < count; i++) {
+    XDrawString(display, window, gc, 8, 16 + 14 * i, lines[i],
+                (int)strlen(lines[i]));
+  }
+}
 
 static void *machine_thread(void *arg) {
-  CPU cpu = CPU();
-  while (cpu.is_running) {
-    cpu.Tick();
-    usleep(1);
+  Machine *machine = (Machine *)arg;
+  CPU *cpu = &machine->cpu;
+  r64 start_time = LinuxGetWallClock();
+  Pacer pacer = Pacer(gSpeed, start_time, cpu->cycles);
+  r64 last_published = 0;
+  while (cpu->is_running && gRunning) {
+    StopReason reason = machine->Run(pacer.SliceCycles());
+    if (reason == Stop_Error) {
+      print("%s\n", machine->error);
+      break;
+    }
+    if (machine->watchpoints) {
+      PrintWatchHits(machine->watchpoints);
+    }
+    if (reason == Stop_Requested) {
+      print("Paused at PC=$%04X, press Enter to go on\n", cpu->PC);
+      getchar();
+      pacer = Pacer(gSpeed, LinuxGetWallClock(), cpu->cycles);
+    }
+    r64 now = LinuxGetWallClock();
+    if (gMetrics && now - last_published >= 0.01) {
+      PublishMachineMetrics(machine, now);
+      last_published = now;
+    }
+    r64 seconds = pacer.SecondsToSleep(now, cpu->cycles);
+    if (seconds > 0) {
+      usleep((useconds_t)(seconds * 1e6));
+    }
+  }
+  r64 elapsed = LinuxGetWallClock() - start_time;
+  if (gMetrics) {
+    PublishMachineMetrics(machine, LinuxGetWallClock());  // not running
   }
   print("CPU has finished work\n");
+  if (cpu->profile) {
+    cpu->profile->Flush(cpu->cycles);
+    PrintProfile(cpu->profile, machine->source_map, 20);
+    if (WriteFoldedStacks(cpu->profile, machine->source_map, gProfileFile)) {
+      print("Folded stacks written to %s\n", gProfileFile);
+    } else {
+      print("Couldn't write %s\n", gProfileFile);
+    }
+  }
+  print("%llu instructions in %.3f s, %.0f instructions/s (%s dispatch)\n",
+        (unsigned long long)cpu->instructions, elapsed,
+        cpu->instructions / elapsed, kDispatchName);
+  if (cpu->jit) {
+    print("JIT: %llu blocks translated, %llu flushes",
+          (unsigned long long)cpu->jit->blocks_translated,
+          (unsigned long long)cpu->jit->flushes);
+    if (cpu->jit->validate) {
+      print(", %llu blocks validated, %llu mismatches",
+            (unsigned long long)cpu->jit->blocks_validated,
+            (unsigned long long)cpu->jit->validation_failures);
+    }
+    print("\n");
+  }
+  if (cpu->heatmap) {
+    if (gHeatmapSeriesFile) {
+      cpu->heatmap->Sample(cpu->cycles);  // the last bit
+      if (!WriteHeatmapSeries(cpu->heatmap, gHeatmapSeriesFile)) {
+        print("Couldn't write %s\n", gHeatmapSeriesFile);
+      }
+    }
+    PrintHeatmap(cpu->heatmap);
+    if (gHeatmapFile && !WriteHeatmap(cpu->heatmap, gHeatmapFile)) {
+      print("Couldn't write %s\n", gHeatmapFile);
+    }
+  }
+  if (cpu->digest) {
+    fflush(cpu->digest->file);
+    print("Digest: %llu checkpoints written to %s\n",
+          (unsigned long long)cpu->digest->num_records, gDigestFile);
+  }
+  if (machine->watchpoints) {
+    print("Watchpoints: %llu other stores to the watched host pages\n",
+          (unsigned long long)machine->watchpoints->near_misses);
+  }
+  if (cpu->block_cache) {
+    cpu->block_cache->PrintFusionReport();
+    print("Idle loops: %llu cycles skipped\n",
+          (unsigned long long)cpu->block_cache->idle_cycles_skipped);
+  }
+  return 0;
+}
+
+// Attaches the tools the command line asked for, loads the program and
+// connects the keyboard. Says what went wrong and returns false if it can't
+static bool SetUpMachine(Machine *machine) {
+  if (gUseBlockCache || gUseJit) {
+    machine->cpu.block_cache = NewBlockCache(&machine->bus);
+    if (machine->cpu.block_cache == NULL) {
+      fprintf(stderr, "Not enough memory for the block cache\n");
+      return false;
+    }
+    machine->cpu.block_cache->fuse_pairs = gFusePairs;
+    machine->cpu.block_cache->skip_idle_loops = gSkipIdleLoops;
+  }
+  if (gUseJit) {
+    machine->cpu.jit = NewJit();
+    if (machine->cpu.jit) {
+      machine->cpu.jit->validate = gValidateJit;
+    }
+  }
+
+  if (gProfileFile) {
+    machine->source_map = (SourceMap *)calloc(1, sizeof(SourceMap));
+    machine->cpu.profile = NewProfile();
+    if (!machine->source_map || !machine->cpu.profile) {
+      fprintf(stderr, "Not enough memory to profile\n");
+      return false;
+    }
+  }
+
+  if (machine->cpu.instruments & Instrument_Heatmap) {
+    u64 interval = gHeatmapSeriesFile ? kCyclesPerFrame : 0;
+    machine->cpu.heatmap = NewHeatmap(gHeatmapBytes, interval);
+    if (!machine->cpu.heatmap) {
+      fprintf(stderr, "Not enough memory for the heatmap\n");
+      return false;
+    }
+  }
+
+  if (gDigestFile) {
+    machine->cpu.digest =
+        NewStateDigest(machine->memory, gDigestInterval, gDigestFile);
+    if (!machine->cpu.digest) {
+      fprintf(stderr, "Couldn't write %s\n", gDigestFile);
+      return false;
+    }
+  }
+
+  // Load the program at $D400
+  if (!machine->LoadProgram("test/pong.s", kPC_start)) {
+    fprintf(stderr, "%s\n", machine->error);
+    return false;
+  }
+
+  // Keyboard and joystick registers at $FD00
+  if (!ConnectInput(machine)) {
+    fprintf(stderr, "Couldn't connect the keyboard\n");
+    return false;
+  }
+
+  // After loading, which would hit them
+  for (int i = 0; i < gNumWatchArgs; i++) {
+    char *end;
+    char const *arg = gWatchArgs[i];
+    if (*arg == '$') arg++;
+    u32 address = (u32)strtoul(arg, &end, 16);
+    u32 length = *end == ':' ? (u32)strtoul(end + 1, &end, 0) : 1;
+    if (*end != '\0' || address > 0xFFFF || length == 0 || length > 0xFFFF) {
+      fprintf(stderr, "Bad watchpoint %s\n", gWatchArgs[i]);
+      return false;
+    }
+    if (!machine->Watch((u16)address, (u16)length, gPauseOnWatch)) {
+      fprintf(stderr, "Couldn't set a watchpoint at $%04X\n", address);
+      return false;
+    }
+  }
+
+  return true;
 }
 
 int main(int argc, char const *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      gSpeed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--no-block-cache") == 0) {
+      gUseBlockCache = false;
+    } else if (strcmp(argv[i], "--no-fusion") == 0) {
+      gFusePairs = false;
+    } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+      gSkipIdleLoops = false;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      gUseJit = true;
+    } else if (strcmp(argv[i], "--jit-validate") == 0) {
+      gUseJit = true;
+      gValidateJit = true;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      gProfileFile = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+      gHeatmapFile = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--heatmap-bytes") == 0) {
+      gHeatmapBytes = true;
+    } else if (strcmp(argv[i], "--heatmap-series") == 0 && i + 1 < argc) {
+      gHeatmapSeriesFile = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      gMetricsName = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--frame-stats") == 0) {
+      gShowFrameStats = true;
+    } else if (strcmp(argv[i], "--digest") == 0 && i + 1 < argc) {
+      gDigestFile = (char *)argv[++i];
+    } else if (strcmp(argv[i], "--digest-interval") == 0 && i + 1 < argc) {
+      gDigestInterval = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc &&
+               gNumWatchArgs < kMaxWatchArgs) {
+      gWatchArgs[gNumWatchArgs++] = argv[++i];
+    } else if (strcmp(argv[i], "--watch-pause") == 0) {
+      gPauseOnWatch = true;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--speed <multiple of 1 MHz, 0 = max>] "
+              "[--no-block-cache] [--no-fusion] [--no-idle-skip] [--jit] "
+              "[--jit-validate] "
+              "[--profile <folded stacks file>] [--heatmap <file>] "
+              "[--heatmap-bytes] [--heatmap-series <csv file>] "
+              "[--digest <file>] [--digest-interval <cycles>] "
+              "[--frame-stats] [--metrics <name>] "
+              "[--watch <hex address>[:<length>]] [--watch-pause]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
   Display *display;
   Window window;
   int screen;
@@ -82,23 +379,48 @@ int main(int argc, char const *argv[]) {
     gc = XCreateGC(display, window, 0, &gcvalues);
   }
 
-  // Init VM memory
-  gMachineMemory = malloc(kMachineMemorySize);
-  gVideoMemory = (u8 *)gMachineMemory + 0x0200;
-
-  // Load the program at $D400
-  LoadProgram("test/pong.s", 0xD400);
+  u32 instruments = 0;
+  if (gProfileFile) instruments |= Instrument_Profile;
+  bool use_heatmap = gHeatmapFile || gHeatmapSeriesFile || gHeatmapBytes;
+  if (use_heatmap) instruments |= Instrument_Heatmap;
+  if (gDigestFile) instruments |= Instrument_Digest;
+  Machine *machine = NewMachine(instruments);
+  if (machine == NULL) {
+    fprintf(stderr, "Not enough memory for the machine\n");
+    return 1;
+  }
+  if (!SetUpMachine(machine)) {
+    FreeMachine(machine);
+    return 1;
+  }
+  InputDevice *input = machine->input;
+  if (gMetricsName) {
+    gMetrics = StartMetrics(gMetricsName);
+    if (!gMetrics) {
+      fprintf(stderr, "Couldn't publish metrics as %s\n", gMetricsName);
+      FreeMachine(machine);
+      return 1;
+    }
+  }
 
   gRunning = true;
+  gRenderThread = pthread_self();
 
   // Run the machine
   pthread_t thread_id;
-  if (pthread_create(&thread_id, 0, &machine_thread, 0) != 0) {
+  if (pthread_create(&thread_id, 0, &machine_thread, machine) != 0) {
     fprintf(stderr, "Cannot create thread\n");
+    if (gMetrics) {
+      StopMetrics(gMetrics);
+    }
+    FreeMachine(machine);
     return 1;
   }
 
+  u64 last_frame = AtomicLoad(&machine->frame);
   while (gRunning) {
+    gFrameStats.StartFrame(LinuxGetWallClock());
+
     // Process events
     while (XPending(display)) {
       XEvent event;
@@ -110,13 +432,27 @@ int main(int argc, char const *argv[]) {
           gRunning = false;
         }
       }
+      if (event.type == KeyPress || event.type == KeyRelease) {
+        KeySym keysym = XLookupKeysym(&event.xkey, 0);
+        u8 key = InputKeyFor(keysym);
+        if (key != 0) {
+          u64 sequence = input->queue.Push(key, event.type == KeyPress);
+          gFrameStats.input.OnEvent(sequence, LinuxGetWallClock());
+        } else if (keysym == XK_F1 && event.type == KeyPress) {
+          gShowFrameStats = !gShowFrameStats;
+        }
+      }
     }
+    r64 events_end = LinuxGetWallClock();
+    gFrameStats.EndStage(Stage_Events, events_end);
+    gFrameStats.input.BeforeConvert(input, AtomicLoad(&machine->frame),
+                                    events_end);
 
     // Copy data from the machine's video memory to our "display"
     // and stretch pixels
     for (int y = 0; y < kWindowHeight; y++) {
       for (int x = 0; x < kWindowWidth; x++) {
-        u8 *src_pixel = gVideoMemory + kWindowWidth * y + x;
+        u8 *src_pixel = machine->video_memory + kWindowWidth * y + x;
         u32 *dest_pixel =
             (u32 *)gLinuxBitmapMemory + (kWindowWidth * SCREEN_ZOOM * y + x) * SCREEN_ZOOM;
         u32 color = GetColor(*src_pixel);
@@ -128,11 +464,37 @@ int main(int argc, char const *argv[]) {
       }
     }
 
+    gFrameStats.EndStage(Stage_Convert, LinuxGetWallClock());
+
     XPutImage(display, window, gc, gXImage, 0, 0, 0, 0, kWindowWidth * SCREEN_ZOOM,
               kWindowHeight * SCREEN_ZOOM);
+    if (gShowFrameStats) {
+      DrawFrameOverlay(display, window, gc);
+    }
+    // Flushing here so that presenting is timed, not the next XPending
+    XFlush(display);
+    r64 present_end = LinuxGetWallClock();
+    gFrameStats.EndStage(Stage_Present, present_end);
+    gFrameStats.input.AfterPresent(present_end);
+
+    // Emulated frames that came and went since the last one shown
+    u64 frame = AtomicLoad(&machine->frame);
+    u64 frames_since = frame - last_frame;
+    if (frames_since > 1) {
+      AtomicStore(&gFramesDropped, gFramesDropped + frames_since - 1);
+    }
+    last_frame = frame;
+    AtomicStore(&gFramesRendered, gFramesRendered + 1);
   }
 
+  // Let the machine finish its slice and write out what it has collected
+  pthread_join(thread_id, NULL);
   XCloseDisplay(display);
+  PrintFrameStats(&gFrameStats);
+  if (gMetrics) {
+    StopMetrics(gMetrics);
+  }
+  FreeMachine(machine);
 
   return 0;
 }
@@ -0,0 +1,280 @@
+// ================= Memory bus ==================
+#ifndef MEMORY_BUS_CPP
+#define MEMORY_BUS_CPP
+
+#ifdef BUILD_WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// The 64K address space is split into 256 pages of 256 bytes. Each page is
+// plain RAM, read-only ROM, or belongs to a device that handles reads and
+// writes itself.
+//
+// Every page has a read and a write pointer into the machine's memory. When
+// it's there the access is a plain load or store, otherwise it goes through
+// SlowRead/SlowWrite. So RAM costs one table lookup and devices only cost
+// something when they're touched. Pages that hold decoded blocks have their
+// write pointer taken away so that stores to code get noticed.
+//
+// The CPU fetches instructions, and does all its zero page and stack
+// accesses, straight from memory without asking the bus. Code on a device
+// page runs whatever is in memory underneath, and the zero page and the
+// stack (pages 0 and 1) are always RAM.
+//
+// Machine memory is mapped twice in a row (see AllocateMirroredMemory), so
+// an address that runs past $FFFF, like $FFFF + 1 or $FFF0,X, lands back at
+// the bottom without being masked. The highest address the CPU can come up
+// with is $FFFF + $FF, which is why there's one extra page entry, a copy of
+// the zero page.
+//
+// The bus also carries the interrupt lines. IRQ is held down by whoever
+// wants it (one bit each, a device usually uses its index) until they've
+// been served, NMI is remembered until the CPU takes it. The CPU looks at
+// them between instructions, see CPU::TakeInterrupt.
+//
+// The top bit of irq isn't an interrupt line: RequestStop sets it to make
+// the CPU return from Run, so that the loop has just the one thing to check.
+
+// Returns kMachineMemorySize bytes followed by a second view of the same
+// bytes, or NULL
+static u8 *AllocateMirroredMemory() {
+  int size = kMachineMemorySize;
+#ifdef BUILD_WIN32
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+                                      0, size, 0);
+  if (mapping == NULL) return NULL;
+  u8 *result = NULL;
+  // Find a free range and map both views in it. Someone else may grab the
+  // range in between, so try a few times
+  for (int attempt = 0; attempt < 10 && result == NULL; attempt++) {
+    u8 *base = (u8 *)VirtualAlloc(0, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
+    if (base == NULL) break;
+    VirtualFree(base, 0, MEM_RELEASE);
+    void *low = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, base);
+    void *high =
+        MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, base + size);
+    if (low == base && high == base + size) {
+      result = base;
+    } else {
+      if (low) UnmapViewOfFile(low);
+      if (high) UnmapViewOfFile(high);
+    }
+  }
+  CloseHandle(mapping);  // the views keep it alive
+  return result;
+#else
+  int fd = memfd_create("machine memory", 0);
+  if (fd < 0) return NULL;
+  u8 *result = NULL;
+  if (ftruncate(fd, size) == 0) {
+    // Reserve the whole range first so that nothing else ends up in it
+    u8 *base = (u8 *)mmap(0, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+    if (base != MAP_FAILED) {
+      int prot = PROT_READ | PROT_WRITE;
+      void *low = mmap(base, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+      void *high = mmap(base + size, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+      if (low == base && high == base + size) {
+        result = base;
+      } else {
+        munmap(base, 2 * size);
+      }
+    }
+  }
+  close(fd);  // the mappings keep it alive
+  return result;
+#endif
+}
+
+static void FreeMirroredMemory(u8 *memory) {
+#ifdef BUILD_WIN32
+  UnmapViewOfFile(memory);
+  UnmapViewOfFile(memory + kMachineMemorySize);
+#else
+  munmap(memory, 2 * kMachineMemorySize);
+#endif
+}
+
+global int const kNumPages = 256;
+global int const kMaxDevices = 16;
+global int const kFirstMappablePage = 2;  // past the zero page and stack
+global u32 const kStopRequest = 0x80000000;  // in MemoryBus::irq
+
+typedef u8 (*DeviceReadFunction)(void *context, u16 address);
+typedef void (*DeviceWriteFunction)(void *context, u16 address, u8 value);
+
+struct Device {
+  DeviceReadFunction read;    // may be NULL, reads return 0 then
+  DeviceWriteFunction write;  // may be NULL, writes are ignored then
+  void *context;
+};
+
+enum PageKind {
+  Page_RAM = 0,
+  Page_ROM,
+  Page_Device,
+};
+
+struct BlockCache;
+static void InvalidateCodeOnPage(BlockCache *, int page);
+
+struct MemoryBus {
+  // Pointers are biased so that they're indexed with the full address,
+  // i.e. read[page][address]. NULL means take the slow path.
+  // The last entry is the zero page seen past $FFFF
+  u8 *read[kNumPages + 1];
+  u8 *write[kNumPages + 1];
+
+  u8 *memory;  // mirrored, see AllocateMirroredMemory
+  u8 kind[kNumPages];
+  u8 device_for_page[kNumPages];
+  u8 num_devices;
+  Device devices[kMaxDevices];
+
+  BlockCache *block_cache;  // told about stores to pages with code
+
+  u32 irq;   // one bit per source
+  bool nmi;  // pending
+
+  void Init(u8 *memory);
+  void MapRAM(int first_page, int num_pages);
+  bool MapROM(int first_page, int num_pages);
+  bool MapDevice(int first_page, int num_pages, Device device);
+  void TrapWrites(int page, bool trap);
+  void UpdateMirror();
+  void AssertIRQ(int source);
+  void ReleaseIRQ(int source);
+  void RaiseNMI();
+  void RequestStop();
+
+  // Addresses go up to $FFFF + $FF
+  inline u8 Read(u32 address);
+  inline void Write(u32 address, u8 value);
+  u8 SlowRead(u32 address);
+  void SlowWrite(u32 address, u8 value);
+};
+
+// All RAM
+void MemoryBus::Init(u8 *memory) {
+  this->memory = memory;
+  this->num_devices = 0;
+  this->block_cache = NULL;
+  this->irq = 0;
+  this->nmi = false;
+  this->MapRAM(0, kNumPages);
+}
+
+void MemoryBus::MapRAM(int first_page, int num_pages) {
+  for (int page = first_page; page < first_page + num_pages; page++) {
+    this->kind[page] = Page_RAM;
+    this->read[page] = this->memory;
+    this->write[page] = this->memory;
+    InvalidateCodeOnPage(this->block_cache, page);
+  }
+  this->UpdateMirror();
+}
+
+// The contents stay whatever is in memory, e.g. what LoadProgram put there.
+// Returns false if the range includes the zero page or the stack
+bool MemoryBus::MapROM(int first_page, int num_pages) {
+  if (first_page < kFirstMappablePage) return false;
+  for (int page = first_page; page < first_page + num_pages; page++) {
+    this->kind[page] = Page_ROM;
+    this->read[page] = this->memory;
+    this->write[page] = NULL;
+    InvalidateCodeOnPage(this->block_cache, page);
+  }
+  return true;
+}
+
+// Returns false if there are too many devices already or the range
+// includes the zero page or the stack
+bool MemoryBus::MapDevice(int first_page, int num_pages, Device device) {
+  if (this->num_devices >= kMaxDevices || first_page < kFirstMappablePage) {
+    return false;
+  }
+  int index = this->num_devices++;
+  this->devices[index] = device;
+  for (int page = first_page; page < first_page + num_pages; page++) {
+    this->kind[page] = Page_Device;
+    this->device_for_page[page] = (u8)index;
+    this->read[page] = NULL;
+    this->write[page] = NULL;
+    InvalidateCodeOnPage(this->block_cache, page);
+  }
+  return true;
+}
+
+// Called by the block cache when the first block lands on a page and when
+// the last one goes away. Only RAM pages can be written to anyway
+void MemoryBus::TrapWrites(int page, bool trap) {
+  if (this->kind[page] != Page_RAM) return;
+  this->write[page] = trap ? NULL : this->memory;
+  this->UpdateMirror();
+}
+
+void MemoryBus::UpdateMirror() {
+  this->read[kNumPages] = this->read[0];
+  this->write[kNumPages] = this->write[0];
+}
+
+void MemoryBus::AssertIRQ(int source) { this->irq |= 1u << source; }
+
+void MemoryBus::ReleaseIRQ(int source) { this->irq &= ~(1u << source); }
+
+void MemoryBus::RaiseNMI() { this->nmi = true; }
+
+void MemoryBus::RequestStop() { this->irq |= kStopRequest; }
+
+force_inline u8 MemoryBus::Read(u32 address) {
+  u8 *memory = this->read[address >> 8];
+  if (memory != NULL) {
+    return memory[address];
+  }
+  return this->SlowRead(address);
+}
+
+force_inline void MemoryBus::Write(u32 address, u8 value) {
+  u8 *memory = this->write[address >> 8];
+  if (memory != NULL) {
+    memory[address] = value;
+    return;
+  }
+  this->SlowWrite(address, value);
+}
+
+no_inline u8 MemoryBus::SlowRead(u32 address) {
+  address = (u16)address;
+  int page = address >> 8;
+  if (this->kind[page] == Page_Device) {
+    Device *device = this->devices + this->device_for_page[page];
+    return device->read ? device->read(device->context, (u16)address) : 0;
+  }
+  return this->memory[address];
+}
+
+no_inline void MemoryBus::SlowWrite(u32 address, u8 value) {
+  address = (u16)address;
+  int page = address >> 8;
+  switch (this->kind[page]) {
+    case Page_RAM: {
+      // There's code on this page
+      this->memory[address] = value;
+      InvalidateCodeOnPage(this->block_cache, page);
+    } break;
+    case Page_ROM: {
+      // Ignored
+    } break;
+    case Page_Device: {
+      Device *device = this->devices + this->device_for_page[page];
+      if (device->write) {
+        device->write(device->context, (u16)address, value);
+      }
+    } break;
+  }
+}
+
+#endif  // MEMORY_BUS_CPP
@@ -0,0 +1,208 @@
+// ================= Live metrics ==================
+#ifndef METRICS_CPP
+#define METRICS_CPP
+
+// A running emulator can publish its counters into a named shared memory
+// segment, and metrics_reader shows them from another process without
+// stopping it. The machine thread publishes between slices, so the CPU
+// loop doesn't pay anything for it.
+//
+// Every thread that runs machines has a segment of its own: linux_vm's
+// machine thread, and each of batch's workers as <name>-<worker>, showing
+// the job it's running.
+//
+// The segment is a seqlock: the writer makes sequence odd, writes the
+// values and makes it even again. A reader copies the values and tries
+// again if sequence was odd or changed in the meantime. There's only ever
+// one writer.
+//
+// Fields are only added at the end of MetricsValues, and size says how
+// much of it the writer knows about. version changes when an existing
+// field changes its meaning.
+
+#ifdef BUILD_WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+global char const kMetricsMagic[8] = {'6', '5', '0', '2', 'M', 'T', 'R', 'C'};
+global u32 const kMetricsVersion = 1;
+
+struct MetricsValues {
+  u64 cycles;
+  u64 instructions;
+  r64 mips;  // over the last half second or so
+  u64 emulated_frames;
+  u64 frames_rendered;
+  u64 frames_dropped;  // emulated frames that were never shown
+  u64 machine_thread_cpu_ns;
+  u64 render_thread_cpu_ns;
+  u64 published_ns;  // wall clock, to tell how fresh it is
+  u32 pid;
+  u16 pc;
+  u8 is_running;
+  u8 pad;
+  u32 machine;  // the manifest line of a batch job, 0 for linux_vm
+  u32 pad2;
+};
+
+struct MetricsSegment {
+  char magic[8];
+  u32 version;
+  u32 size;  // of values
+  volatile u64 sequence;  // odd while the values are being written
+  u64 padding[5];  // values start on their own cache line
+  MetricsValues values;
+};
+
+static_assert(offsetof(MetricsSegment, values) == 64,
+              "readers depend on it");
+
+struct MetricsPublisher {
+  MetricsSegment *segment;
+  char name[64];
+#ifdef BUILD_WIN32
+  HANDLE mapping;
+#endif
+
+  // For the MIPS
+  r64 window_start;
+  u64 window_instructions;
+  r64 mips;
+};
+
+// The shared memory name for a metrics name
+static void MetricsSegmentName(char *buffer, int size, char const *name) {
+#ifdef BUILD_WIN32
+  snprintf(buffer, size, "Local\\6502-metrics-%s", name);
+#else
+  snprintf(buffer, size, "/6502-metrics-%s", name);
+#endif
+}
+
+// CPU time of the calling thread
+static u64 CurrentThreadCPUNanoseconds() {
+#ifdef BUILD_WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  u64 kernel_time = (u64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+  u64 user_time = (u64)user.dwHighDateTime << 32 | user.dwLowDateTime;
+  return (kernel_time + user_time) * 100;
+#else
+  timespec time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) return 0;
+  return (u64)time.tv_sec * 1000000000 + (u64)time.tv_nsec;
+#endif
+}
+
+// Returns NULL if the segment can't be created
+static MetricsPublisher *StartMetrics(char const *name) {
+  MetricsPublisher *publisher =
+      (MetricsPublisher *)calloc(1, sizeof(MetricsPublisher));
+  if (publisher == NULL) return NULL;
+  MetricsSegmentName(publisher->name, sizeof(publisher->name), name);
+  void *memory = NULL;
+#ifdef BUILD_WIN32
+  publisher->mapping =
+      CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0,
+                         sizeof(MetricsSegment), publisher->name);
+  if (publisher->mapping != NULL) {
+    memory = MapViewOfFile(publisher->mapping, FILE_MAP_ALL_ACCESS, 0, 0,
+                           sizeof(MetricsSegment));
+  }
+#else
+  int fd = shm_open(publisher->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    if (ftruncate(fd, sizeof(MetricsSegment)) == 0) {
+      memory = mmap(0, sizeof(MetricsSegment), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+      if (memory == MAP_FAILED) memory = NULL;
+    }
+    close(fd);  // the mapping keeps it alive
+  }
+#endif
+  if (memory == NULL) {
+#ifdef BUILD_WIN32
+    if (publisher->mapping != NULL) CloseHandle(publisher->mapping);
+#else
+    shm_unlink(publisher->name);
+#endif
+    free(publisher);
+    return NULL;
+  }
+
+  MetricsSegment *segment = (MetricsSegment *)memory;
+  segment->version = kMetricsVersion;
+  segment->size = sizeof(MetricsValues);
+  // The magic goes last, a reader that sees it sees the rest
+  ReleaseFence();
+  memcpy(segment->magic, kMetricsMagic, sizeof(kMetricsMagic));
+  publisher->segment = segment;
+  return publisher;
+}
+
+// Call from one thread only. Works out the MIPS from the instructions and
+// now (seconds). Fewer instructions than last time means a new machine
+static void PublishMetrics(MetricsPublisher *publisher, MetricsValues *values,
+                           r64 now) {
+  r64 elapsed = now - publisher->window_start;
+  if (publisher->window_start == 0 ||
+      values->instructions < publisher->window_instructions) {
+    publisher->window_start = now;
+    publisher->window_instructions = values->instructions;
+  } else if (elapsed >= 0.5) {
+    publisher->mips =
+        (values->instructions - publisher->window_instructions) / elapsed /
+        1e6;
+    publisher->window_start = now;
+    publisher->window_instructions = values->instructions;
+  }
+  values->mips = publisher->mips;
+
+  MetricsSegment *segment = publisher->segment;
+  u64 sequence = segment->sequence;
+  AtomicStore(&segment->sequence, sequence + 1);
+  ReleaseFence();
+  segment->values = *values;
+  AtomicStore(&segment->sequence, sequence + 2);
+}
+
+// Takes the name away so that no new reader finds it. The segment stays
+// mapped until the process exits, in case a thread still publishes
+static void StopMetrics(MetricsPublisher *publisher) {
+#ifdef BUILD_WIN32
+  // Goes away with the last handle
+#else
+  shm_unlink(publisher->name);
+#endif
+}
+
+// Copies a consistent set of values out of a segment someone else writes.
+// Fields the writer doesn't know about are 0
+static void ReadMetrics(MetricsSegment *segment, MetricsValues *values) {
+  u32 size = segment->size < sizeof(MetricsValues) ? segment->size
+                                                    : sizeof(MetricsValues);
+  for (;;) {
+    u64 before = AtomicLoad(&segment->sequence);
+    if ((before & 1) == 0) {
+      memset(values, 0, sizeof(MetricsValues));
+      memcpy(values, &segment->values, size);
+      AcquireFence();
+      if (AtomicLoad(&segment->sequence) == before) return;
+    }
+#ifdef BUILD_WIN32
+    Sleep(0);
+#else
+    sched_yield();
+#endif
+  }
+}
+
+#endif  // METRICS_CPP
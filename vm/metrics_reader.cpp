@@ -0,0 +1,101 @@
+// Shows the counters an emulator publishes with --metrics <name>, without
+// stopping it. For batch the name is <name>-<worker>:
+//
+//   metrics_reader <name> [--watch]
+//
+// With --watch it prints them again every second until the emulator is gone.
+
+#include "base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "vm.cpp"
+#include "metrics.cpp"
+
+// Returns NULL if there's no such segment or it isn't one of ours
+static MetricsSegment *OpenMetricsSegment(char const *name) {
+  char segment_name[64];
+  MetricsSegmentName(segment_name, sizeof(segment_name), name);
+  int fd = shm_open(segment_name, O_RDONLY, 0);
+  if (fd < 0) return NULL;
+  struct stat info;
+  void *memory = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(MetricsSegment)) {
+    memory = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) return NULL;
+  MetricsSegment *segment = (MetricsSegment *)memory;
+  AcquireFence();
+  if (memcmp(segment->magic, kMetricsMagic, sizeof(kMetricsMagic)) != 0 ||
+      segment->version != kMetricsVersion) {
+    munmap(memory, info.st_size);
+    return NULL;
+  }
+  return segment;
+}
+
+static void PrintMetrics(MetricsValues *values) {
+  // Published with the same clock
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  r64 age = (now.tv_sec * 1e9 + now.tv_nsec - values->published_ns) / 1e9;
+  printf("pid %u, %s, updated %.2f s ago\n", values->pid,
+         values->is_running ? "running" : "finished", age);
+  if (values->machine != 0) {
+    printf("  machine       line %u of the batch manifest\n",
+           values->machine);
+  }
+  printf("  cycles        %llu (%.1f s emulated, %llu frames)\n",
+         (unsigned long long)values->cycles,
+         (r64)values->cycles / kCPUFrequency,
+         (unsigned long long)values->emulated_frames);
+  printf("  instructions  %llu, %.2f MIPS\n",
+         (unsigned long long)values->instructions, values->mips);
+  printf("  frames        %llu rendered, %llu dropped\n",
+         (unsigned long long)values->frames_rendered,
+         (unsigned long long)values->frames_dropped);
+  printf("  CPU time      %.3f s machine thread, %.3f s render thread\n",
+         values->machine_thread_cpu_ns / 1e9,
+         values->render_thread_cpu_ns / 1e9);
+  printf("  PC            $%04X\n", values->pc);
+}
+
+int main(int argc, char const *argv[]) {
+  char const *name = NULL;
+  bool watch = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--watch") == 0) {
+      watch = true;
+    } else if (name == NULL) {
+      name = argv[i];
+    } else {
+      name = NULL;
+      break;
+    }
+  }
+  if (name == NULL) {
+    fprintf(stderr, "Usage: %s <name> [--watch]\n", argv[0]);
+    return 1;
+  }
+
+  MetricsSegment *segment = OpenMetricsSegment(name);
+  if (segment == NULL) {
+    fprintf(stderr, "No emulator publishes metrics as %s\n", name);
+    return 1;
+  }
+  MetricsValues values;
+  ReadMetrics(segment, &values);
+  PrintMetrics(&values);
+  while (watch && values.is_running) {
+    sleep(1);
+    ReadMetrics(segment, &values);
+    printf("\n");
+    PrintMetrics(&values);
+  }
+  return 0;
+}
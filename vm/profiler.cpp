@@ -0,0 +1,295 @@
+// ================= Source-level profiler ==================
+#ifndef PROFILER_CPP
+#define PROFILER_CPP
+
+// With Instrument_Profile the CPU counts how many times each address was
+// executed and how many cycles it took. Every instruction is charged when the
+// next one starts, so branch, page crossing and interrupt cycles all go to
+// the instruction that caused them.
+//
+// Calls are followed too: JSR and interrupts go one level down the call
+// tree, RTS and RTI come back up. Every node of the tree knows the cycles
+// spent in it (not counting its callees), which is exactly what a folded
+// stack file for flame graphs wants. Together with a SourceMap the counters
+// become a report per label and per source line.
+
+global int const kMaxCallNodes = 4096;
+
+struct CallNode {
+  u16 function;  // where it was called
+  int parent;
+  int first_child;
+  int next_sibling;
+  u64 cycles;  // in the function itself
+};
+
+struct Profile {
+  u64 executions[kMachineMemorySize];
+  u64 cycles[kMachineMemorySize];
+
+  CallNode nodes[kMaxCallNodes];  // 0 is where the program started
+  int num_nodes;
+  int current;     // the node the running code belongs to
+  int lost_depth;  // calls that didn't fit in the tree and haven't returned
+  u64 calls_lost;
+
+  // The instruction that hasn't been charged yet
+  bool started;
+  u16 last_pc;
+  int last_node;
+  u64 last_cycles;
+
+  inline void Enter(u16 pc, u8 opcode, int operand, u64 cycles);
+  void Call(u16 function);
+  void Return();
+  void Flush(u64 cycles);
+};
+
+// Called before every instruction with the cycle count at that point
+force_inline void Profile::Enter(u16 pc, u8 opcode, int operand, u64 cycles) {
+  if (this->started) {
+    u64 spent = cycles - this->last_cycles;
+    this->cycles[this->last_pc] += spent;
+    this->nodes[this->last_node].cycles += spent;
+  } else {
+    this->started = true;
+    this->nodes[0].function = pc;
+  }
+  this->executions[pc]++;
+  this->last_pc = pc;
+  this->last_node = this->current;
+  this->last_cycles = cycles;
+
+  if (opcode == 0x20) {
+    this->Call((u16)operand);  // JSR
+  } else if (opcode == 0x60 || opcode == 0x40) {
+    this->Return();  // RTS, RTI
+  }
+}
+
+void Profile::Call(u16 function) {
+  if (this->lost_depth > 0) {
+    this->lost_depth++;
+    return;
+  }
+  CallNode *parent = this->nodes + this->current;
+  int child = parent->first_child;
+  while (child != 0 && this->nodes[child].function != function) {
+    child = this->nodes[child].next_sibling;
+  }
+  if (child == 0) {
+    if (this->num_nodes >= kMaxCallNodes) {
+      // Charge it all to the caller until it returns
+      this->lost_depth = 1;
+      this->calls_lost++;
+      return;
+    }
+    child = this->num_nodes++;
+    CallNode *node = this->nodes + child;
+    node->function = function;
+    node->parent = this->current;
+    node->first_child = 0;
+    node->next_sibling = parent->first_child;
+    node->cycles = 0;
+    parent->first_child = child;
+  }
+  this->current = child;
+}
+
+// Returning from the top just stays there, the program may have started
+// inside a subroutine or thrown away its return address
+void Profile::Return() {
+  if (this->lost_depth > 0) {
+    this->lost_depth--;
+  } else if (this->current != 0) {
+    this->current = this->nodes[this->current].parent;
+  }
+}
+
+// Charges the last instruction, call before looking at the counters
+void Profile::Flush(u64 cycles) {
+  if (!this->started) return;
+  u64 spent = cycles - this->last_cycles;
+  this->cycles[this->last_pc] += spent;
+  this->nodes[this->last_node].cycles += spent;
+  this->last_cycles = cycles;
+}
+
+// Returns NULL if out of memory
+static Profile *NewProfile() {
+  Profile *profile = (Profile *)calloc(1, sizeof(Profile));
+  if (profile == NULL) return NULL;
+  profile->num_nodes = 1;
+  return profile;
+}
+
+static void FreeProfile(Profile *profile) { free(profile); }
+
+// ================= Reports ==================
+
+struct ProfileEntry {
+  int key;  // label index or line number
+  u64 cycles;
+  u64 executions;
+};
+
+static void SortByCycles(ProfileEntry *entries, int count) {
+  // Insertion sort, there are only as many as there are labels or lines
+  for (int i = 1; i < count; i++) {
+    ProfileEntry entry = entries[i];
+    int j = i;
+    while (j > 0 && entries[j - 1].cycles < entry.cycles) {
+      entries[j] = entries[j - 1];
+      j--;
+    }
+    entries[j] = entry;
+  }
+}
+
+static char const *LabelName(SourceMap *map, int label, char *buffer,
+                             int size, u32 address) {
+  if (label < 0) {
+    snprintf(buffer, size, "$%04X", address);
+  } else if (map->labels[label].address == address) {
+    snprintf(buffer, size, "%s", map->labels[label].name);
+  } else {
+    snprintf(buffer, size, "%s+%d", map->labels[label].name,
+             address - map->labels[label].address);
+  }
+  return buffer;
+}
+
+// Points at the start of each line of the source, lines[0] is line 1.
+// Returns the number of lines
+static int SplitLines(char *source, char **lines, int max_lines) {
+  int count = 0;
+  char *at = source;
+  while (*at && count < max_lines) {
+    lines[count++] = at;
+    while (*at && *at != '\n') at++;
+    if (*at == '\n') *at++ = '\0';
+  }
+  return count;
+}
+
+// Prints where the cycles went, per label and per source line. Code before
+// the first label is under its address
+static void PrintProfile(Profile *profile, SourceMap *map, int max_lines) {
+  u64 total = 0;
+  for (int i = 0; i < kMachineMemorySize; i++) {
+    total += profile->cycles[i];
+  }
+  if (total == 0) {
+    print("Profile: nothing was executed\n");
+    return;
+  }
+
+  // Per label, plus one for code before the first one
+  int num_label_entries = map->num_labels + 1;
+  ProfileEntry *by_label =
+      (ProfileEntry *)calloc(num_label_entries, sizeof(ProfileEntry));
+  for (int i = 0; i < num_label_entries; i++) {
+    by_label[i].key = i - 1;
+  }
+  for (int address = 0; address < kMachineMemorySize; address++) {
+    if (profile->executions[address] == 0) continue;
+    ProfileEntry *entry = by_label + map->FindLabel(address) + 1;
+    entry->cycles += profile->cycles[address];
+    entry->executions += profile->executions[address];
+  }
+  SortByCycles(by_label, num_label_entries);
+
+  print("Profile of %s: %llu cycles\n", map->filename,
+        (unsigned long long)total);
+  print("%12s %6s %12s  %s\n", "cycles", "%", "instructions", "label");
+  for (int i = 0; i < num_label_entries && by_label[i].cycles > 0; i++) {
+    ProfileEntry *entry = by_label + i;
+    char name[64];
+    u32 address = entry->key >= 0 ? map->labels[entry->key].address : 0;
+    print("%12llu %6.2f %12llu  %s\n", (unsigned long long)entry->cycles,
+          100.0 * entry->cycles / total,
+          (unsigned long long)entry->executions,
+          entry->key >= 0 ? LabelName(map, entry->key, name, sizeof(name),
+                                      address)
+                          : "(no label)");
+  }
+  free(by_label);
+
+  // Per line. Code that isn't in the source (e.g. written by the program)
+  // has no line and isn't shown
+  int num_lines = 0;
+  for (int address = 0; address < kMachineMemorySize; address++) {
+    if (map->lines[address] > num_lines) num_lines = map->lines[address];
+  }
+  ProfileEntry *by_line =
+      (ProfileEntry *)calloc(num_lines + 1, sizeof(ProfileEntry));
+  for (int i = 0; i <= num_lines; i++) {
+    by_line[i].key = i;
+  }
+  for (int address = 0; address < kMachineMemorySize; address++) {
+    int line = map->lines[address];
+    if (line == 0 || profile->executions[address] == 0) continue;
+    by_line[line].cycles += profile->cycles[address];
+    by_line[line].executions += profile->executions[address];
+  }
+  SortByCycles(by_line, num_lines + 1);
+
+  // The text of the lines, if the file is still there
+  char *source = ReadFileIntoString(map->filename);
+  char **text = NULL;
+  int num_text_lines = 0;
+  if (source != NULL) {
+    text = (char **)calloc(num_lines + 1, sizeof(char *));
+    num_text_lines = SplitLines(source, text, num_lines + 1);
+  }
+
+  print("\n%12s %6s %12s  %s\n", "cycles", "%", "executions", "line");
+  for (int i = 0; i < max_lines && i <= num_lines && by_line[i].cycles > 0;
+       i++) {
+    ProfileEntry *entry = by_line + i;
+    char const *line = entry->key <= num_text_lines ? text[entry->key - 1] : "";
+    while (*line == ' ' || *line == '\t') line++;
+    print("%12llu %6.2f %12llu  %5d: %s\n", (unsigned long long)entry->cycles,
+          100.0 * entry->cycles / total,
+          (unsigned long long)entry->executions, entry->key, line);
+  }
+  if (profile->calls_lost > 0) {
+    print("Call tree is full, %llu calls were charged to their callers\n",
+          (unsigned long long)profile->calls_lost);
+  }
+  free(text);
+  free(source);
+  free(by_line);
+}
+
+// One line per call stack, e.g. "start;mainloop;update_ball 1234", the way
+// flamegraph.pl and friends read it. Returns false if the file can't be
+// written
+static bool WriteFoldedStacks(Profile *profile, SourceMap *map,
+                              char *filename) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) return false;
+
+  int *path = (int *)malloc(kMaxCallNodes * sizeof(int));
+  for (int i = 0; i < profile->num_nodes; i++) {
+    CallNode *node = profile->nodes + i;
+    if (node->cycles == 0) continue;
+    int depth = 0;
+    for (int n = i; depth < kMaxCallNodes; n = profile->nodes[n].parent) {
+      path[depth++] = n;
+      if (n == 0) break;
+    }
+    for (int d = depth - 1; d >= 0; d--) {
+      u16 function = profile->nodes[path[d]].function;
+      char name[64];
+      LabelName(map, map->FindLabel(function), name, sizeof(name), function);
+      fprintf(file, d > 0 ? "%s;" : "%s", name);
+    }
+    fprintf(file, " %llu\n", (unsigned long long)node->cycles);
+  }
+  free(path);
+
+  return fclose(file) == 0;
+}
+
+#endif  // PROFILER_CPP
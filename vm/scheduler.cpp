@@ -0,0 +1,129 @@
+// ================= Cycle-timed events ==================
+#ifndef SCHEDULER_CPP
+#define SCHEDULER_CPP
+
+// Devices ask to be called back at an absolute CPU cycle (vblank, timers,
+// etc.). Events are kept in a binary min-heap ordered by time, and by the
+// order they were scheduled in when times are equal, so runs are repeatable.
+//
+// The CPU never looks at the scheduler. Machine::Run runs it straight up to
+// the next deadline and fires whatever is due in between, so the number of
+// devices makes no difference to the instruction loop. Deadlines can be
+// overshot by a block when the block cache is on (see CPU::Run).
+
+global int const kMaxEvents = 64;
+
+// time is when the event was due, which may be a little earlier than now
+typedef void (*EventCallback)(void *context, u64 time);
+
+struct Event {
+  u64 time;
+  u64 sequence;  // breaks ties between events due at the same time
+  EventCallback callback;
+  void *context;
+};
+
+struct Scheduler {
+  Event heap[kMaxEvents];
+  int num_events;
+  u64 next_sequence;
+
+  u64 events_fired;
+
+  bool Schedule(u64 time, EventCallback callback, void *context);
+  void Cancel(EventCallback callback, void *context);
+  inline u64 NextDeadline();
+  void FireDue(u64 now);
+
+  bool Before(int a, int b);
+  void Swap(int a, int b);
+  void SiftUp(int index);
+  void SiftDown(int index);
+  void Remove(int index);
+};
+
+// Returns false if there are too many events already
+bool Scheduler::Schedule(u64 time, EventCallback callback, void *context) {
+  if (this->num_events >= kMaxEvents) return false;
+  int index = this->num_events++;
+  Event *event = this->heap + index;
+  event->time = time;
+  event->sequence = this->next_sequence++;
+  event->callback = callback;
+  event->context = context;
+  this->SiftUp(index);
+  return true;
+}
+
+// Removes every pending event with this callback and context
+void Scheduler::Cancel(EventCallback callback, void *context) {
+  for (int i = this->num_events - 1; i >= 0; i--) {
+    if (this->heap[i].callback == callback &&
+        this->heap[i].context == context) {
+      this->Remove(i);
+    }
+  }
+}
+
+// UINT64_MAX when nothing is scheduled
+inline u64 Scheduler::NextDeadline() {
+  return this->num_events > 0 ? this->heap[0].time : UINT64_MAX;
+}
+
+// Callbacks may schedule more events, including ones that are already due
+void Scheduler::FireDue(u64 now) {
+  while (this->num_events > 0 && this->heap[0].time <= now) {
+    Event event = this->heap[0];
+    this->Remove(0);
+    event.callback(event.context, event.time);
+    this->events_fired++;
+  }
+}
+
+bool Scheduler::Before(int a, int b) {
+  Event *x = this->heap + a;
+  Event *y = this->heap + b;
+  return x->time < y->time || (x->time == y->time && x->sequence < y->sequence);
+}
+
+void Scheduler::Swap(int a, int b) {
+  Event temp = this->heap[a];
+  this->heap[a] = this->heap[b];
+  this->heap[b] = temp;
+}
+
+void Scheduler::SiftUp(int index) {
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!this->Before(index, parent)) break;
+    this->Swap(index, parent);
+    index = parent;
+  }
+}
+
+void Scheduler::SiftDown(int index) {
+  for (;;) {
+    int smallest = index;
+    int left = 2 * index + 1;
+    int right = left + 1;
+    if (left < this->num_events && this->Before(left, smallest)) {
+      smallest = left;
+    }
+    if (right < this->num_events && this->Before(right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == index) break;
+    this->Swap(index, smallest);
+    index = smallest;
+  }
+}
+
+void Scheduler::Remove(int index) {
+  this->num_events--;
+  if (index == this->num_events) return;
+  this->heap[index] = this->heap[this->num_events];
+  this->SiftDown(index);
+  this->SiftUp(index);
+}
+
+#endif  // SCHEDULER_CPP
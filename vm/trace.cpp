@@ -0,0 +1,98 @@
+// ================= Execution trace ==================
+#ifndef TRACE_CPP
+#define TRACE_CPP
+
+// With Instrument_Trace the CPU prints every instruction it executes into
+// cpu->trace, one line each, with the registers as they were before it and
+// the address it used. That's a formatted write per instruction, many times
+// slower than the run itself, so it's for short stretches such as the one
+// digest_diff replays, not for whole runs.
+
+#include <stdio.h>
+
+struct TraceLine {
+  u64 cycle;
+  u16 pc;
+  u16 operand;  // as it follows the opcode
+  u16 address;  // effective address, 0 if the instruction has none
+  u8 opcode;
+  u8 A;
+  u8 X;
+  u8 Y;
+  u8 SP;
+  u8 status;
+};
+
+static void FormatOperand(char *buffer, int size, AddressingMode mode,
+                          int operand) {
+  switch (mode) {
+    case AM_Immediate:
+      snprintf(buffer, size, "#$%02X", operand);
+      break;
+    case AM_Zeropage:
+      snprintf(buffer, size, "$%02X", operand);
+      break;
+    case AM_Zeropage_X:
+      snprintf(buffer, size, "$%02X,X", operand);
+      break;
+    case AM_Zeropage_Y:
+      snprintf(buffer, size, "$%02X,Y", operand);
+      break;
+    case AM_Absolute:
+    case AM_Relative:
+      snprintf(buffer, size, "$%04X", operand);
+      break;
+    case AM_Absolute_X:
+      snprintf(buffer, size, "$%04X,X", operand);
+      break;
+    case AM_Absolute_Y:
+      snprintf(buffer, size, "$%04X,Y", operand);
+      break;
+    case AM_Indirect:
+      snprintf(buffer, size, "($%04X)", operand);
+      break;
+    case AM_Indirect_X:
+      snprintf(buffer, size, "($%02X,X)", operand);
+      break;
+    case AM_Indirect_Y:
+      snprintf(buffer, size, "($%02X),Y", operand);
+      break;
+    case AM_Accumulator:
+      snprintf(buffer, size, "A");
+      break;
+    default:
+      buffer[0] = '\0';
+  }
+}
+
+// Only modes that go to memory have an address worth showing
+static bool HasAddress(AddressingMode mode) {
+  return mode != AM_Unknown && mode != AM_Immediate && mode != AM_Implied &&
+         mode != AM_Accumulator && mode != AM_Relative;
+}
+
+static void PrintTraceLine(FILE *file, TraceLine *line) {
+  InstructionTypeAndMode instruction = gOpcodeToInstruction[line->opcode];
+  char operand[16];
+  FormatOperand(operand, sizeof(operand), instruction.mode, line->operand);
+
+  // Set flags in capitals, clear ones as dots
+  char flags[9];
+  char const *names = "NV-BDIZC";
+  for (int i = 0; i < 8; i++) {
+    flags[i] = (line->status & (0x80 >> i)) ? names[i] : '.';
+  }
+  flags[8] = '\0';
+
+  fprintf(file,
+          "%12llu  %04X  %02X  %s %-9s  A:%02X X:%02X Y:%02X SP:%02X P:%s",
+          (unsigned long long)line->cycle, line->pc, line->opcode,
+          gInstructionNames[instruction.type], operand, line->A, line->X,
+          line->Y, line->SP, flags);
+  if (HasAddress(instruction.mode)) {
+    fprintf(file, "  [$%04X]", line->address);
+  }
+  fprintf(file, "\n");
+}
+
+#endif  // TRACE_CPP
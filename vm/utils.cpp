@@ -35,4 +35,47 @@ int strtoi(char *string, int length, int base) {
   return value;
 }
 
+// For data shared between threads without a lock. A value stored with
+// AtomicStore is seen by another thread's AtomicLoad together with everything
+// written before it
+#ifdef BUILD_WIN32
+#include <intrin.h>
+inline u64 AtomicLoad(volatile u64 *value) {
+  u64 result = *value;
+  _ReadWriteBarrier();
+  return result;
+}
+inline void AtomicStore(volatile u64 *value, u64 new_value) {
+  _ReadWriteBarrier();
+  *value = new_value;
+}
+// Stores desired if value is still expected. Returns whether it did
+inline bool AtomicCompareExchange(volatile u64 *value, u64 expected,
+                                  u64 desired) {
+  return (u64)_InterlockedCompareExchange64((volatile __int64 *)value,
+                                            (__int64)desired,
+                                            (__int64)expected) == expected;
+}
+// x86 keeps loads in order with loads and stores with stores
+inline void AcquireFence() { _ReadWriteBarrier(); }
+inline void ReleaseFence() { _ReadWriteBarrier(); }
+#else
+inline u64 AtomicLoad(volatile u64 *value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+inline void AtomicStore(volatile u64 *value, u64 new_value) {
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+// Stores desired if value is still expected. Returns whether it did
+inline bool AtomicCompareExchange(volatile u64 *value, u64 expected,
+                                  u64 desired) {
+  return __atomic_compare_exchange_n(value, &expected, desired, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+// Loads before it stay before later loads and stores
+inline void AcquireFence() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+// Loads and stores before it stay before later stores
+inline void ReleaseFence() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+#endif
+
 #endif  // UTILS_CPP
\ No newline at end of file
@@ -8,11 +8,24 @@ global int const kWindowHeight = 192;
 global u16 const kPC_start = 0xD400;
 global int const kSP_start = 0x100;
 
-global void *gMachineMemory;
-global u8 *gVideoMemory;
+global u64 const kCPUFrequency = 1000000;  // 1 MHz
+
+global u16 const kVideoMemoryStart = 0x0200;
+
+global u16 const kNMIVector = 0xFFFA;
+global u16 const kIRQVector = 0xFFFE;  // also BRK
+global int const kInterruptCycles = 7;
 
 #include "utils.cpp"
 #include "asm.cpp"
+#include "memory_bus.cpp"
+#include "watchpoints.cpp"
+#include "alu.cpp"
+#include "scheduler.cpp"
+#include "trace.cpp"
+#include "profiler.cpp"
+#include "heatmap.cpp"
+#include "digest.cpp"
 
 #define SCREEN_ZOOM 4
 
@@ -49,19 +62,93 @@ inline u32 GetColor(u8 code) {
 #define FLAG_V 0x40
 #define FLAG_S 0x80
 
+struct BlockCache;
+struct Block;
+struct Jit;
+struct NoInstrumentation;  // see instrumentation.cpp
+
+enum StopReason {
+  Stop_BudgetExhausted = 0,
+  Stop_Halted,  // END executed
+  Stop_Error,   // see CPU::error
+  Stop_Requested,  // MemoryBus::RequestStop, e.g. by a watchpoint
+};
+
+enum CPUError {
+  CPUError_None = 0,
+  CPUError_StackOverflow,
+  CPUError_StackUnderflow,
+  CPUError_NotImplemented,
+  CPUError_BadInstruction,
+};
+
+static char const *CPUErrorString(CPUError error) {
+  switch (error) {
+    case CPUError_None:
+      return "no error";
+    case CPUError_StackOverflow:
+      return "stack overflow";
+    case CPUError_StackUnderflow:
+      return "stack underflow";
+    case CPUError_NotImplemented:
+      return "instruction not implemented";
+    case CPUError_BadInstruction:
+      return "bad instruction";
+  }
+  return "unknown error";
+}
+
 struct CPU {
   u8 A;
   u8 X;
   u8 Y;
   u8 SP;
-  u8 status;
+  u8 status;  // only I and D, the rest is below. Use GetStatus()
   u16 PC;
 
-  u8 *memory;
+  // Lazy flags: N is bit 7 of flag_n, Z is set when flag_z is 0,
+  // C is flag_c (always 0 or 1), V is bit 7 of flag_v
+  u8 flag_n;
+  u8 flag_z;
+  u8 flag_c;
+  u8 flag_v;
+
+  u8 *memory;      // for instruction fetches and zero page pointers
+  MemoryBus *bus;  // for everything else
   bool is_running;
 
-  CPU();
+  BlockCache *block_cache;  // NULL when disabled
+  Jit *jit;                 // NULL when disabled, needs the block cache
+
+  u64 cycles;  // monotonic, never reset
+  u64 instructions;
+  u64 cycle_limit;  // where the current Run stops, checked by translated code
+
+  CPUError error;  // why the CPU stopped if it wasn't END
+  u8 error_opcode;
+
+  // Instrument flags, see instrumentation.cpp. The tools they stand for
+  // have to be attached before running
+  u32 instruments;
+  FILE *trace;
+  Profile *profile;
+  Heatmap *heatmap;
+  StateDigest *digest;
+
+  CPU(MemoryBus *bus);
   void Tick();
+  template <class Policy = NoInstrumentation>
+  inline void Step();
+  template <class Policy = NoInstrumentation>
+  inline void RunBlock(Block *);
+  void RunIdleLoop(Block *, u64 instruction_limit);
+  StopReason Run(u64 cycle_budget, u64 instruction_budget = UINT64_MAX);
+  template <class Policy>
+  StopReason RunWith(u64 cycle_budget, u64 instruction_budget);
+  template <class Policy = NoInstrumentation>
+  inline void Execute(u8, InstructionType, AddressingMode);
+  template <class Policy = NoInstrumentation>
+  inline void ExecuteDecoded(u8, InstructionType, AddressingMode, int);
 
   inline bool GetC();
   inline bool GetZ();
@@ -80,25 +167,65 @@ struct CPU {
   inline void SetN(int);
 
   inline void SetNZFor(u8);
+  inline u8 ApplyAluEntry(u32);
+  inline void Compare(u8, u8);
+  inline u8 GetStatus();
+  inline void SetStatus(u8);
+  template <class Policy>
+  inline int Branch(bool, u16);
 
+  template <class Policy = NoInstrumentation>
+  inline u8 Read(u32);
+  template <class Policy = NoInstrumentation>
+  inline void Store(u32, u8);
+  template <class Policy>
+  inline u8 ReadRAM(u32);
+  template <class Policy>
+  inline void StoreRAM(u32, u8);
+  template <class Policy>
+  inline u8 ReadOperand(AddressingMode, u32);
+  template <class Policy>
+  inline void StoreResult(AddressingMode, u32, u8);
+  template <class Policy>
   void Push(u8);
+  template <class Policy>
   u8 Pull();
+  template <class Policy>
+  void Interrupt(u16 vector, u8 pushed_flags);
+  template <class Policy>
+  void TakeInterrupt();
+  void Fail(CPUError, u8 opcode = 0);
 };
 
-CPU::CPU() {
+CPU::CPU(MemoryBus *bus) {
   this->A = 0;
   this->X = 0;
   this->Y = 0;
   this->SP = 0;
-  this->status = 0;
+  this->SetStatus(0);
   this->PC = kPC_start;
-  this->memory = (u8 *)gMachineMemory;
+  this->memory = bus->memory;
+  this->bus = bus;
   this->is_running = true;
+  this->block_cache = NULL;
+  this->jit = NULL;
+  this->cycles = 0;
+  this->instructions = 0;
+  this->cycle_limit = 0;
+  this->error = CPUError_None;
+  this->error_opcode = 0;
+  this->instruments = 0;
+  this->trace = NULL;
+  this->profile = NULL;
+  this->heatmap = NULL;
+  this->digest = NULL;
 }
 
-inline bool CPU::GetC() { return (this->status & FLAG_C) > 0; }
+// N, Z, C and V are evaluated lazily. Instructions just store the values the
+// flags come from and the flags are only worked out when something reads them
+inline bool CPU::GetC() { return this->flag_c != 0; }
 
-inline bool CPU::GetZ() { return (this->status & FLAG_Z) > 0; }
+inline bool CPU::GetZ() { return this->flag_z == 0; }
 
 inline bool CPU::GetI() { return (this->status & FLAG_I) > 0; }
 
@@ -106,25 +233,13 @@ inline bool CPU::GetD() { return (this->status & FLAG_D) > 0; }
 
 inline bool CPU::GetB() { return (this->status & FLAG_B) > 0; }
 
-inline bool CPU::GetV() { return (this->status & FLAG_V) > 0; }
+inline bool CPU::GetV() { return (this->flag_v & 0x80) != 0; }
 
-inline bool CPU::GetN() { return (this->status & FLAG_S) > 0; }
+inline bool CPU::GetN() { return (this->flag_n & 0x80) != 0; }
 
-inline void CPU::SetC(int value) {
-  if (value) {
-    this->status |= FLAG_C;
-  } else {
-    this->status &= ~FLAG_C;
-  }
-}
+inline void CPU::SetC(int value) { this->flag_c = value ? 1 : 0; }
 
-inline void CPU::SetZ(int value) {
-  if (value) {
-    this->status |= FLAG_Z;
-  } else {
-    this->status &= ~FLAG_Z;
-  }
-}
+inline void CPU::SetZ(int value) { this->flag_z = value ? 0 : 1; }
 
 inline void CPU::SetI(int value) {
   if (value) {
@@ -150,63 +265,150 @@ inline void CPU::SetB(int value) {
   }
 }
 
-inline void CPU::SetV(int value) {
-  if (value) {
-    this->status |= FLAG_V;
-  } else {
-    this->status &= ~FLAG_V;
-  }
+inline void CPU::SetV(int value) { this->flag_v = value ? 0x80 : 0; }
+
+inline void CPU::SetN(int value) { this->flag_n = value ? 0x80 : 0; }
+
+inline void CPU::SetNZFor(u8 value) {
+  this->flag_n = value;
+  this->flag_z = value;
 }
 
-inline void CPU::SetN(int value) {
-  if (value) {
-    this->status |= FLAG_S;
-  } else {
-    this->status &= ~FLAG_S;
-  }
+// The processor status byte with all the lazy flags worked out
+inline u8 CPU::GetStatus() {
+  u8 result = this->status & ~(FLAG_S | FLAG_V | FLAG_Z | FLAG_C);
+  result |= this->flag_n & FLAG_S;
+  result |= (this->flag_v & 0x80) ? FLAG_V : 0;
+  result |= this->flag_z == 0 ? FLAG_Z : 0;
+  result |= this->flag_c ? FLAG_C : 0;
+  return result;
 }
 
-inline void CPU::SetNZFor(u8 value) {
-  this->SetN(value >> 7 ? 1 : 0);
-  this->SetZ(value == 0 ? 1 : 0);
+// B and bit 5 only exist on the stack, PHP and Interrupt add them on push
+inline void CPU::SetStatus(u8 value) {
+  this->status = value & (FLAG_I | FLAG_D);
+  this->SetN(value & FLAG_S);
+  this->SetV(value & FLAG_V);
+  this->SetZ(value & FLAG_Z);
+  this->SetC(value & FLAG_C);
+}
+
+inline u8 CPU::ApplyAluEntry(u32 entry) {
+  this->flag_n = (u8)(entry >> 8);
+  this->flag_z = (u8)(entry >> 16);
+  this->flag_c = (u8)(entry >> 24) & 1;
+  this->flag_v = (u8)(entry >> 24);
+  return (u8)entry;
+}
+
+// CMP/CPX/CPY: a binary subtraction without borrow that only keeps N, Z, C
+inline void CPU::Compare(u8 reg, u8 value) {
+  u32 entry = gAluSubtract[AluIndex(reg, value, 1, 0)];
+  this->flag_n = (u8)(entry >> 8);
+  this->flag_z = (u8)(entry >> 16);
+  this->flag_c = (u8)(entry >> 24) & 1;
 }
 
+template <class Policy>
 void CPU::Push(u8 value) {
   // Push a value onto the top of the stack
   if (this->SP >= 0xFF) {
-    print("Stack overflow\n");
-    exit(1);
+    this->Fail(CPUError_StackOverflow);
+    return;
   }
-  this->memory[kSP_start + this->SP] = value;
+  this->StoreRAM<Policy>(kSP_start + this->SP, value);
   this->SP++;
 }
 
+template <class Policy>
 u8 CPU::Pull() {
   if (this->SP == 0) {
-    print("Stack underflow\n");
-    exit(1);
+    this->Fail(CPUError_StackUnderflow);
+    return 0;
   }
   this->SP--;
-  return this->memory[kSP_start + this->SP];
+  return this->ReadRAM<Policy>(kSP_start + this->SP);
 }
 
-void CPU::Tick() {
-  u8 opcode = this->memory[this->PC];
+#include "instrumentation.cpp"
 
-  InstructionTypeAndMode instruction = gOpcodeToInstruction[opcode];
+// Pushes the return address and status, then goes to the handler.
+// For BRK, PC is already past the instruction
+template <class Policy>
+void CPU::Interrupt(u16 vector, u8 pushed_flags) {
+  this->Push<Policy>((u8)(this->PC >> 8));
+  this->Push<Policy>((u8)(this->PC & 0x00FF));
+  this->Push<Policy>(this->GetStatus() | pushed_flags | 0x20);
+  this->SetI(1);
+  this->PC = (u16)(this->Read<Policy>(vector + 1) << 8 |
+                   this->Read<Policy>(vector));
+  Policy::OnInterrupt(this, vector);
+}
 
-  // Default
-  if (instruction.mode == AM_Unknown) {
-    instruction.type = I_NOP;
-    instruction.mode = AM_Implied;
-    print("WARNING: Unknown instruction treated as NOP, opcode %#02x\n",
-          opcode);
+// Called between instructions when either line is up. NMI goes first and
+// can't be masked, IRQ waits while the I flag is set
+template <class Policy>
+no_inline void CPU::TakeInterrupt() {
+  if (this->bus->nmi) {
+    this->bus->nmi = false;
+    this->Interrupt<Policy>(kNMIVector, 0);
+    this->cycles += kInterruptCycles;
+  } else if (this->bus->irq && !this->GetI()) {
+    this->Interrupt<Policy>(kIRQVector, 0);
+    this->cycles += kInterruptCycles;
   }
+}
 
-  int bytes = gBytesForAddressingMode[instruction.mode];
+// Only reads pay for crossing a page, stores and read-modify-write
+// instructions always take the long path (it's in their base cycles)
+force_inline bool PaysPageCrossPenalty(InstructionType type) {
+  switch (type) {
+    case I_ADC:
+    case I_AND:
+    case I_CMP:
+    case I_EOR:
+    case I_LDA:
+    case I_LDX:
+    case I_LDY:
+    case I_ORA:
+    case I_SBC:
+      return true;
+    default:
+      return false;
+  }
+}
+
+constexpr bool IsZeropageMode(AddressingMode mode) {
+  return mode == AM_Zeropage || mode == AM_Zeropage_X ||
+         mode == AM_Zeropage_Y;
+}
+
+constexpr bool ReadsFromAddress(AddressingMode mode, InstructionType type) {
+  return mode != AM_Immediate && mode != AM_Implied &&
+         mode != AM_Accumulator && mode != AM_Relative && type != I_STA &&
+         type != I_STX && type != I_STY && type != I_JMP && type != I_JSR;
+}
+
+// Returns the extra cycles a branch costs: one if taken, two if it also
+// lands on a different page
+template <class Policy>
+force_inline int CPU::Branch(bool condition, u16 target) {
+  Policy::OnBranch(this, target, condition);
+  if (!condition) return 0;
+  int extra_cycles = ((this->PC ^ target) > 0xFF) ? 2 : 1;
+  this->PC = target;
+  return extra_cycles;
+}
+
+// The body of every instruction. It's always inlined so that when it's called
+// with a constant type and mode (see ExecuteOpcode) both switches fold away
+template <class Policy>
+force_inline void CPU::Execute(u8 opcode, InstructionType type,
+                               AddressingMode mode) {
+  int bytes = gBytesForAddressingMode[mode];
   if (!bytes) {
-    print("Panic (incorrect instruction length)!\n");
-    exit(1);
+    this->Fail(CPUError_BadInstruction, opcode);
+    return;
   }
 
   // Fetch operand
@@ -221,39 +423,63 @@ void CPU::Tick() {
   // Moving the PC now, as it may change later
   this->PC += (u16)bytes;
 
+  this->ExecuteDecoded<Policy>(opcode, type, mode, operand);
+}
+
+// Same as Execute but with the operand already fetched and PC already
+// pointing at the next instruction
+template <class Policy>
+force_inline void CPU::ExecuteDecoded(u8 opcode, InstructionType type,
+                                      AddressingMode mode, int operand) {
   // Get the data according to the addressing mode
+  // Memory is mirrored (see MemoryBus) so addresses past $FFFF are fine.
+  // Zero page addresses wrap around within the zero page
   u8 data = 0;
-  u8 *data_pointer = NULL;
-  u16 address = 0;
-  switch (instruction.mode) {
+  u32 address = 0;
+  bool page_crossed = false;
+  switch (mode) {
     case AM_Immediate: {
       data = (u8)operand;
     } break;
     case AM_Relative:
     case AM_Absolute:
     case AM_Zeropage: {
-      data_pointer = this->memory + operand;
+      address = operand;
+    } break;
+    case AM_Absolute_X: {
+      address = operand + this->X;
+      page_crossed = (address ^ operand) > 0xFF;
+    } break;
+    case AM_Absolute_Y: {
+      address = operand + this->Y;
+      page_crossed = (address ^ operand) > 0xFF;
     } break;
-    case AM_Absolute_X:
     case AM_Zeropage_X: {
-      data_pointer = this->memory + operand + this->X;
+      address = (u8)(operand + this->X);
     } break;
-    case AM_Absolute_Y:
     case AM_Zeropage_Y: {
-      data_pointer = this->memory + operand + this->Y;
+      address = (u8)(operand + this->Y);
     } break;
     case AM_Indirect: {
-      address = (u16)(this->memory[operand + 1] << 8 | this->memory[operand]);
-      data_pointer = this->memory + address;
+      address = (u32)(this->Read<Policy>(operand + 1) << 8 |
+                      this->Read<Policy>(operand));
     } break;
     case AM_Indirect_X: {
-      address = (u16)(this->memory[operand + this->X + 1] << 8 |
-                      this->memory[operand + this->X]);
-      data_pointer = this->memory + address;
+      u8 pointer = (u8)(operand + this->X);
+      u8 low = this->memory[pointer];
+      u8 high = this->memory[(u8)(pointer + 1)];
+      Policy::OnRead(this, pointer, low);
+      Policy::OnRead(this, (u8)(pointer + 1), high);
+      address = (u32)(high << 8 | low);
     } break;
     case AM_Indirect_Y: {
-      address = (u16)(this->memory[operand + 1] << 8 | this->memory[operand]);
-      data_pointer = this->memory + address + this->Y;
+      u8 low = this->memory[operand];
+      u8 high = this->memory[(u8)(operand + 1)];
+      Policy::OnRead(this, operand, low);
+      Policy::OnRead(this, (u8)(operand + 1), high);
+      u32 base = (u32)(high << 8 | low);
+      address = base + this->Y;
+      page_crossed = (address ^ base) > 0xFF;
     } break;
     case AM_Implied: {
     } break;
@@ -261,67 +487,75 @@ void CPU::Tick() {
       data = this->A;
     } break;
     default: {
-      print("Panic (incorrect mode)!\n");
-      exit(1);
+      this->Fail(CPUError_BadInstruction, opcode);
+      return;
     }
   }
 
-  if (data_pointer != NULL) {
-    data = *data_pointer;
+  Policy::OnFetch(this, opcode, mode, operand, address);
+
+  // Stores and jumps don't look at what's at the address (it matters for
+  // devices, reading a register may change it)
+  if (ReadsFromAddress(mode, type)) {
+    data = this->ReadOperand<Policy>(mode, address);
+  }
+
+  int cycles = gCyclesForOpcode[opcode];
+  if (page_crossed && PaysPageCrossPenalty(type)) {
+    cycles++;
   }
 
   // Execute instruction
-  switch (instruction.type) {
+  switch (type) {
     case I_ADC: {
-      u16 tmp = this->A + data + (u8) this->GetC();
-      this->A = (u8)tmp;
-      this->SetC(tmp > this->A ? 1 : 0);
+      int index = AluIndex(this->A, data, this->flag_c,
+                           (this->status & FLAG_D) >> 3);
+      this->A = this->ApplyAluEntry(gAluAdd[index]);
     } break;
     case I_AND: {
-      this->A &= operand;
+      this->A &= data;
       this->SetNZFor(this->A);
     } break;
     case I_ASL: {
-      print("ERROR: instruction ASL not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->flag_c = data >> 7;
+      data <<= 1;
+      this->SetNZFor(data);
+      this->StoreResult<Policy>(mode, address, data);
     } break;
     case I_BIT: {
-      print("ERROR: instruction BIT not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->flag_z = this->A & data;
+      this->flag_n = data;
+      this->flag_v = (u8)(data << 1);
     } break;
     case I_CMP: {
-      u8 tmp = this->A - data;
-      this->SetNZFor(tmp);
-      this->SetC(this->A >= data ? 1 : 0);
+      this->Compare(this->A, data);
     } break;
     case I_CPX: {
-      u8 tmp = this->X - data;
-      this->SetNZFor(tmp);
-      this->SetC(this->X >= data ? 1 : 0);
+      this->Compare(this->X, data);
     } break;
     case I_CPY: {
-      u8 tmp = this->Y - data;
-      this->SetNZFor(tmp);
-      this->SetC(this->Y >= data ? 1 : 0);
+      this->Compare(this->Y, data);
     } break;
     case I_DEC: {
-      *data_pointer = *data_pointer - 1;
-      this->SetNZFor(*data_pointer);
+      data--;
+      this->StoreResult<Policy>(mode, address, data);
+      this->SetNZFor(data);
     } break;
     case I_EOR: {
-      this->A ^= operand;
+      this->A ^= data;
       this->SetNZFor(this->A);
     } break;
     case I_INC: {
-      *data_pointer = *data_pointer + 1;
-      this->SetNZFor(*data_pointer);
+      data++;
+      this->StoreResult<Policy>(mode, address, data);
+      this->SetNZFor(data);
     } break;
     case I_JMP: {
-      this->PC = (u16)operand;
+      this->PC = (u16)address;
     } break;
     case I_JSR: {
-      this->Push((u8)(this->PC >> 8));
-      this->Push((u8)(this->PC & 0x00FF));
+      this->Push<Policy>((u8)(this->PC >> 8));
+      this->Push<Policy>((u8)(this->PC & 0x00FF));
       this->PC = (u16)operand;
     } break;
     case I_LDA: {
@@ -337,54 +571,59 @@ void CPU::Tick() {
       this->SetNZFor(data);
     } break;
     case I_LSR: {
-      print("ERROR: instruction LSR not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->flag_c = data & 1;
+      data >>= 1;
+      this->SetNZFor(data);
+      this->StoreResult<Policy>(mode, address, data);
     } break;
     case I_ORA: {
-      this->A |= operand;
+      this->A |= data;
       this->SetNZFor(this->A);
     } break;
     case I_ROL: {
-      print("ERROR: instruction ROL not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      u8 carry = this->flag_c;
+      this->flag_c = data >> 7;
+      data = (u8)(data << 1 | carry);
+      this->SetNZFor(data);
+      this->StoreResult<Policy>(mode, address, data);
     } break;
     case I_ROR: {
-      print("ERROR: instruction ROR not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      u8 carry = this->flag_c;
+      this->flag_c = data & 1;
+      data = (u8)(data >> 1 | carry << 7);
+      this->SetNZFor(data);
+      this->StoreResult<Policy>(mode, address, data);
     } break;
     case I_SBC: {
-      print("ERROR: instruction SBC not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      int index = AluIndex(this->A, data, this->flag_c,
+                           (this->status & FLAG_D) >> 3);
+      this->A = this->ApplyAluEntry(gAluSubtract[index]);
     } break;
     case I_STA: {
-      *data_pointer = this->A;
+      this->StoreResult<Policy>(mode, address, this->A);
     } break;
     case I_STX: {
-      print("ERROR: instruction STX not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->StoreResult<Policy>(mode, address, this->X);
     } break;
     case I_STY: {
-      print("ERROR: instruction STY not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->StoreResult<Policy>(mode, address, this->Y);
     } break;
     case I_BRK: {
-      // For debugging
-      int debug = 1;
+      // The byte after BRK is skipped, like on the real thing
+      this->PC++;
+      this->Interrupt<Policy>(kIRQVector, FLAG_B);
     } break;
     case I_CLC: {
       this->SetC(0);
     } break;
     case I_CLD: {
-      print("ERROR: instruction CLD not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SetD(0);
     } break;
     case I_CLI: {
-      print("ERROR: instruction CLI not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SetI(0);
     } break;
     case I_CLV: {
-      print("ERROR: instruction CLV not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->flag_v = 0;
     } break;
     case I_DEX: {
       this->X--;
@@ -406,107 +645,724 @@ void CPU::Tick() {
       // You lazy bastard!
     } break;
     case I_PHA: {
-      this->Push(this->A);
+      this->Push<Policy>(this->A);
     } break;
     case I_PHP: {
-      print("ERROR: instruction PHP not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->Push<Policy>(this->GetStatus() | FLAG_B | 0x20);
     } break;
     case I_PLA: {
-      this->A = this->Pull();
+      this->A = this->Pull<Policy>();
     } break;
     case I_PLP: {
-      print("ERROR: instruction PLP not implemented. Opcode %#02x\n", opcode);
-      exit(1);
-    } break;
-    case I_RTI: {
-      print("ERROR: instruction RTI not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SetStatus(this->Pull<Policy>());
     } break;
     case I_RTS: {
-      u8 PC_low = this->Pull();
-      u8 PC_high = this->Pull();
+      u8 PC_low = this->Pull<Policy>();
+      u8 PC_high = this->Pull<Policy>();
       this->PC = PC_high << 8 | PC_low;
     } break;
     case I_SEC: {
-      print("ERROR: instruction SEC not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->flag_c = 1;
     } break;
     case I_SED: {
-      print("ERROR: instruction SED not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SetD(1);
     } break;
     case I_SEI: {
-      print("ERROR: instruction SEI not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SetI(1);
     } break;
     case I_TAX: {
-      print("ERROR: instruction TAX not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->X = this->A;
+      this->SetNZFor(this->X);
     } break;
     case I_TAY: {
-      print("ERROR: instruction TAY not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->Y = this->A;
+      this->SetNZFor(this->Y);
     } break;
     case I_TSX: {
-      print("ERROR: instruction TSX not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->X = this->SP;
+      this->SetNZFor(this->X);
     } break;
     case I_TXA: {
-      print("ERROR: instruction TXA not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->A = this->X;
+      this->SetNZFor(this->A);
     } break;
     case I_TXS: {
-      print("ERROR: instruction TXS not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->SP = this->X;
     } break;
     case I_TYA: {
-      print("ERROR: instruction TYA not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      this->A = this->Y;
+      this->SetNZFor(this->A);
     } break;
     case I_BCC: {
-      if (!this->GetC()) {
-        this->PC = (u16)operand;
-      }
+      cycles += this->Branch<Policy>(!this->GetC(), (u16)operand);
     } break;
     case I_BCS: {
-      if (this->GetC()) {
-        this->PC = (u16)operand;
-      }
+      cycles += this->Branch<Policy>(this->GetC(), (u16)operand);
     } break;
     case I_BEQ: {
-      if (this->GetZ()) {
-        this->PC = (u16)operand;
-      }
+      cycles += this->Branch<Policy>(this->GetZ(), (u16)operand);
     } break;
     case I_BMI: {
-      print("ERROR: instruction BMI not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      cycles += this->Branch<Policy>(this->GetN(), (u16)operand);
     } break;
     case I_BNE: {
-      if (!this->GetZ()) {
-        this->PC = (u16)operand;
-      }
+      cycles += this->Branch<Policy>(!this->GetZ(), (u16)operand);
     } break;
     case I_BPL: {
-      print("ERROR: instruction BPL not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      cycles += this->Branch<Policy>(!this->GetN(), (u16)operand);
     } break;
     case I_BVC: {
-      print("ERROR: instruction BVC not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      cycles += this->Branch<Policy>(!this->GetV(), (u16)operand);
     } break;
     case I_BVS: {
-      print("ERROR: instruction BVS not implemented. Opcode %#02x\n", opcode);
-      exit(1);
+      cycles += this->Branch<Policy>(this->GetV(), (u16)operand);
     } break;
     case I_END: {
       this->is_running = false;
     } break;
+    case I_RTI: {
+      this->SetStatus(this->Pull<Policy>());
+      u8 PC_low = this->Pull<Policy>();
+      u8 PC_high = this->Pull<Policy>();
+      this->PC = PC_high << 8 | PC_low;
+    } break;
 
     default: {
-      print("Panic! Unknown instruction, opcode %#02x\n", opcode);
-      exit(1);
+      this->Fail(CPUError_BadInstruction, opcode);
+    }
+  }
+
+  this->cycles += cycles;
+}
+
+// Unknown opcodes are treated as NOPs
+constexpr InstructionType KnownType(u8 opcode) {
+  return gOpcodeToInstruction[opcode].mode == AM_Unknown
+             ? I_NOP
+             : gOpcodeToInstruction[opcode].type;
+}
+
+constexpr AddressingMode KnownMode(u8 opcode) {
+  return gOpcodeToInstruction[opcode].mode == AM_Unknown
+             ? AM_Implied
+             : gOpcodeToInstruction[opcode].mode;
+}
+
+static void WarnUnknownOpcode(u8 opcode) {
+  print("WARNING: Unknown instruction treated as NOP, opcode %#02x\n", opcode);
+}
+
+// A handler specialized for one opcode with its mode and operation fused
+template <u8 opcode>
+static void ExecuteOpcode(CPU *cpu) {
+  if (gOpcodeToInstruction[opcode].mode == AM_Unknown) {
+    WarnUnknownOpcode(opcode);
+  }
+  cpu->Execute(opcode, KnownType(opcode), KnownMode(opcode));
+}
+
+// Same for instructions that have been decoded in advance (see BlockCache)
+template <u8 opcode>
+static void ExecuteDecodedOpcode(CPU *cpu, int operand) {
+  if (gOpcodeToInstruction[opcode].mode == AM_Unknown) {
+    WarnUnknownOpcode(opcode);
+  }
+  cpu->ExecuteDecoded(opcode, KnownType(opcode), KnownMode(opcode), operand);
+}
+
+#define OPCODE_HANDLER_ROW(handler, hi)                                   \
+  &handler<hi##0>, &handler<hi##1>, &handler<hi##2>, &handler<hi##3>,     \
+      &handler<hi##4>, &handler<hi##5>, &handler<hi##6>, &handler<hi##7>, \
+      &handler<hi##8>, &handler<hi##9>, &handler<hi##A>, &handler<hi##B>, \
+      &handler<hi##C>, &handler<hi##D>, &handler<hi##E>, &handler<hi##F>
+
+#define OPCODE_HANDLER_TABLE(handler)                                       \
+  {                                                                         \
+    OPCODE_HANDLER_ROW(handler, 0x0), OPCODE_HANDLER_ROW(handler, 0x1),     \
+        OPCODE_HANDLER_ROW(handler, 0x2), OPCODE_HANDLER_ROW(handler, 0x3), \
+        OPCODE_HANDLER_ROW(handler, 0x4), OPCODE_HANDLER_ROW(handler, 0x5), \
+        OPCODE_HANDLER_ROW(handler, 0x6), OPCODE_HANDLER_ROW(handler, 0x7), \
+        OPCODE_HANDLER_ROW(handler, 0x8), OPCODE_HANDLER_ROW(handler, 0x9), \
+        OPCODE_HANDLER_ROW(handler, 0xA), OPCODE_HANDLER_ROW(handler, 0xB), \
+        OPCODE_HANDLER_ROW(handler, 0xC), OPCODE_HANDLER_ROW(handler, 0xD), \
+        OPCODE_HANDLER_ROW(handler, 0xE), OPCODE_HANDLER_ROW(handler, 0xF), \
+  }
+
+typedef void (*OpcodeHandler)(CPU *);
+typedef void (*DecodedOpcodeHandler)(CPU *, int);
+
+global OpcodeHandler const gOpcodeHandlers[256] =
+    OPCODE_HANDLER_TABLE(ExecuteOpcode);
+global DecodedOpcodeHandler const gDecodedOpcodeHandlers[256] =
+    OPCODE_HANDLER_TABLE(ExecuteDecodedOpcode);
+
+// The instrumented loops (see instrumentation.cpp) share one generic
+// handler instead of getting 256 specialized ones each, which would take
+// ages to compile. Their hooks cost more than the dispatch anyway
+template <class Policy>
+no_inline static void ExecuteAnyOpcode(CPU *cpu, u8 opcode) {
+  if (gOpcodeToInstruction[opcode].mode == AM_Unknown) {
+    WarnUnknownOpcode(opcode);
+  }
+  cpu->Execute<Policy>(opcode, KnownType(opcode), KnownMode(opcode));
+}
+
+template <class Policy>
+no_inline static void ExecuteAnyDecodedOpcode(CPU *cpu, u8 opcode,
+                                              int operand) {
+  if (gOpcodeToInstruction[opcode].mode == AM_Unknown) {
+    WarnUnknownOpcode(opcode);
+  }
+  cpu->ExecuteDecoded<Policy>(opcode, KnownType(opcode), KnownMode(opcode),
+                              operand);
+}
+
+#include "fusion.cpp"
+#include "block_cache.cpp"
+
+template <class Policy>
+force_inline u8 CPU::Read(u32 address) {
+  u8 value = this->bus->Read(address);
+  Policy::OnRead(this, address, value);
+  return value;
+}
+
+// Stores to pages with decoded blocks end up in BlockCache::InvalidatePage
+template <class Policy>
+force_inline void CPU::Store(u32 address, u8 value) {
+  this->bus->Write(address, value);
+  Policy::OnWrite(this, address, value);
+}
+
+// The zero page and the stack are always RAM (see MemoryBus::MapDevice),
+// so they skip the page table
+template <class Policy>
+force_inline u8 CPU::ReadRAM(u32 address) {
+  u8 value = this->memory[address];
+  Policy::OnRead(this, address, value);
+  return value;
+}
+
+template <class Policy>
+force_inline void CPU::StoreRAM(u32 address, u8 value) {
+  this->memory[address] = value;
+  Policy::OnWrite(this, address, value);
+}
+
+template <class Policy>
+force_inline u8 CPU::ReadOperand(AddressingMode mode, u32 address) {
+  if (IsZeropageMode(mode)) {
+    return this->ReadRAM<Policy>(address);
+  }
+  return this->Read<Policy>(address);
+}
+
+// For instructions that work either on A or on memory
+template <class Policy>
+force_inline void CPU::StoreResult(AddressingMode mode, u32 address, u8 value) {
+  if (mode == AM_Accumulator) {
+    this->A = value;
+  } else if (IsZeropageMode(mode)) {
+    this->StoreRAM<Policy>(address, value);
+  } else {
+    this->Store<Policy>(address, value);
+  }
+}
+
+// Stops the machine. Whatever block is running returns after this instruction
+void CPU::Fail(CPUError error, u8 opcode) {
+  this->error = error;
+  this->error_opcode = opcode;
+  this->is_running = false;
+  if (this->block_cache != NULL) {
+    this->block_cache->generation++;
+    this->block_cache->jit_flush_pending = true;
+  }
+}
+
+// Executes a decoded block. Stops early if the block has overwritten itself
+// or its neighbours
+template <class Policy>
+force_inline void CPU::RunBlock(Block *block) {
+  BlockCache *cache = this->block_cache;
+  u32 generation = cache->generation;
+  int executed = 0;
+  if (Policy::kActive) {
+    // The steps have uninstrumented handlers, go one instruction at a time
+    for (int i = 0; i < block->num_instructions; i++) {
+      DecodedInstruction *instruction = block->instructions + i;
+      this->PC += instruction->length;
+      ExecuteAnyDecodedOpcode<Policy>(this, instruction->opcode,
+                                      instruction->operand);
+      executed++;
+      if (cache->generation != generation) break;
+    }
+  } else {
+    for (int i = 0; i < block->num_steps; i++) {
+      BlockStep *step = block->steps + i;
+      this->PC += step->length;
+      step->handler(this, step->operand);
+      executed += step->num_instructions;
+      if (cache->generation != generation) break;
+    }
+  }
+  this->instructions += executed;
+}
+
+// Runs a block that spins without side effects (see IdleLoop). Instead of
+// going round and round it works out where the loop will be when the budget
+// runs out or the loop ends, whichever comes first, and goes straight there
+void CPU::RunIdleLoop(Block *block, u64 instruction_limit) {
+  u64 cycles_left = this->cycle_limit - this->cycles;
+  u64 instructions_left = instruction_limit - this->instructions;
+  int instructions_per_iteration = block->num_instructions;
+  u64 iterations = 0;
+  u64 skipped_from = this->cycles;
+
+  if (block->idle_loop == Idle_Countdown) {
+    DecodedInstruction *step = block->instructions;
+    DecodedInstruction *branch = block->instructions + 1;
+    InstructionType type = KnownType(step->opcode);
+    u8 *counter = (type == I_DEX || type == I_INX) ? &this->X : &this->Y;
+    bool down = (type == I_DEX || type == I_DEY);
+
+    // Times the counter changes before it gets to zero
+    int remaining = down ? *counter : 256 - *counter;
+    if (remaining == 0) remaining = 256;
+
+    int not_taken_cycles =
+        gCyclesForOpcode[step->opcode] + gCyclesForOpcode[branch->opcode];
+    bool crosses_page = ((block->last + 1) ^ block->start) > 0xFF;
+    int taken_cycles = not_taken_cycles + (crosses_page ? 2 : 1);
+    iterations = cycles_left / taken_cycles;
+    if (iterations > instructions_left / instructions_per_iteration) {
+      iterations = instructions_left / instructions_per_iteration;
+    }
+    if (iterations >= (u64)remaining) {
+      // Falls through
+      iterations = remaining;
+      *counter = 0;
+      this->PC = (u16)(block->last + 1);
+      this->cycles += (iterations - 1) * taken_cycles + not_taken_cycles;
+    } else if (iterations > 0) {
+      *counter = (u8)(down ? *counter - iterations : *counter + iterations);
+      this->cycles += iterations * taken_cycles;
+    } else {
+      this->RunBlock(block);
+      return;
+    }
+    this->SetNZFor(*counter);
+    this->instructions += iterations * instructions_per_iteration;
+  } else {
+    // Run it once. If it comes back to the start with the registers and
+    // flags as they were, the next time round will be exactly the same, and
+    // so will every other until something changes the memory
+    u8 before[] = {this->A,      this->X,      this->Y,      this->SP,
+                   this->status, this->flag_n, this->flag_z, this->flag_c,
+                   this->flag_v};
+    u64 cycles_before = this->cycles;
+    this->RunBlock(block);
+    u8 after[] = {this->A,      this->X,      this->Y,      this->SP,
+                  this->status, this->flag_n, this->flag_z, this->flag_c,
+                  this->flag_v};
+    if (this->PC != block->start || memcmp(before, after, sizeof(before))) {
+      return;
+    }
+    // A device may have been mapped under it since it was decoded
+    for (int i = 0; i < block->num_instructions; i++) {
+      DecodedInstruction *instruction = block->instructions + i;
+      if (KnownMode(instruction->opcode) == AM_Absolute &&
+          this->bus->read[instruction->operand >> 8] == NULL) {
+        return;
+      }
+    }
+
+    u64 cycles_per_iteration = this->cycles - cycles_before;
+    skipped_from = this->cycles;
+    cycles_left = this->cycle_limit > this->cycles
+                      ? this->cycle_limit - this->cycles
+                      : 0;
+    instructions_left = instruction_limit - this->instructions;
+    iterations = cycles_left / cycles_per_iteration;
+    if (iterations > instructions_left / instructions_per_iteration) {
+      iterations = instructions_left / instructions_per_iteration;
+    }
+    this->cycles += iterations * cycles_per_iteration;
+    this->instructions += iterations * instructions_per_iteration;
+  }
+  this->block_cache->idle_cycles_skipped += this->cycles - skipped_from;
+}
+
+#include "jit.cpp"
+
+#if BUILD_GENERIC_DISPATCH
+global char const *const kDispatchName = "generic";
+
+template <class Policy>
+force_inline void CPU::Step() {
+  u8 opcode = this->memory[this->PC];
+
+  InstructionTypeAndMode instruction = gOpcodeToInstruction[opcode];
+
+  // Default
+  if (instruction.mode == AM_Unknown) {
+    instruction.type = I_NOP;
+    instruction.mode = AM_Implied;
+    print("WARNING: Unknown instruction treated as NOP, opcode %#02x\n",
+          opcode);
+  }
+
+  this->Execute<Policy>(opcode, instruction.type, instruction.mode);
+}
+#else
+global char const *const kDispatchName = "specialized";
+
+template <class Policy>
+force_inline void CPU::Step() {
+  u8 opcode = this->memory[this->PC];
+  if (Policy::kActive) {
+    ExecuteAnyOpcode<Policy>(this, opcode);
+  } else {
+    gOpcodeHandlers[opcode](this);
+  }
+}
+#endif
+
+void CPU::Tick() {
+  this->Step();
+  this->instructions++;
+}
+
+// Executes instructions until one of the budgets runs out or the program ends.
+// With the block cache on, the cycle budget may be overshot by one block, and
+// interrupts are only taken between blocks.
+// Translated code is only used when there's no instruction budget
+template <class Policy>
+StopReason CPU::RunWith(u64 cycle_budget, u64 instruction_budget) {
+  // Keep the registers in a local copy for the whole run
+  CPU cpu = *this;
+  StopReason reason = Stop_BudgetExhausted;
+
+  cpu.cycle_limit = cycle_budget < UINT64_MAX - cpu.cycles
+                        ? cpu.cycles + cycle_budget
+                        : UINT64_MAX;
+  u64 instruction_limit =
+      instruction_budget < UINT64_MAX - cpu.instructions
+          ? cpu.instructions + instruction_budget
+          : UINT64_MAX;
+  bool use_jit = cpu.jit != NULL && cpu.jit->enabled &&
+                 instruction_budget == UINT64_MAX;
+  bool skip_idle_loops =
+      cpu.block_cache != NULL && cpu.block_cache->skip_idle_loops;
+  // Instruments wouldn't see translated code or skipped loops
+  if (Policy::kActive) {
+    use_jit = false;
+    skip_idle_loops = false;
+  }
+
+  while (cpu.cycles < cpu.cycle_limit && cpu.instructions < instruction_limit) {
+    if (cpu.bus->nmi || cpu.bus->irq) {
+      if (cpu.bus->irq & kStopRequest) {
+        cpu.bus->irq &= ~kStopRequest;
+        reason = Stop_Requested;
+        break;
+      }
+      cpu.TakeInterrupt<Policy>();
+      if (!cpu.is_running) {
+        reason = Stop_Error;  // no room on the stack
+        break;
+      }
+    }
+    Block *block = NULL;
+    if (cpu.block_cache != NULL &&
+        instruction_limit - cpu.instructions >= kMaxBlockInstructions) {
+      block = cpu.block_cache->GetBlock(cpu.PC);
+    }
+    if (block == NULL) {
+      cpu.Step<Policy>();
+      cpu.instructions++;
+    } else if (block->idle_loop != Idle_None && skip_idle_loops) {
+      cpu.RunIdleLoop(block, instruction_limit);
+    } else if (use_jit && cpu.jit->IsHot(cpu.block_cache, block)) {
+      cpu.jit->Execute(&cpu, block);
+      use_jit = cpu.jit->enabled;
+    } else {
+      cpu.RunBlock<Policy>(block);
+    }
+    if (!cpu.is_running) {
+      reason = cpu.error == CPUError_None ? Stop_Halted : Stop_Error;
+      break;
+    }
+  }
+
+  *this = cpu;
+  return reason;
+}
+
+typedef StopReason (*Runner)(CPU *, u64 cycle_budget, u64 instruction_budget);
+
+template <u32 instruments>
+static StopReason RunInstrumented(CPU *cpu, u64 cycle_budget,
+                                  u64 instruction_budget) {
+  typedef typename InstrumentSet<instruments>::Policy Policy;
+  return cpu->RunWith<Policy>(cycle_budget, instruction_budget);
+}
+
+// One run loop for every combination of instruments
+global Runner const gRunners[kNumInstrumentSets] = {
+    &RunInstrumented<0>,
+    &RunInstrumented<1>,
+    &RunInstrumented<2>,
+    &RunInstrumented<3>,
+    &RunInstrumented<4>,
+    &RunInstrumented<5>,
+    &RunInstrumented<6>,
+    &RunInstrumented<7>,
+    &RunInstrumented<8>,
+    &RunInstrumented<9>,
+    &RunInstrumented<10>,
+    &RunInstrumented<11>,
+    &RunInstrumented<12>,
+    &RunInstrumented<13>,
+    &RunInstrumented<14>,
+    &RunInstrumented<15>,
+};
+static_assert(kNumInstrumentSets == 16, "gRunners needs an entry per set");
+
+StopReason CPU::Run(u64 cycle_budget, u64 instruction_budget) {
+  Assert(!(this->instruments & Instrument_Trace) || this->trace);
+  Assert(!(this->instruments & Instrument_Profile) || this->profile);
+  Assert(!(this->instruments & Instrument_Heatmap) || this->heatmap);
+  Assert(!(this->instruments & Instrument_Digest) || this->digest);
+  return gRunners[this->instruments](this, cycle_budget, instruction_budget);
+}
+
+// ================= Machine ==================
+
+// The video side has a page of registers. A frame is drawn every
+// kCyclesPerFrame cycles and at the end of it (vblank) the frame counter goes
+// up and, if the program asked for it, an NMI is raised. Vblank is an event
+// on the machine's scheduler
+global u16 const kVideoControl = 0xFE00;  // bit 7: NMI on vblank
+global u16 const kVideoFrame = 0xFE01;    // frame counter, read only
+global u8 const kVideoControlNMI = 0x80;
+global u64 const kCyclesPerFrame = kCPUFrequency / 60;
+
+struct InputDevice;  // see input.cpp
+
+// A whole computer: the CPU, its memory and what's loaded into it. Machines
+// don't share anything, so any number of them can live in one process
+struct Machine {
+  CPU cpu;
+  MemoryBus bus;     // all RAM to begin with, plus the video registers
+  Scheduler scheduler;
+  u8 *memory;        // kMachineMemorySize bytes, mirrored
+  u8 *video_memory;  // kWindowWidth * kWindowHeight bytes inside memory
+  char error[256];   // set when LoadProgram or Run fails
+  SourceMap *source_map;  // filled in by LoadProgram if it's not NULL
+  Watchpoints *watchpoints;  // made by the first Watch
+  InputDevice *input;        // set by ConnectInput
+
+  u8 video_control;
+  volatile u64 frame;  // frames so far, the platform thread reads it too
+
+  bool LoadProgram(char *filename, u16 address);
+  bool LoadSource(char const *text, char const *name, u16 address);
+  bool FinishLoading(bool ok, char const *name, AsmError *error);
+  StopReason Run(u64 cycle_budget, u64 instruction_budget = UINT64_MAX);
+  bool Watch(u16 address, u16 length, bool pause);
+};
+
+static void Vblank(void *context, u64 time) {
+  Machine *machine = (Machine *)context;
+  AtomicStore(&machine->frame, machine->frame + 1);
+  if (machine->video_control & kVideoControlNMI) {
+    machine->bus.RaiseNMI();
+  }
+  machine->scheduler.Schedule(time + kCyclesPerFrame, Vblank, machine);
+}
+
+static u8 ReadVideoRegister(void *context, u16 address) {
+  Machine *machine = (Machine *)context;
+  if (address == kVideoControl) return machine->video_control;
+  if (address == kVideoFrame) return (u8)machine->frame;
+  return 0;
+}
+
+static void WriteVideoRegister(void *context, u16 address, u8 value) {
+  Machine *machine = (Machine *)context;
+  if (address == kVideoControl) machine->video_control = value;
+}
+
+// instruments are Instrument flags. The tools they need have to be attached
+// to the CPU before it runs. Returns NULL if out of memory
+static Machine *NewMachine(u32 instruments = 0) {
+  Machine *machine = (Machine *)calloc(1, sizeof(Machine));
+  if (machine == NULL) return NULL;
+  machine->memory = AllocateMirroredMemory();
+  if (machine->memory == NULL) {
+    free(machine);
+    return NULL;
+  }
+  machine->video_memory = machine->memory + kVideoMemoryStart;
+  machine->bus.Init(machine->memory);
+  Device video = {ReadVideoRegister, WriteVideoRegister, machine};
+  machine->bus.MapDevice(kVideoControl >> 8, 1, video);
+  machine->cpu = CPU(&machine->bus);
+  machine->cpu.instruments = instruments;
+  machine->scheduler.Schedule(kCyclesPerFrame, Vblank, machine);
+  return machine;
+}
+
+static void FreeMachine(Machine *machine) {
+  if (machine->cpu.jit != NULL) {
+    FreeJit(machine->cpu.jit);
+  }
+  if (machine->cpu.block_cache != NULL) {
+    FreeBlockCache(machine->cpu.block_cache);
+  }
+  if (machine->cpu.profile != NULL) {
+    FreeProfile(machine->cpu.profile);
+  }
+  if (machine->cpu.heatmap != NULL) {
+    FreeHeatmap(machine->cpu.heatmap);
+  }
+  if (machine->cpu.digest != NULL) {
+    FreeStateDigest(machine->cpu.digest);
+  }
+  if (machine->watchpoints != NULL) {
+    FreeWatchpoints(machine->watchpoints);
+  }
+  free(machine->input);
+  free(machine->source_map);
+  FreeMirroredMemory(machine->memory);
+  free(machine);
+}
+
+bool Machine::LoadProgram(char *filename, u16 address) {
+  AsmError error;
+  bool ok = ::LoadProgram(this->memory, filename, address, &error,
+                          this->source_map);
+  return this->FinishLoading(ok, filename, &error);
+}
+
+// Assembles a program that's in memory, name is only for errors
+bool Machine::LoadSource(char const *text, char const *name, u16 address) {
+  AsmError error;
+  bool ok = AssembleSource(this->memory, text, address, &error);
+  return this->FinishLoading(ok, name, &error);
+}
+
+bool Machine::FinishLoading(bool ok, char const *name, AsmError *error) {
+  if (!ok) {
+    if (error->line_num > 0) {
+      snprintf(this->error, sizeof(this->error),
+               "Syntax error in %s at line %d: %s", name, error->line_num,
+               error->message);
+    } else {
+      snprintf(this->error, sizeof(this->error), "%s", error->message);
     }
+    return false;
+  }
+  if (this->cpu.block_cache != NULL) {
+    this->cpu.block_cache->Reset();
+  }
+  return true;
+}
+
+// Runs the CPU in stretches that end at the next scheduled event
+StopReason Machine::Run(u64 cycle_budget, u64 instruction_budget) {
+  CPU *cpu = &this->cpu;
+  u64 cycle_limit = cycle_budget < UINT64_MAX - cpu->cycles
+                        ? cpu->cycles + cycle_budget
+                        : UINT64_MAX;
+  u64 instruction_limit =
+      instruction_budget < UINT64_MAX - cpu->instructions
+          ? cpu->instructions + instruction_budget
+          : UINT64_MAX;
+
+  StopReason reason = Stop_BudgetExhausted;
+  while (cpu->cycles < cycle_limit && cpu->instructions < instruction_limit) {
+    // Whatever got scheduled for the past
+    this->scheduler.FireDue(cpu->cycles);
+    u64 deadline = this->scheduler.NextDeadline();
+    u64 until = cycle_limit < deadline ? cycle_limit : deadline;
+    // An unlimited instruction budget stays unlimited, see CPU::Run
+    u64 instructions = instruction_budget == UINT64_MAX
+                           ? UINT64_MAX
+                           : instruction_limit - cpu->instructions;
+    reason = cpu->Run(until - cpu->cycles, instructions);
+    this->scheduler.FireDue(cpu->cycles);
+    if (reason != Stop_BudgetExhausted) break;
+  }
+
+  if (reason == Stop_Error) {
+    snprintf(this->error, sizeof(this->error),
+             "CPU error: %s, opcode %#02x (PC=$%04X)",
+             CPUErrorString(this->cpu.error), this->cpu.error_opcode,
+             this->cpu.PC);
+  }
+  return reason;
+}
+
+// Watches stores to [address, address + length). Hits are in
+// watchpoints->hits, with pause the CPU stops too (Stop_Requested).
+// Returns false if watchpoints don't work here or there are too many
+bool Machine::Watch(u16 address, u16 length, bool pause) {
+  if (this->watchpoints == NULL) {
+    this->watchpoints = NewWatchpoints(this->memory, &this->bus);
+    if (this->watchpoints == NULL) return false;
   }
+  return this->watchpoints->Add(address, length, pause);
+}
+
+#include "input.cpp"
+
+// ================= Wall-clock pacing ==================
+
+// Keeps the emulated clock in step with the wall clock. The machine thread
+// runs one slice worth of cycles, then sleeps once for the rest of the slice
+struct Pacer {
+  r64 speed;  // multiple of kCPUFrequency, 0 = unthrottled
+  r64 slice_seconds;
+
+  r64 start_time;
+  u64 start_cycles;
+
+  Pacer(r64 speed, r64 now, u64 cycles);
+  u64 SliceCycles();
+  r64 SecondsToSleep(r64 now, u64 cycles);
+};
+
+Pacer::Pacer(r64 speed, r64 now, u64 cycles) {
+  this->speed = speed;
+  this->slice_seconds = 0.001;  // 1 ms
+  this->start_time = now;
+  this->start_cycles = cycles;
+}
+
+u64 Pacer::SliceCycles() {
+  if (this->speed <= 0) {
+    return kCPUFrequency / 10;  // unthrottled, just keep the slices coarse
+  }
+  u64 result = (u64)(kCPUFrequency * this->speed * this->slice_seconds);
+  return result > 0 ? result : 1;
+}
+
+r64 Pacer::SecondsToSleep(r64 now, u64 cycles) {
+  if (this->speed <= 0) return 0;
+
+  r64 emulated_seconds =
+      (r64)(cycles - this->start_cycles) / (kCPUFrequency * this->speed);
+  r64 ahead = emulated_seconds - (now - this->start_time);
+
+  if (ahead < -0.1) {
+    // We've fallen too far behind (e.g. the thread wasn't scheduled).
+    // Don't try to catch up in a burst, just start counting from here
+    this->start_time = now;
+    this->start_cycles = cycles;
+    return 0;
+  }
+
+  return ahead;
 }
@@ -0,0 +1,334 @@
+// ================= Watchpoints ==================
+#ifndef WATCHPOINTS_CPP
+#define WATCHPOINTS_CPP
+
+// Watchpoints catch stores to a few addresses without the CPU checking
+// anything. The host pages under the watched addresses are made read-only in
+// both views of the machine memory, so a store there faults. The fault
+// handler works out which emulated address it was and notes the hit. Then it
+// lets the store through: it opens the page, single-steps the host
+// instruction with the trap flag and closes the page again.
+//
+// Code that doesn't store near a watched address runs at full speed. But a
+// host page is 4K, i.e. 16 emulated pages, and every other store to it pays
+// for two signals. Fine for chasing a bug, not for benchmarks.
+//
+// A watchpoint that pauses asks the CPU to stop (see MemoryBus::RequestStop).
+// That happens after the instruction, or at the end of the block with the
+// block cache on. Translated code only stops at the end of its run.
+//
+// Hits are recorded by whichever thread stored, so read them from the
+// machine's thread between runs. Needs the x86-64 trap flag.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define WATCHPOINTS_SUPPORTED 1
+#else
+#define WATCHPOINTS_SUPPORTED 0
+#endif
+
+#ifdef BUILD_WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+global int const kMaxWatchpoints = 16;
+global int const kMaxWatchHits = 1024;  // more are only counted
+global int const kMaxWatchedMachines = 16;
+global int const kMaxOpenPages = 4;  // per host instruction
+global u64 const kTrapFlag = 0x100;  // in RFLAGS
+
+struct Watchpoint {
+  u16 address;
+  u16 length;
+  bool pause;
+  u64 hits;
+};
+
+struct WatchHit {
+  u16 address;
+  u8 old_value;
+  u8 new_value;
+};
+
+struct Watchpoints {
+  u8 *memory;  // the machine's, mirrored
+  MemoryBus *bus;
+  Watchpoint list[kMaxWatchpoints];
+  int count;
+
+  // Filled in by the fault handler
+  WatchHit hits[kMaxWatchHits];
+  int num_hits;
+  u64 hits_lost;    // didn't fit
+  u64 near_misses;  // stores to the same host page, the price of it all
+
+  bool Add(u16 address, u16 length, bool pause);
+  void Remove(u16 address);
+  int Find(u16 address);
+  void ProtectPages(bool on);
+};
+
+// A store that's being single-stepped
+struct OpenPage {
+  Watchpoints *watchpoints;
+  u8 *page;
+  int watchpoint;  // -1 if it wasn't to a watched byte
+  u16 address;
+  u8 old_value;
+};
+
+global u32 gHostPageSize;
+global Watchpoints *gWatchedMachines[kMaxWatchedMachines];
+static thread_local OpenPage tOpenPages[kMaxOpenPages];
+static thread_local int tNumOpenPages;
+
+static bool ProtectHostPage(u8 *page, bool read_only) {
+#ifdef BUILD_WIN32
+  DWORD old;
+  return VirtualProtect(page, gHostPageSize,
+                        read_only ? PAGE_READONLY : PAGE_READWRITE, &old) != 0;
+#else
+  int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  return mprotect(page, gHostPageSize, prot) == 0;
+#endif
+}
+
+// Returns the index of the watchpoint covering address, or -1
+int Watchpoints::Find(u16 address) {
+  for (int i = 0; i < this->count; i++) {
+    Watchpoint *watchpoint = this->list + i;
+    if ((u16)(address - watchpoint->address) < watchpoint->length) return i;
+  }
+  return -1;
+}
+
+// Makes the host pages that have a watchpoint read-only and the rest
+// writable. With on = false they're all writable
+void Watchpoints::ProtectPages(bool on) {
+  for (u32 start = 0; start < (u32)kMachineMemorySize; start += gHostPageSize) {
+    bool watched = false;
+    for (int i = 0; on && i < this->count; i++) {
+      Watchpoint *watchpoint = this->list + i;
+      u32 end = watchpoint->address + watchpoint->length;  // may be past $FFFF
+      for (u32 a = watchpoint->address; a < end && !watched; a++) {
+        watched = (a & 0xFFFF) / gHostPageSize == start / gHostPageSize;
+      }
+    }
+    ProtectHostPage(this->memory + start, watched);
+    ProtectHostPage(this->memory + kMachineMemorySize + start, watched);
+  }
+}
+
+// Returns false if there are too many
+bool Watchpoints::Add(u16 address, u16 length, bool pause) {
+  if (this->count >= kMaxWatchpoints || length == 0) return false;
+  Watchpoint *watchpoint = this->list + this->count++;
+  watchpoint->address = address;
+  watchpoint->length = length;
+  watchpoint->pause = pause;
+  watchpoint->hits = 0;
+  this->ProtectPages(true);
+  return true;
+}
+
+void Watchpoints::Remove(u16 address) {
+  for (int i = 0; i < this->count; i++) {
+    if (this->list[i].address == address) {
+      this->list[i] = this->list[--this->count];
+      break;
+    }
+  }
+  this->ProtectPages(true);
+}
+
+// Opens the page for a store that faulted. Returns false if it's not one of
+// ours, or if one instruction touched too many pages
+static bool OpenWatchedPage(u8 *fault_address) {
+  for (int i = 0; i < kMaxWatchedMachines; i++) {
+    Watchpoints *watchpoints = gWatchedMachines[i];
+    if (watchpoints == NULL) continue;
+    u8 *memory = watchpoints->memory;
+    if (fault_address < memory ||
+        fault_address >= memory + 2 * kMachineMemorySize) {
+      continue;
+    }
+    if (tNumOpenPages >= kMaxOpenPages) return false;
+    u64 offset = (u64)(fault_address - memory);
+    OpenPage *open = tOpenPages + tNumOpenPages++;
+    open->watchpoints = watchpoints;
+    open->page = memory + (offset & ~(u64)(gHostPageSize - 1));
+    open->address = (u16)offset;
+    open->watchpoint = watchpoints->Find(open->address);
+    open->old_value = memory[open->address];
+    ProtectHostPage(open->page, false);
+    return true;
+  }
+  return false;
+}
+
+// After the store went through. Returns false if no page was open
+static bool CloseWatchedPages() {
+  if (tNumOpenPages == 0) return false;
+  for (int i = 0; i < tNumOpenPages; i++) {
+    OpenPage *open = tOpenPages + i;
+    Watchpoints *watchpoints = open->watchpoints;
+    ProtectHostPage(open->page, true);
+    if (open->watchpoint < 0) {
+      watchpoints->near_misses++;
+      continue;
+    }
+    Watchpoint *watchpoint = watchpoints->list + open->watchpoint;
+    watchpoint->hits++;
+    if (watchpoints->num_hits < kMaxWatchHits) {
+      WatchHit *hit = watchpoints->hits + watchpoints->num_hits++;
+      hit->address = open->address;
+      hit->old_value = open->old_value;
+      hit->new_value = watchpoints->memory[open->address];
+    } else {
+      watchpoints->hits_lost++;
+    }
+    if (watchpoint->pause) {
+      watchpoints->bus->RequestStop();
+    }
+  }
+  tNumOpenPages = 0;
+  return true;
+}
+
+#if WATCHPOINTS_SUPPORTED && defined(BUILD_WIN32)
+
+static LONG CALLBACK WatchExceptionHandler(EXCEPTION_POINTERS *info) {
+  EXCEPTION_RECORD *record = info->ExceptionRecord;
+  if (record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION &&
+      record->ExceptionInformation[0] == 1) {  // a write
+    if (OpenWatchedPage((u8 *)record->ExceptionInformation[1])) {
+      info->ContextRecord->EFlags |= kTrapFlag;
+      return EXCEPTION_CONTINUE_EXECUTION;
+    }
+  } else if (record->ExceptionCode == EXCEPTION_SINGLE_STEP) {
+    if (CloseWatchedPages()) {
+      info->ContextRecord->EFlags &= ~kTrapFlag;
+      return EXCEPTION_CONTINUE_EXECUTION;
+    }
+  }
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static bool InstallWatchHandlers() {
+  SYSTEM_INFO system;
+  GetSystemInfo(&system);
+  gHostPageSize = system.dwPageSize;
+  return AddVectoredExceptionHandler(1, WatchExceptionHandler) != NULL;
+}
+
+#elif WATCHPOINTS_SUPPORTED
+
+global struct sigaction gPreviousSegvAction;
+global struct sigaction gPreviousTrapAction;
+
+// Hands a signal that isn't ours to whoever had it before. Our handler
+// stays, so watchpoints keep working afterwards
+static void PassSignalOn(int signal, siginfo_t *info, void *context,
+                         struct sigaction *previous) {
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(signal, info, context);
+    return;
+  }
+  void (*handler)(int) = previous->sa_handler;
+  // A fault can't be ignored, it would only happen again
+  if (handler == SIG_IGN && signal == SIGTRAP) return;
+  if (handler == SIG_DFL || handler == SIG_IGN) {
+    // Let the default action have it. A fault happens again when the
+    // handler returns, a trap doesn't
+    struct sigaction action = {};
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+    if (signal == SIGTRAP) raise(signal);
+    return;
+  }
+  handler(signal);
+}
+
+static void WatchSignalHandler(int signal, siginfo_t *info, void *context) {
+  greg_t *flags = &((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL];
+  if (signal == SIGSEGV) {
+    if (OpenWatchedPage((u8 *)info->si_addr)) {
+      *flags |= kTrapFlag;
+    } else {
+      PassSignalOn(signal, info, context, &gPreviousSegvAction);
+    }
+  } else {
+    if (CloseWatchedPages()) {
+      *flags &= ~kTrapFlag;
+    } else {
+      PassSignalOn(signal, info, context, &gPreviousTrapAction);
+    }
+  }
+}
+
+static bool InstallWatchHandlers() {
+  gHostPageSize = (u32)sysconf(_SC_PAGESIZE);
+  struct sigaction action = {};
+  action.sa_sigaction = WatchSignalHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGSEGV, &action, &gPreviousSegvAction) == 0 &&
+         sigaction(SIGTRAP, &action, &gPreviousTrapAction) == 0;
+}
+
+#else
+
+static bool InstallWatchHandlers() { return false; }
+
+#endif
+
+// Returns NULL if watchpoints don't work here, or if too many machines
+// are watched already
+static Watchpoints *NewWatchpoints(u8 *memory, MemoryBus *bus) {
+  local_persist bool installed = false;
+  if (!installed) {
+    if (!InstallWatchHandlers()) return NULL;
+    installed = true;
+  }
+  if (gHostPageSize > (u32)kMachineMemorySize) return NULL;
+  int slot = 0;
+  while (slot < kMaxWatchedMachines && gWatchedMachines[slot] != NULL) slot++;
+  if (slot == kMaxWatchedMachines) return NULL;
+
+  Watchpoints *watchpoints = (Watchpoints *)calloc(1, sizeof(Watchpoints));
+  if (watchpoints == NULL) return NULL;
+  watchpoints->memory = memory;
+  watchpoints->bus = bus;
+  gWatchedMachines[slot] = watchpoints;
+  return watchpoints;
+}
+
+static void FreeWatchpoints(Watchpoints *watchpoints) {
+  watchpoints->ProtectPages(false);
+  for (int i = 0; i < kMaxWatchedMachines; i++) {
+    if (gWatchedMachines[i] == watchpoints) gWatchedMachines[i] = NULL;
+  }
+  free(watchpoints);
+}
+
+// Prints the hits since the last time and forgets them
+static void PrintWatchHits(Watchpoints *watchpoints) {
+  for (int i = 0; i < watchpoints->num_hits; i++) {
+    WatchHit *hit = watchpoints->hits + i;
+    print("Watchpoint: $%04X written, $%02X -> $%02X\n", hit->address,
+          hit->old_value, hit->new_value);
+  }
+  if (watchpoints->hits_lost > 0) {
+    print("Watchpoint: %llu more hits not shown\n",
+          (unsigned long long)watchpoints->hits_lost);
+  }
+  watchpoints->num_hits = 0;
+  watchpoints->hits_lost = 0;
+}
+
+#endif  // WATCHPOINTS_CPP
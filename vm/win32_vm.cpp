@@ -2,6 +2,7 @@
 
 global void *gWindowsBitmapMemory;
 global volatile bool32 gRunning;
+global r64 gSpeed = 1.0;  // multiple of the emulated clock, 0 = unthrottled
 
 #include "vm.cpp"
 
@@ -9,6 +10,7 @@ global volatile bool32 gRunning;
 #include <intrin.h>
 
 global BITMAPINFO GlobalBitmapInfo;
+global Machine *gMachine;  // the one shown in the window
 
 void Win32Print(char *String) {
   // A hack to allow calling print() in functions above
@@ -16,12 +18,12 @@ void Win32Print(char *String) {
 }
 
 static void Win32UpdateWindow(HDC hdc) {
-  if (!gWindowsBitmapMemory) return;
+  if (!gWindowsBitmapMemory || !gMachine) return;
 
   // Copy data from the machine's video memory to our "display"
   for (int y = 0; y < kWindowHeight; y++) {
     for (int x = 0; x < kWindowWidth; x++) {
-      u8 *SrcPixel = gVideoMemory + kWindowWidth * y + x;
+      u8 *SrcPixel = gMachine->video_memory + kWindowWidth * y + x;
       u32 *DestPixel = (u32 *)gWindowsBitmapMemory + (kWindowWidth * y + x);
       *DestPixel = GetColor(*SrcPixel);
     }
@@ -63,14 +65,40 @@ Win32WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
   return Result;
 }
 
-DWORD WINAPI MachineThread(LPVOID lpParam) {
-  CPU cpu = CPU();
+static r64 Win32GetWallClock() {
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (r64)counter.QuadPart / (r64)frequency.QuadPart;
+}
 
-  while (cpu.is_running) {
-    cpu.Tick();
+DWORD WINAPI MachineThread(LPVOID lpParam) {
+  Machine *machine = (Machine *)lpParam;
+  CPU *cpu = &machine->cpu;
+  r64 start_time = Win32GetWallClock();
+  Pacer pacer = Pacer(gSpeed, start_time, cpu->cycles);
+
+  while (cpu->is_running) {
+    if (machine->Run(pacer.SliceCycles()) == Stop_Error) {
+      print("%s\n", machine->error);
+      break;
+    }
+    r64 seconds = pacer.SecondsToSleep(Win32GetWallClock(), cpu->cycles);
+    // Sleep only has millisecond resolution
+    if (seconds >= 0.001) {
+      Sleep((DWORD)(seconds * 1000));
+    }
   }
 
+  r64 elapsed = Win32GetWallClock() - start_time;
   print("CPU has finished work\n");
+  print("%llu instructions in %.3f s, %.0f instructions/s (%s dispatch)\n",
+        cpu->instructions, elapsed, cpu->instructions / elapsed, kDispatchName);
+  if (cpu->block_cache) {
+    cpu->block_cache->PrintFusionReport();
+    print("Idle loops: %llu cycles skipped\n",
+          cpu->block_cache->idle_cycles_skipped);
+  }
 
   return 0;
 }
@@ -116,10 +144,17 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 
       gRunning = true;
 
-      // Init memory
-      gMachineMemory =
-          VirtualAlloc(0, kMachineMemorySize, MEM_COMMIT, PAGE_READWRITE);
-      gVideoMemory = (u8 *)gMachineMemory + 0x0200;
+      Machine *machine = NewMachine();
+      if (machine == NULL) {
+        print("Not enough memory for the machine\n");
+        return 1;
+      }
+      machine->cpu.block_cache = NewBlockCache(&machine->bus);
+      if (machine->cpu.block_cache == NULL) {
+        print("Not enough memory for the block cache\n");
+        FreeMachine(machine);
+        return 1;
+      }
 
       gWindowsBitmapMemory =
           VirtualAlloc(0, kWindowWidth * kWindowHeight * sizeof(u32),
@@ -134,10 +169,16 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
       GlobalBitmapInfo.bmiHeader.biCompression = BI_RGB;
 
       // Load the program
-      LoadProgram("test/pong.s", kPC_start);
+      if (!machine->LoadProgram("test/pong.s", kPC_start)) {
+        print("%s\n", machine->error);
+        FreeMachine(machine);
+        return 1;
+      }
+      gMachine = machine;
 
       // Run the machine
-      HANDLE MainMachineThread = CreateThread(0, 0, MachineThread, 0, 0, 0);
+      HANDLE MainMachineThread =
+          CreateThread(0, 0, MachineThread, machine, 0, 0);
 
       // Event loop
       while (gRunning) {